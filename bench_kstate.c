@@ -0,0 +1,425 @@
+/*
+ * Benchmarks for kstate.
+ *
+ * Each benchmark runs in several processes sharing one state, and prints a
+ * single line of results, as a JSON object, so that the output can be
+ * compared against that of an earlier version (for instance, with a script
+ * that reads one object per line).
+ *
+ * Usage:
+ *
+ *     bench_kstate [-n <iterations>] [-r <max readers>] [-w <max writers>]
+ *
+ * Run it with "make bench".
+ */
+
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS State library.
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2013
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *   Tony Ibbs <tibs@tonyibbs.co.uk>
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "kstate.h"
+
+// The most samples any one process keeps
+#define MAX_SAMPLES     100000
+#define MAX_PROCS       64
+
+// What the processes in a benchmark share, in an anonymous shared mapping
+// made before they fork
+struct shared {
+  volatile uint32_t ready;      // How many children are ready to go
+  volatile uint32_t go;         // Set when they should start
+  volatile uint32_t stop;       // Set when the readers should stop
+  volatile uint32_t sampling;   // How many readers have taken a sample
+  uint32_t  num_samples[MAX_PROCS];
+  uint64_t  samples[MAX_PROCS][MAX_SAMPLES];
+};
+
+static struct shared *shared = NULL;
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+  uint64_t aa = *(const uint64_t *)a;
+  uint64_t bb = *(const uint64_t *)b;
+  return aa < bb ? -1 : aa > bb ? 1 : 0;
+}
+
+/*
+ * Sort the samples from processes 'first' to 'last' (inclusive) together,
+ * and print percentiles of them, prefixed by 'name'.
+ */
+static void print_percentiles(const char *name, int first, int last)
+{
+  size_t total = 0;
+  int ii;
+  for (ii = first; ii <= last; ii++)
+    total += shared->num_samples[ii];
+
+  uint64_t *all = malloc((total + 1) * sizeof(uint64_t));
+  if (all == NULL) {
+    fprintf(stderr, "!!! bench_kstate: Cannot allocate %zu samples\n", total);
+    exit(1);
+  }
+  size_t count = 0;
+  for (ii = first; ii <= last; ii++) {
+    memcpy(&all[count], shared->samples[ii],
+           shared->num_samples[ii] * sizeof(uint64_t));
+    count += shared->num_samples[ii];
+  }
+  qsort(all, count, sizeof(uint64_t), cmp_uint64);
+
+  if (count == 0) {
+    printf(", \"%s_samples\": 0", name);
+  } else {
+    printf(", \"%s_samples\": %zu, \"%s_p50_ns\": %llu, \"%s_p90_ns\": %llu,"
+           " \"%s_p99_ns\": %llu, \"%s_max_ns\": %llu",
+           name, count,
+           name, (unsigned long long)all[count / 2],
+           name, (unsigned long long)all[count * 9 / 10],
+           name, (unsigned long long)all[count * 99 / 100],
+           name, (unsigned long long)all[count - 1]);
+  }
+  free(all);
+}
+
+static void record(int proc, uint64_t ns)
+{
+  uint32_t n = shared->num_samples[proc];
+  if (n < MAX_SAMPLES) {
+    shared->samples[proc][n] = ns;
+    shared->num_samples[proc] = n + 1;
+  }
+}
+
+static void wait_for_go(void)
+{
+  __atomic_add_fetch(&shared->ready, 1, __ATOMIC_SEQ_CST);
+  while (!__atomic_load_n(&shared->go, __ATOMIC_SEQ_CST))
+    sched_yield();
+}
+
+static void start_children_and_go(uint32_t num_children)
+{
+  while (__atomic_load_n(&shared->ready, __ATOMIC_SEQ_CST) < num_children)
+    sched_yield();
+  __atomic_store_n(&shared->go, 1, __ATOMIC_SEQ_CST);
+}
+
+static int wait_for_children(pid_t *pids, int num_children)
+{
+  int failures = 0;
+  int ii;
+  for (ii = 0; ii < num_children; ii++) {
+    int status;
+    waitpid(pids[ii], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failures ++;
+  }
+  return failures;
+}
+
+/*
+ * Give up on a benchmark, telling any readers to stop, and letting any
+ * children still waiting to start get going, and then waiting for them all,
+ * so that none of them is left spinning after we exit.
+ */
+static void stop_children_and_fail(pid_t *pids, int num_children)
+{
+  __atomic_store_n(&shared->stop, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&shared->go, 1, __ATOMIC_SEQ_CST);
+  wait_for_children(pids, num_children);
+  exit(1);
+}
+
+static kstate_state_p new_subscribed_state(size_t size)
+{
+  char *name = kstate_get_unique_name("bench");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_size(state, size);
+  if (rv == 0)
+    rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  free(name);
+  if (rv) {
+    fprintf(stderr, "!!! bench_kstate: Cannot subscribe to a state of"
+            " size %zu: %d %s\n", size, -rv, strerror(-rv));
+    exit(1);
+  }
+  return state;
+}
+
+/*
+ * A reader, which looks at the state (using a read transaction) as often as
+ * it can, until told to stop, and records how long each look takes.
+ */
+static void reader(int proc, kstate_state_p state)
+{
+  kstate_transaction_p transaction = kstate_new_transaction();
+  volatile uint32_t sum = 0;
+  wait_for_go();
+  while (!__atomic_load_n(&shared->stop, __ATOMIC_SEQ_CST)) {
+    uint64_t start = now_ns();
+    if (kstate_start_transaction(transaction, state, KSTATE_READ)) {
+      // Don't leave the writer waiting for our first sample
+      if (shared->num_samples[proc] == 0)
+        __atomic_add_fetch(&shared->sampling, 1, __ATOMIC_SEQ_CST);
+      _exit(1);
+    }
+    uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+    sum += ptr[0];
+    kstate_abort_transaction(transaction);
+    record(proc, now_ns() - start);
+    if (shared->num_samples[proc] == 1)
+      __atomic_add_fetch(&shared->sampling, 1, __ATOMIC_SEQ_CST);
+  }
+  _exit(0);
+}
+
+/*
+ * One writer committing 'iterations' transactions as fast as it can, with
+ * 'num_readers' readers looking at the state at the same time.
+ *
+ * The writer only starts once every reader is sampling, as otherwise a
+ * small state's commits can all be over before the readers get going.
+ */
+static void bench_single_writer(size_t size, int num_readers, int iterations)
+{
+  memset(shared, 0, sizeof(*shared));
+  kstate_state_p state = new_subscribed_state(size);
+
+  pid_t pids[MAX_PROCS];
+  int ii;
+  for (ii = 0; ii < num_readers; ii++) {
+    pids[ii] = fork();
+    if (pids[ii] < 0) {
+      perror("!!! bench_kstate: fork");
+      stop_children_and_fail(pids, ii);
+    } else if (pids[ii] == 0) {
+      reader(1 + ii, state);
+    }
+  }
+  start_children_and_go(num_readers);
+  while (__atomic_load_n(&shared->sampling, __ATOMIC_SEQ_CST) <
+         (uint32_t)num_readers)
+    sched_yield();
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  uint64_t start = now_ns();
+  for (ii = 0; ii < iterations; ii++) {
+    uint64_t t0 = now_ns();
+    int rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+    if (rv == 0) {
+      uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+      ptr[0] = ii + 1;
+      rv = kstate_commit_transaction(transaction);
+    }
+    if (rv) {
+      fprintf(stderr, "!!! bench_kstate: Writer failed after %d commits:"
+              " %d %s\n", ii, -rv, strerror(-rv));
+      stop_children_and_fail(pids, num_readers);
+    }
+    record(0, now_ns() - t0);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  __atomic_store_n(&shared->stop, 1, __ATOMIC_SEQ_CST);
+  // The readers have all gone by now, so it's safe to give up
+  int failures = wait_for_children(pids, num_readers);
+  for (ii = 0; ii < num_readers; ii++) {
+    if (shared->num_samples[1 + ii] == 0) {
+      fprintf(stderr, "!!! bench_kstate: Reader %d took no samples\n", ii);
+      exit(1);
+    }
+  }
+
+  printf("{\"bench\": \"single_writer\", \"size\": %zu, \"readers\": %d,"
+         " \"commits\": %d, \"elapsed_ns\": %llu, \"commits_per_sec\": %.0f",
+         size, num_readers, iterations, (unsigned long long)elapsed,
+         iterations * 1e9 / elapsed);
+  print_percentiles("commit", 0, 0);
+  if (num_readers)
+    print_percentiles("read", 1, num_readers);
+  printf(", \"failures\": %d}\n", failures);
+  fflush(stdout);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+
+static int increment_fn(kstate_transaction_p transaction, void *ptr, void *data)
+{
+  (void) transaction;
+  (void) data;
+  uint32_t *value = ptr;
+  (*value) ++;
+  return 0;
+}
+
+/*
+ * 'num_writers' writers, each incrementing the same counter in the state
+ * 'iterations' times, retrying (with the default backoff) whenever they
+ * conflict.
+ */
+static void bench_many_writers(size_t size, int num_writers, int iterations)
+{
+  memset(shared, 0, sizeof(*shared));
+  kstate_state_p state = new_subscribed_state(size);
+
+  pid_t pids[MAX_PROCS];
+  int ii;
+  for (ii = 0; ii < num_writers; ii++) {
+    pids[ii] = fork();
+    if (pids[ii] < 0) {
+      perror("!!! bench_kstate: fork");
+      stop_children_and_fail(pids, ii);
+    } else if (pids[ii] == 0) {
+      int jj;
+      wait_for_go();
+      for (jj = 0; jj < iterations; jj++) {
+        struct kstate_retry retry = { UINT32_MAX, NULL, NULL, 0 };
+        uint64_t t0 = now_ns();
+        if (kstate_transaction_using_fn(state, increment_fn, NULL, &retry))
+          _exit(1);
+        record(ii, now_ns() - t0);
+      }
+      _exit(0);
+    }
+  }
+  uint64_t start = now_ns();
+  start_children_and_go(num_writers);
+  int failures = wait_for_children(pids, num_writers);
+  uint64_t elapsed = now_ns() - start;
+
+  uint32_t *value = kstate_get_state_ptr(state);
+  if (*value != (uint32_t)(num_writers * iterations))
+    failures ++;
+
+  struct kstate_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  kstate_get_state_stats(state, &stats);
+
+  int total = num_writers * iterations;
+  printf("{\"bench\": \"many_writers\", \"size\": %zu, \"writers\": %d,"
+         " \"commits\": %d, \"elapsed_ns\": %llu, \"commits_per_sec\": %.0f,"
+         " \"conflicts\": %llu, \"busy\": %llu, \"retries\": %llu",
+         size, num_writers, total, (unsigned long long)elapsed,
+         total * 1e9 / elapsed,
+         (unsigned long long)stats.conflicts,
+         (unsigned long long)stats.busy,
+         (unsigned long long)stats.retries);
+  print_percentiles("commit", 0, num_writers - 1);
+  printf(", \"failures\": %d}\n", failures);
+  fflush(stdout);
+
+  kstate_free_state(&state);
+}
+
+static void usage(void)
+{
+  printf("Usage: bench_kstate [-n <iterations>] [-r <max readers>]"
+         " [-w <max writers>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int iterations = 20000;
+  int max_readers = 4;
+  int max_writers = 8;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:w:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'r':
+      max_readers = atoi(optarg);
+      break;
+    case 'w':
+      max_writers = atoi(optarg);
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (iterations < 1 || max_readers < 0 || max_readers >= MAX_PROCS ||
+      max_writers < 2 || max_writers > MAX_PROCS) {
+    usage();
+    return 1;
+  }
+
+  shared = mmap(NULL, sizeof(*shared), PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("!!! bench_kstate: mmap");
+    return 1;
+  }
+
+  // Scaling with state size, and with the number of readers
+  size_t sizes[] = { 4096, 65536, 1024 * 1024, 4 * 1024 * 1024 };
+  size_t ii;
+  for (ii = 0; ii < sizeof(sizes)/sizeof(sizes[0]); ii++) {
+    int readers;
+    for (readers = 0; readers <= max_readers;
+         readers = readers ? readers * 2 : 1) {
+      // Copying large states is slow, so don't take all day over it
+      int n = sizes[ii] > 65536 ? iterations / 10 + 1 : iterations;
+      bench_single_writer(sizes[ii], readers, n);
+    }
+  }
+
+  // Conflicts between writers
+  int writers;
+  for (writers = 2; writers <= max_writers; writers *= 2)
+    bench_many_writers(4096, writers, iterations / writers + 1);
+
+  munmap(shared, sizeof(*shared));
+  return 0;
+}
+
+// vim: set tabstop=8 softtabstop=2 shiftwidth=2 expandtab:
+//
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
@@ -38,11 +38,17 @@
 
 #define _XOPEN_SOURCE 600 // enable nftw, etc.
 #include <ftw.h>          // for nftw
+#include <pthread.h>
 
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "kstate.h"
 
@@ -1021,6 +1027,31 @@ START_TEST(transaction_committed_after_state_freed)
 }
 END_TEST
 
+// A transaction shares its state's name, but it outlives the state
+START_TEST(transaction_name_survives_state_being_freed)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_READ|KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_free_state(&state);
+
+  ck_assert_str_eq(kstate_get_transaction_name(transaction), state_name);
+  free(state_name);
+
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  fail_unless(kstate_get_transaction_name(transaction) == NULL);
+
+  kstate_free_transaction(&transaction);
+}
+END_TEST
+
 START_TEST(states_can_be_distinguished)
 {
   char *state_name = kstate_get_unique_name("Fred");
@@ -1469,6 +1500,8 @@ START_TEST(commit_when_state_changed_during_transaction_fails)
   ck_assert_int_eq(rv, 0);
   kstate_free_transaction(&transaction1);
 
+  // The commit made a new version of the state current
+  s_ptr = kstate_get_state_ptr(state);
   ck_assert_int_eq(*s_ptr, 0x12345678);
 
   uint32_t *t_ptr2 = kstate_get_transaction_ptr(transaction2);
@@ -1478,6 +1511,7 @@ START_TEST(commit_when_state_changed_during_transaction_fails)
   ck_assert_int_eq(rv, -EPERM);
   kstate_free_transaction(&transaction2);
 
+  s_ptr = kstate_get_state_ptr(state);
   ck_assert_int_eq(*s_ptr, 0x12345678);
 
   kstate_free_state(&state);
@@ -1518,19 +1552,2472 @@ START_TEST(abort_when_state_changed_during_transaction_succeeds)
   ck_assert_int_eq(*t_ptr2, 0);
   *t_ptr2 = 0x87654321;
 
+  // The commit made a new version of the state current
+  s_ptr = kstate_get_state_ptr(state);
   ck_assert_int_eq(*s_ptr, 0x12345678);
 
   rv = kstate_abort_transaction(transaction2);
   ck_assert_int_eq(rv, 0);
   kstate_free_transaction(&transaction2);
 
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 0x12345678);
+
+  kstate_free_state(&state);
+  fail_unless(state == NULL);
+}
+END_TEST
+
+// Any commit counts as a change, even if it puts back the original value
+START_TEST(commit_when_state_changed_and_restored_during_transaction_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 0);
+
+  kstate_transaction_p transaction1 = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction1, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction2 = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction2, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr2 = kstate_get_transaction_ptr(transaction2);
+  *t_ptr2 = 0x12345678;
+  rv = kstate_commit_transaction(transaction2);
+  ck_assert_int_eq(rv, 0);
+  s_ptr = kstate_get_state_ptr(state);
   ck_assert_int_eq(*s_ptr, 0x12345678);
 
+  rv = kstate_start_transaction(transaction2, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  t_ptr2 = kstate_get_transaction_ptr(transaction2);
+  *t_ptr2 = 0;
+  rv = kstate_commit_transaction(transaction2);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&transaction2);
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 0);
+
+  // The data is as it was when transaction1 started, but it has been
+  // committed to in the meantime
+  uint32_t *t_ptr1 = kstate_get_transaction_ptr(transaction1);
+  *t_ptr1 = 0x87654321;
+  rv = kstate_commit_transaction(transaction1);
+  ck_assert_int_eq(rv, -EPERM);
+  kstate_free_transaction(&transaction1);
+
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 0);
+
   kstate_free_state(&state);
   fail_unless(state == NULL);
 }
 END_TEST
 
+// Several processes incrementing the same counter must not lose updates
+START_TEST(concurrent_commits_from_several_processes_are_not_lost)
+{
+  const int num_children = 4;
+  const int num_increments = 100;
+
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  int ii;
+  for (ii = 0; ii < num_children; ii++) {
+    pid_t pid = fork();
+    fail_if(pid < 0);
+    if (pid == 0) {
+      kstate_state_p child_state = kstate_new_state();
+      if (kstate_subscribe_state(child_state, state_name, KSTATE_WRITE))
+        _exit(1);
+      kstate_transaction_p transaction = kstate_new_transaction();
+      int done = 0;
+      while (done < num_increments) {
+        if (kstate_start_transaction(transaction, child_state, KSTATE_WRITE))
+          _exit(2);
+        uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+        (*t_ptr)++;
+        rv = kstate_commit_transaction(transaction);
+        if (rv == 0)
+          done++;
+        else if (rv != -EPERM)
+          _exit(3);
+      }
+      // Don't unsubscribe, as that would unlink the state for everyone else
+      _exit(0);
+    }
+  }
+
+  for (ii = 0; ii < num_children; ii++) {
+    int status;
+    wait(&status);
+    fail_unless(WIFEXITED(status));
+    ck_assert_int_eq(WEXITSTATUS(status), 0);
+  }
+
+  free(state_name);
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, num_children * num_increments);
+
+  kstate_free_state(&state);
+}
+END_TEST
+
+// Each commit uses a new version of the state, so this checks that the old
+// versions get reused
+START_TEST(many_commits_in_succession)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  uint32_t ii;
+  for (ii = 1; ii <= 100; ii++) {
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+    ck_assert_int_eq(*t_ptr, ii - 1);
+    *t_ptr = ii;
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+
+    uint32_t *s_ptr = kstate_get_state_ptr(state);
+    ck_assert_int_eq(*s_ptr, ii);
+  }
+  kstate_free_transaction(&transaction);
+
+  kstate_free_state(&state);
+}
+END_TEST
+
+// There are only so many versions of a state available to write to
+START_TEST(too_many_write_transactions_fails_until_one_ends)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transactions[100];
+  int ii, num_started = 0;
+  for (ii = 0; ii < 100; ii++) {
+    transactions[ii] = kstate_new_transaction();
+    rv = kstate_start_transaction(transactions[ii], state, KSTATE_WRITE);
+    if (rv) {
+      ck_assert_int_eq(rv, -EAGAIN);
+      break;
+    }
+    num_started++;
+  }
+  fail_unless(num_started > 1);
+  fail_unless(num_started < 100);
+
+  rv = kstate_abort_transaction(transactions[0]);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_start_transaction(transactions[num_started], state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  for (ii = 0; ii <= num_started; ii++) {
+    kstate_free_transaction(&transactions[ii]);
+  }
+  kstate_free_state(&state);
+}
+END_TEST
+
+// A read transaction looks at the state's data in place
+START_TEST(read_transaction_does_not_copy_state)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  fail_unless(kstate_get_transaction_ptr(transaction) ==
+              kstate_get_state_ptr(state));
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+// A transaction on a read-only state works too
+START_TEST(read_transaction_on_readonly_state)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state_w = kstate_new_state();
+  int rv = kstate_subscribe_state(state_w, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_state_p state_r = kstate_new_state();
+  rv = kstate_subscribe_state(state_r, state_name, KSTATE_READ);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p writer = kstate_new_transaction();
+  rv = kstate_start_transaction(writer, state_w, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *w_ptr = kstate_get_transaction_ptr(writer);
+  *w_ptr = 0x12345678;
+  rv = kstate_commit_transaction(writer);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&writer);
+
+  kstate_transaction_p reader = kstate_new_transaction();
+  rv = kstate_start_transaction(reader, state_r, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *r_ptr = kstate_get_transaction_ptr(reader);
+  ck_assert_int_eq(*r_ptr, 0x12345678);
+  kstate_free_transaction(&reader);
+
+  kstate_free_state(&state_r);
+  kstate_free_state(&state_w);
+}
+END_TEST
+
+// A read transaction doesn't see commits made after it started
+START_TEST(read_transaction_not_affected_by_later_commits)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p reader = kstate_new_transaction();
+  rv = kstate_start_transaction(reader, state, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *r_ptr = kstate_get_transaction_ptr(reader);
+
+  // Commit enough times that every version slot would have been reused
+  // if the reader didn't have its version pinned
+  kstate_transaction_p writer = kstate_new_transaction();
+  uint32_t ii;
+  for (ii = 1; ii <= 20; ii++) {
+    rv = kstate_start_transaction(writer, state, KSTATE_WRITE);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *w_ptr = kstate_get_transaction_ptr(writer);
+    *w_ptr = ii;
+    rv = kstate_commit_transaction(writer);
+    ck_assert_int_eq(rv, 0);
+
+    ck_assert_int_eq(*r_ptr, 0);
+  }
+  kstate_free_transaction(&writer);
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 20);
+
+  rv = kstate_abort_transaction(reader);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&reader);
+
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(start_lazy_transaction_without_read_or_write_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_READ|KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_LAZY);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(lazy_write_transaction_visible_after_commit)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  uint32_t ii;
+  for (ii = 1; ii <= 10; ii++) {
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+    ck_assert_int_eq(*t_ptr, ii - 1);
+    *t_ptr = ii;
+
+    // Our private copy isn't visible through the state
+    uint32_t *s_ptr = kstate_get_state_ptr(state);
+    ck_assert_int_eq(*s_ptr, ii - 1);
+
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+
+    s_ptr = kstate_get_state_ptr(state);
+    ck_assert_int_eq(*s_ptr, ii);
+  }
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+// Large states are compared and copied differently when they're committed
+START_TEST(large_lazy_write_transaction_commits_all_of_it)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  size_t size = 1024 * 1024 + 3;
+  int rv = kstate_set_size(state, size);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  uint32_t ii;
+  for (ii = 1; ii <= 3; ii++) {
+    uint32_t changes = kstate_get_state_changes(state);
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+    ck_assert_int_eq(rv, 0);
+    uint8_t *t_ptr = kstate_get_transaction_ptr(transaction);
+    // Alter the first time, then just the end, then nothing at all
+    if (ii == 1)
+      memset(t_ptr, 0x5A, size);
+    else if (ii == 2)
+      t_ptr[size - 1] = 0xA5;
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(kstate_get_state_changes(state),
+                     changes + (ii < 3 ? 1 : 0));
+
+    uint8_t *s_ptr = kstate_get_state_ptr(state);
+    size_t jj;
+    for (jj = 0; jj < size - 1; jj++)
+      ck_assert_int_eq(s_ptr[jj], 0x5A);
+    ck_assert_int_eq(s_ptr[size - 1], ii == 1 ? 0x5A : 0xA5);
+  }
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(lazy_write_transaction_not_visible_after_abort)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  *t_ptr = 1234;
+  rv = kstate_abort_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+// The flag means nothing to a read transaction, which doesn't copy anyway
+START_TEST(lazy_read_transaction_is_just_a_read_transaction)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_READ|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_transaction_permissions(transaction),
+                   KSTATE_READ);
+  ck_assert_ptr_eq(kstate_get_transaction_ptr(transaction),
+                   kstate_get_state_ptr(state));
+  rv = kstate_abort_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(mark_dirty_on_read_transaction_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_transaction_mark_dirty(transaction, 0, 4);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  rv = kstate_start_transaction(transaction, state, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_transaction_mark_dirty(transaction, 0, 4);
+  ck_assert_int_eq(rv, -EPERM);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(mark_dirty_outside_state_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_transaction_mark_dirty(transaction, page_size - 4, 4);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_transaction_mark_dirty(transaction, page_size - 4, 5);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_transaction_mark_dirty(transaction, page_size + 1, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_transaction_mark_dirty(transaction, 4, (size_t)-1);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+// More ranges than a transaction can remember separately still all count
+START_TEST(commit_with_many_dirty_ranges)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  int ii;
+  for (ii = 0; ii < 20; ii++) {
+    rv = kstate_transaction_mark_dirty(transaction, 8 * ii, 4);
+    ck_assert_int_eq(rv, 0);
+  }
+  // Only the first range we marked actually changes
+  *t_ptr = 99;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 99);
+
+  // And the same for a lazy transaction, changing the last range we mark
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  t_ptr = kstate_get_transaction_ptr(transaction);
+  for (ii = 0; ii < 20; ii++) {
+    rv = kstate_transaction_mark_dirty(transaction, 8 * ii, 4);
+    ck_assert_int_eq(rv, 0);
+  }
+  t_ptr[2 * 19] = 42;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(s_ptr[0], 99);
+  ck_assert_int_eq(s_ptr[2 * 19], 42);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(set_size_on_subscribed_state_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_size(state, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_size(state, KSTATE_MAX_SIZE + 1);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_size(state), sysconf(_SC_PAGESIZE));
+
+  rv = kstate_set_size(state, 100);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(large_state_can_be_written_and_read)
+{
+  size_t size = 200 * 1024 + 3;
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_size(state, size);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_size(state), size);
+
+  // Someone else subscribing gets the same size, without having to ask
+  kstate_state_p state2 = kstate_new_state();
+  rv = kstate_subscribe_state(state2, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_size(state2), size);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint8_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  t_ptr[0] = 1;
+  t_ptr[size - 1] = 2;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&transaction);
+
+  uint8_t *s_ptr = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(s_ptr[0], 1);
+  ck_assert_int_eq(s_ptr[size - 1], 2);
+
+  free(state_name);
+  kstate_free_state(&state2);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(subscribe_with_wrong_size_for_existing_state_fails)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_size(state, 1000);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_state_p state2 = kstate_new_state();
+  rv = kstate_set_size(state2, 2000);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  rv = kstate_set_size(state2, 1000);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  free(state_name);
+  kstate_free_state(&state2);
+  kstate_free_state(&state);
+}
+END_TEST
+
+// Big enough to be laid out for huge pages, whether or not we get them
+START_TEST(huge_state_can_be_written)
+{
+  size_t size = 3 * 1024 * 1024;
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_size(state, size);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  uint8_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  t_ptr[size - 1] = 3;
+  rv = kstate_transaction_mark_dirty(transaction, size - 1, 1);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&transaction);
+
+  uint8_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(s_ptr[size - 1], 3);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(wait_for_unchanged_state_times_out)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_wait_for_state_change(state, 0, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t changes = kstate_get_state_changes(state);
+  rv = kstate_wait_for_state_change(state, changes, 10);
+  ck_assert_int_eq(rv, -ETIMEDOUT);
+
+  // Committing without changing anything doesn't count
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_changes(state), changes);
+
+  // But changing something does
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  *t_ptr = 1;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_ne(kstate_get_state_changes(state), changes);
+  rv = kstate_wait_for_state_change(state, changes, 0);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(wait_is_woken_by_commit_in_another_process)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t changes = kstate_get_state_changes(state);
+
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p state2 = kstate_new_state();
+    int rv = kstate_subscribe_state(state2, state_name, KSTATE_WRITE);
+    if (rv) _exit(1);
+    usleep(50000);
+    kstate_transaction_p transaction = kstate_new_transaction();
+    rv = kstate_start_transaction(transaction, state2, KSTATE_WRITE);
+    if (rv) _exit(1);
+    uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+    *t_ptr = 42;
+    rv = kstate_commit_transaction(transaction);
+    _exit(rv ? 1 : 0);
+  }
+
+  rv = kstate_wait_for_state_change(state, changes, 2000);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 42);
+
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  free(state_name);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(rate_limited_state_sees_changes_at_most_at_that_rate)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_state_p slow = kstate_new_state();
+  rv = kstate_set_max_rate(slow, 10);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(slow, state_name, KSTATE_READ);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t *slow_ptr = kstate_get_state_ptr(slow);
+  ck_assert_int_eq(*slow_ptr, 0);
+  uint32_t changes = kstate_get_state_changes(slow);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  *t_ptr = 1;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  // We see the change straight away through the unlimited state, but
+  // not through the rate limited one until its next tick
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 1);
+  slow_ptr = kstate_get_state_ptr(slow);
+  ck_assert_int_eq(*slow_ptr, 0);
+  ck_assert_int_eq(kstate_get_state_changes(slow), changes);
+
+  rv = kstate_wait_for_state_change(slow, changes, 1000);
+  ck_assert_int_eq(rv, 0);
+  slow_ptr = kstate_get_state_ptr(slow);
+  ck_assert_int_eq(*slow_ptr, 1);
+  ck_assert_int_ne(kstate_get_state_changes(slow), changes);
+
+  // And turning off the limit means we see the latest version again
+  rv = kstate_set_max_rate(slow, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  t_ptr = kstate_get_transaction_ptr(transaction);
+  *t_ptr = 2;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  slow_ptr = kstate_get_state_ptr(slow);
+  ck_assert_int_eq(*slow_ptr, 2);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&slow);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(commit_on_several_states)
+{
+  char *name1 = kstate_get_unique_name("Fred");
+  char *name2 = kstate_get_unique_name("Jim");
+  kstate_state_p state1 = kstate_new_state();
+  kstate_state_p state2 = kstate_new_state();
+  int rv = kstate_subscribe_state(state1, name1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, name2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  free(name1);
+  free(name2);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_add_state_to_transaction(transaction, state2);
+  ck_assert_int_eq(rv, 0);
+
+  // We can't add the same state twice
+  rv = kstate_add_state_to_transaction(transaction, state1);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  uint32_t *t_ptr1 = kstate_get_transaction_state_ptr(transaction, state1);
+  uint32_t *t_ptr2 = kstate_get_transaction_state_ptr(transaction, state2);
+  ck_assert_ptr_eq(t_ptr1, kstate_get_transaction_ptr(transaction));
+  ck_assert_ptr_ne(t_ptr2, NULL);
+  *t_ptr1 = 1;
+  *t_ptr2 = 2;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t *s_ptr1 = kstate_get_state_ptr(state1);
+  uint32_t *s_ptr2 = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(*s_ptr1, 1);
+  ck_assert_int_eq(*s_ptr2, 2);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state1);
+  kstate_free_state(&state2);
+}
+END_TEST
+
+START_TEST(commit_on_several_states_fails_if_any_changed)
+{
+  char *name1 = kstate_get_unique_name("Fred");
+  char *name2 = kstate_get_unique_name("Jim");
+  kstate_state_p state1 = kstate_new_state();
+  kstate_state_p state2 = kstate_new_state();
+  int rv = kstate_subscribe_state(state1, name1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, name2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  free(name1);
+  free(name2);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_add_state_to_transaction(transaction, state2);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr1 = kstate_get_transaction_state_ptr(transaction, state1);
+  *t_ptr1 = 1;
+
+  // Someone else alters the state we've only been reading
+  kstate_transaction_p other = kstate_new_transaction();
+  rv = kstate_start_transaction(other, state2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *o_ptr = kstate_get_transaction_ptr(other);
+  *o_ptr = 99;
+  rv = kstate_commit_transaction(other);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&other);
+
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, -EPERM);
+
+  uint32_t *s_ptr1 = kstate_get_state_ptr(state1);
+  uint32_t *s_ptr2 = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(*s_ptr1, 0);
+  ck_assert_int_eq(*s_ptr2, 99);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state1);
+  kstate_free_state(&state2);
+}
+END_TEST
+
+START_TEST(add_state_to_transaction_fails_fast_if_already_changed)
+{
+  char *name1 = kstate_get_unique_name("Fred");
+  char *name2 = kstate_get_unique_name("Jim");
+  kstate_state_p state1 = kstate_new_state();
+  kstate_state_p state2 = kstate_new_state();
+  int rv = kstate_subscribe_state(state1, name1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, name2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  free(name1);
+  free(name2);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state1, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p other = kstate_new_transaction();
+  rv = kstate_start_transaction(other, state1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *o_ptr = kstate_get_transaction_ptr(other);
+  *o_ptr = 99;
+  rv = kstate_commit_transaction(other);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&other);
+
+  rv = kstate_add_state_to_transaction(transaction, state2);
+  ck_assert_int_eq(rv, -EPERM);
+  fail_unless(kstate_transaction_is_active(transaction));
+  ck_assert_ptr_eq(kstate_get_transaction_state_ptr(transaction, state2), NULL);
+  rv = kstate_abort_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state1);
+  kstate_free_state(&state2);
+}
+END_TEST
+
+// Each process moves "money" between two states, and none should get lost
+START_TEST(concurrent_commits_on_several_states_are_atomic)
+{
+  char *name1 = kstate_get_unique_name("Fred");
+  char *name2 = kstate_get_unique_name("Jim");
+  kstate_state_p state1 = kstate_new_state();
+  kstate_state_p state2 = kstate_new_state();
+  int rv = kstate_subscribe_state(state1, name1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, name2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  int num_children = 4;
+  int num_moves = 100;
+  pid_t pids[4];
+  int ii;
+  for (ii = 0; ii < num_children; ii++) {
+    pids[ii] = fork();
+    ck_assert_int_ge(pids[ii], 0);
+    if (pids[ii] == 0) {
+      kstate_state_p s1 = kstate_new_state();
+      kstate_state_p s2 = kstate_new_state();
+      if (kstate_subscribe_state(s1, name1, KSTATE_WRITE)) _exit(1);
+      if (kstate_subscribe_state(s2, name2, KSTATE_WRITE)) _exit(1);
+      kstate_transaction_p t = kstate_new_transaction();
+      int done = 0;
+      while (done < num_moves) {
+        if (kstate_start_transaction(t, s1, KSTATE_WRITE)) continue;
+        if (kstate_add_state_to_transaction(t, s2) == 0) {
+          int32_t *p1 = kstate_get_transaction_state_ptr(t, s1);
+          int32_t *p2 = kstate_get_transaction_state_ptr(t, s2);
+          *p1 -= 1;
+          *p2 += 1;
+          if (kstate_commit_transaction(t) == 0)
+            done ++;
+        } else {
+          kstate_abort_transaction(t);
+        }
+      }
+      _exit(0);
+    }
+  }
+
+  // Meanwhile, we check that we never see a version where money has been
+  // lost or created
+  int moves_seen = 0;
+  kstate_transaction_p reader = kstate_new_transaction();
+  while (moves_seen < num_children * num_moves) {
+    rv = kstate_start_transaction(reader, state1, KSTATE_READ);
+    ck_assert_int_eq(rv, 0);
+    rv = kstate_add_state_to_transaction(reader, state2);
+    if (rv == 0) {
+      int32_t *p1 = kstate_get_transaction_state_ptr(reader, state1);
+      int32_t *p2 = kstate_get_transaction_state_ptr(reader, state2);
+      ck_assert_int_eq(*p1 + *p2, 0);
+      moves_seen = *p2;
+    } else {
+      ck_assert_int_eq(rv, -EPERM);
+    }
+    rv = kstate_abort_transaction(reader);
+    ck_assert_int_eq(rv, 0);
+  }
+  kstate_free_transaction(&reader);
+
+  for (ii = 0; ii < num_children; ii++) {
+    int status;
+    waitpid(pids[ii], &status, 0);
+    ck_assert_int_eq(WEXITSTATUS(status), 0);
+  }
+
+  int32_t *s_ptr1 = kstate_get_state_ptr(state1);
+  int32_t *s_ptr2 = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(*s_ptr1, -num_children * num_moves);
+  ck_assert_int_eq(*s_ptr2, num_children * num_moves);
+
+  free(name1);
+  free(name2);
+  kstate_free_state(&state1);
+  kstate_free_state(&state2);
+}
+END_TEST
+
+static int increment_fn(kstate_transaction_p transaction, void *ptr, void *data)
+{
+  uint32_t *value = ptr;
+  (*value) ++;
+  return 0;
+}
+
+static int refuse_fn(kstate_transaction_p transaction, void *ptr, void *data)
+{
+  uint32_t *value = ptr;
+  (*value) ++;
+  return 42;
+}
+
+// Increments the state, but the first time also has someone else commit to
+// it whilst we're in the transaction
+static int interfere_fn(kstate_transaction_p transaction, void *ptr, void *data)
+{
+  kstate_state_p state = data;
+  uint32_t *value = ptr;
+  if (*value == 0) {
+    int rv = kstate_transaction_using_fn(state, increment_fn, NULL, NULL);
+    ck_assert_int_eq(rv, 0);
+  }
+  (*value) ++;
+  return 0;
+}
+
+static void count_backoff(uint32_t retries, void *data)
+{
+  uint32_t *count = data;
+  ck_assert_int_eq(retries, *count);
+  (*count) ++;
+}
+
+START_TEST(transaction_using_fn_commits_or_aborts)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_transaction_using_fn(state, increment_fn, NULL, NULL);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 1);
+
+  rv = kstate_transaction_using_fn(state, refuse_fn, NULL, NULL);
+  ck_assert_int_eq(rv, 42);
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 1);
+
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(transaction_using_fn_retries_after_conflict)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  // Without retrying, we fail
+  rv = kstate_transaction_using_fn(state, interfere_fn, state, NULL);
+  ck_assert_int_eq(rv, -EPERM);
+
+  // ...and only the interloper's increment happened
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 1);
+
+  kstate_free_state(&state);
+
+  state_name = kstate_get_unique_name("Fred");
+  state = kstate_new_state();
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t count = 0;
+  struct kstate_retry retry = { 5, count_backoff, &count, 0 };
+  rv = kstate_transaction_using_fn(state, interfere_fn, state, &retry);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(retry.retries, 1);
+  ck_assert_int_eq(count, 1);
+
+  // One increment by the interloper, and one by us
+  s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, 2);
+
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(concurrent_transactions_using_fn_are_not_lost)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  int num_children = 4;
+  int num_increments = 200;
+  pid_t pids[4];
+  int ii;
+  for (ii = 0; ii < num_children; ii++) {
+    pids[ii] = fork();
+    ck_assert_int_ge(pids[ii], 0);
+    if (pids[ii] == 0) {
+      kstate_state_p s = kstate_new_state();
+      if (kstate_subscribe_state(s, state_name, KSTATE_WRITE)) _exit(1);
+      int jj;
+      for (jj = 0; jj < num_increments; jj++) {
+        struct kstate_retry retry = { UINT32_MAX, NULL, NULL, 0 };
+        if (kstate_transaction_using_fn(s, increment_fn, NULL, &retry))
+          _exit(1);
+      }
+      _exit(0);
+    }
+  }
+  for (ii = 0; ii < num_children; ii++) {
+    int status;
+    waitpid(pids[ii], &status, 0);
+    ck_assert_int_eq(WEXITSTATUS(status), 0);
+  }
+
+  uint32_t *s_ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*s_ptr, num_children * num_increments);
+
+  free(state_name);
+  kstate_free_state(&state);
+}
+END_TEST
+
+struct log_record {
+  int  count;
+  int  level;
+  char message[256];
+};
+
+static void record_log_fn(kstate_log_level_t  level,
+                          const char         *message,
+                          void               *data)
+{
+  struct log_record *record = data;
+  record->count ++;
+  record->level = level;
+  strncpy(record->message, message, sizeof(record->message) - 1);
+}
+
+START_TEST(log_fn_is_given_errors)
+{
+  struct log_record record = { 0, 0, "" };
+  kstate_set_log_fn(record_log_fn, &record);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, NULL, KSTATE_WRITE);
+  kstate_set_log_fn(NULL, NULL);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  ck_assert_int_eq(record.count, 1);
+  ck_assert_int_eq(record.level, KSTATE_LOG_ERROR);
+  ck_assert_str_eq(record.message,
+                   "kstate_subscribe_state: Supplied 'name' may not be NULL");
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(log_level_controls_what_is_logged)
+{
+  struct log_record record = { 0, 0, "" };
+  kstate_set_log_fn(record_log_fn, &record);
+
+  int previous = kstate_set_log_level(KSTATE_LOG_NONE);
+  ck_assert_int_eq(previous, KSTATE_LOG_ERROR);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, NULL, KSTATE_WRITE);
+  ck_assert_int_eq(rv, -EINVAL);
+  ck_assert_int_eq(record.count, 0);
+
+  // At debug level, we hear about each transaction
+  kstate_set_log_level(KSTATE_LOG_DEBUG);
+  char *state_name = kstate_get_unique_name("Fred");
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  int count = record.count;
+  ck_assert_int_gt(count, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_gt(record.count, count);
+
+  kstate_set_log_level(previous);
+  kstate_set_log_fn(NULL, NULL);
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+  free(state_name);
+}
+END_TEST
+
+// Conflicts and running out of slots are what contention looks like, and
+// shouldn't cost anyone a message at the default log level
+START_TEST(contention_is_not_logged)
+{
+  struct log_record record = { 0, 0, "" };
+  kstate_set_log_fn(record_log_fn, &record);
+
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  free(state_name);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_transaction_using_fn(state, interfere_fn, state, NULL);
+  ck_assert_int_eq(rv, -EPERM);
+  struct kstate_retry retry = { 5, NULL, NULL, 0 };
+  rv = kstate_transaction_using_fn(state, interfere_fn, state, &retry);
+  ck_assert_int_eq(rv, 0);
+
+  // Keep starting write transactions until there are no slots left (a
+  // state has fewer than 16)
+  kstate_transaction_p transactions[16];
+  int ii;
+  for (ii = 0; ii < 16; ii++) {
+    transactions[ii] = kstate_new_transaction();
+    rv = kstate_start_transaction(transactions[ii], state, KSTATE_WRITE);
+    if (rv)
+      break;
+  }
+  ck_assert_int_eq(rv, -EAGAIN);
+  for (; ii >= 0; ii--)
+    kstate_free_transaction(&transactions[ii]);
+
+  kstate_set_log_fn(NULL, NULL);
+  ck_assert_int_eq(record.count, 0);
+  kstate_free_state(&state);
+}
+END_TEST
+
+START_TEST(state_stats_count_transactions)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_state_p reader = kstate_new_state();
+  rv = kstate_subscribe_state(reader, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  struct kstate_stats stats;
+  rv = kstate_get_state_stats(reader, &stats);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(stats.subscribers, 2);
+  ck_assert_int_eq(stats.commits, 0);
+
+  kstate_transaction_p t1 = kstate_new_transaction();
+  kstate_transaction_p t2 = kstate_new_transaction();
+
+  // One commit that alters the state, and one that doesn't
+  rv = kstate_start_transaction(t1, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(t1);
+  ptr[0] = 1;
+  rv = kstate_commit_transaction(t1);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_start_transaction(t1, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(t1);
+  ck_assert_int_eq(rv, 0);
+
+  // One conflict, and one abort
+  rv = kstate_start_transaction(t1, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_start_transaction(t2, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_transaction_ptr(t2);
+  ptr[0] = 2;
+  rv = kstate_commit_transaction(t2);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(t1);
+  ck_assert_int_eq(rv, -EPERM);
+
+  rv = kstate_start_transaction(t1, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_abort_transaction(t1);
+  ck_assert_int_eq(rv, 0);
+
+  // And a read transaction in progress
+  rv = kstate_start_transaction(t1, reader, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_get_state_stats(state, &stats);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(stats.commits, 2);
+  ck_assert_int_eq(stats.noop_commits, 1);
+  ck_assert_int_eq(stats.conflicts, 1);
+  ck_assert_int_eq(stats.aborts, 1);
+  ck_assert_int_eq(stats.readers, 1);
+
+  uint64_t committed = 0;
+  int ii;
+  for (ii = 0; ii < KSTATE_STATS_LATENCY_BUCKETS; ii++)
+    committed += stats.latency[ii];
+  ck_assert_int_eq(committed, 3);
+
+  rv = kstate_abort_transaction(t1);
+  ck_assert_int_eq(rv, 0);
+  kstate_unsubscribe_state(reader);
+
+  rv = kstate_get_state_stats(state, &stats);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(stats.readers, 0);
+  ck_assert_int_eq(stats.subscribers, 1);
+
+  rv = kstate_get_state_stats(reader, &stats);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  kstate_free_transaction(&t1);
+  kstate_free_transaction(&t2);
+  kstate_free_state(&reader);
+  kstate_free_state(&state);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(read_begin_and_retry)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 1;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  uint64_t token;
+  const uint32_t *data = kstate_read_begin(state, &token);
+  fail_if(data == NULL);
+  ck_assert_int_eq(data[0], 1);
+  fail_if(kstate_read_retry(state, token));
+
+  // A commit in the middle means we must read again
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 2;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  fail_unless(kstate_read_retry(state, token));
+
+  data = kstate_read_begin(state, &token);
+  ck_assert_int_eq(data[0], 2);
+  fail_if(kstate_read_retry(state, token));
+
+  // But a transaction that doesn't commit doesn't matter
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 3;
+  rv = kstate_abort_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  fail_if(kstate_read_retry(state, token));
+
+  kstate_unsubscribe_state(state);
+  data = kstate_read_begin(state, &token);
+  fail_unless(data == NULL);
+  fail_unless(kstate_read_retry(state, token));
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(read_begin_and_retry_never_sees_torn_data)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // The writer always sets every word of the state to the same value
+  int num_words = 1024;
+  int num_commits = 2000;
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_transaction_p t = kstate_new_transaction();
+    uint32_t ii;
+    int jj;
+    for (ii = 1; ii <= (uint32_t)num_commits; ii++) {
+      if (kstate_start_transaction(t, state, KSTATE_WRITE)) _exit(1);
+      uint32_t *ptr = kstate_get_transaction_ptr(t);
+      for (jj = 0; jj < num_words; jj++)
+        ptr[jj] = ii;
+      if (kstate_commit_transaction(t)) _exit(1);
+    }
+    _exit(0);
+  }
+
+  uint32_t last = 0;
+  int status;
+  bool exited = false;
+  while (last < (uint32_t)num_commits && !exited) {
+    uint64_t token;
+    uint32_t first, other;
+    const uint32_t *data;
+    do {
+      data = kstate_read_begin(state, &token);
+      first = data[0];
+      other = data[num_words - 1];
+    } while (kstate_read_retry(state, token));
+    ck_assert_int_eq(first, other);
+    ck_assert_int_ge(first, last);
+    last = first;
+    // In case the writer fails
+    exited = waitpid(pid, &status, WNOHANG) == pid;
+  }
+
+  if (!exited)
+    waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  kstate_free_state(&state);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(state_lasts_until_its_last_subscriber_leaves)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p writer = kstate_new_state();
+  kstate_state_p reader = kstate_new_state();
+  int rv = kstate_subscribe_state(writer, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, writer, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 1234;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  // The reader is still using it, so it doesn't go away
+  kstate_unsubscribe_state(writer);
+  rv = kstate_subscribe_state(writer, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  const uint32_t *data = kstate_get_state_ptr(writer);
+  ck_assert_int_eq(data[0], 1234);
+
+  // But once everyone has gone, so has it
+  kstate_unsubscribe_state(writer);
+  kstate_unsubscribe_state(reader);
+  rv = kstate_subscribe_state(reader, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, -ENOENT);
+
+  rv = kstate_subscribe_state(writer, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  data = kstate_get_state_ptr(writer);
+  ck_assert_int_eq(data[0], 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&writer);
+  kstate_free_state(&reader);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(dead_subscribers_are_tidied_up_after)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // The child pins every slot but the current one, and then dies without
+  // letting go of any of them
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p child = kstate_new_state();
+    if (kstate_subscribe_state(child, state_name, KSTATE_WRITE)) _exit(1);
+    kstate_transaction_p write = kstate_new_transaction();
+    int ii;
+    for (ii = 0; ii < 7; ii++) {
+      kstate_transaction_p read = kstate_new_transaction();
+      if (kstate_start_transaction(read, child, KSTATE_READ)) _exit(2);
+      if (kstate_start_transaction(write, child, KSTATE_WRITE)) _exit(3);
+      uint32_t *ptr = kstate_get_transaction_ptr(write);
+      ptr[0] = ii + 1;
+      if (kstate_commit_transaction(write)) _exit(4);
+    }
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  struct kstate_stats stats;
+  rv = kstate_get_state_stats(state, &stats);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(stats.subscribers, 2);
+
+  // So there would be no free slots, if we didn't notice it had gone
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  rv = kstate_get_state_stats(state, &stats);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(stats.subscribers, 1);
+  ck_assert_int_eq(stats.busy, 0);
+
+  // And we can now use all the slots
+  kstate_transaction_p reads[7];
+  int ii;
+  for (ii = 0; ii < 7; ii++) {
+    reads[ii] = kstate_new_transaction();
+    rv = kstate_start_transaction(reads[ii], state, KSTATE_READ);
+    ck_assert_int_eq(rv, 0);
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+    ptr[0] = ii + 100;
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+  }
+  for (ii = 0; ii < 7; ii++)
+    kstate_free_transaction(&reads[ii]);
+
+  // The last one out removes the shared memory object
+  kstate_unsubscribe_state(state);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, -ENOENT);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(states_can_share_an_arena)
+{
+  char *arena_name = kstate_get_unique_name("Arena");
+  char *name1 = kstate_get_unique_name("Fred");
+  char *name2 = kstate_get_unique_name("Jim");
+  kstate_state_p state1 = kstate_new_state();
+  kstate_state_p state2 = kstate_new_state();
+  kstate_state_p reader = kstate_new_state();
+
+  int rv = kstate_set_arena(state1, arena_name, 16);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_arena(state1, "Not-A-Name", 16);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_persistent(state1, "/tmp/some.file");
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state1, name1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_size(state1), 64);
+
+  rv = kstate_set_arena(state2, arena_name, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state2, name2, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // Each state has its own data
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state1, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 1;
+  ptr[15] = 15;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_start_transaction(transaction, state2, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 2;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+
+  const uint32_t *data = kstate_get_state_ptr(state1);
+  ck_assert_int_eq(data[0], 1);
+  ck_assert_int_eq(data[15], 15);
+  data = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(data[0], 2);
+  ck_assert_int_eq(kstate_get_state_changes(state1), 1);
+  ck_assert_int_eq(kstate_get_state_changes(state2), 1);
+
+  // And another process sees the same states
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p child = kstate_new_state();
+    if (kstate_set_arena(child, arena_name, 0)) _exit(1);
+    if (kstate_subscribe_state(child, name2, KSTATE_WRITE)) _exit(2);
+    kstate_transaction_p t = kstate_new_transaction();
+    if (kstate_start_transaction(t, child, KSTATE_WRITE)) _exit(3);
+    uint32_t *p = kstate_get_transaction_ptr(t);
+    if (p[0] != 2) _exit(4);
+    p[0] = 3;
+    if (kstate_commit_transaction(t)) _exit(5);
+    kstate_free_transaction(&t);
+    kstate_free_state(&child);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+  data = kstate_get_state_ptr(state2);
+  ck_assert_int_eq(data[0], 3);
+  data = kstate_get_state_ptr(state1);
+  ck_assert_int_eq(data[0], 1);
+
+  // Subscribing for read doesn't add a state
+  rv = kstate_set_arena(reader, arena_name, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, "Bob", KSTATE_READ);
+  ck_assert_int_eq(rv, -ENOENT);
+  rv = kstate_set_arena(reader, arena_name, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, name1, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  data = kstate_get_state_ptr(reader);
+  ck_assert_int_eq(data[15], 15);
+  kstate_unsubscribe_state(reader);
+
+  // All the states in an arena are the same size
+  rv = kstate_set_arena(reader, arena_name, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_size(reader, 128);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, name1, KSTATE_READ);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  // Once everyone has gone, so has the arena
+  kstate_unsubscribe_state(state1);
+  kstate_unsubscribe_state(state2);
+  rv = kstate_set_arena(reader, arena_name, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, name1, KSTATE_READ);
+  ck_assert_int_eq(rv, -ENOENT);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state1);
+  kstate_free_state(&state2);
+  kstate_free_state(&reader);
+  free(arena_name);
+  free(name1);
+  free(name2);
+}
+END_TEST
+
+START_TEST(arena_has_room_for_so_many_states)
+{
+  char *arena_name = kstate_get_unique_name("Arena");
+  kstate_state_p states[3];
+  char name[20];
+  int ii, rv;
+  for (ii = 0; ii < 3; ii++) {
+    states[ii] = kstate_new_state();
+    rv = kstate_set_arena(states[ii], arena_name, 2);
+    ck_assert_int_eq(rv, 0);
+    rv = kstate_set_size(states[ii], 1000);
+    ck_assert_int_eq(rv, 0);
+    sprintf(name, "State%d", ii);
+    rv = kstate_subscribe_state(states[ii], name, KSTATE_WRITE);
+    ck_assert_int_eq(rv, ii < 2 ? 0 : -ENOSPC);
+  }
+  ck_assert_int_eq(kstate_get_state_size(states[1]), 1000);
+
+  // But it doesn't mind us subscribing to states it already has
+  kstate_state_p again = kstate_new_state();
+  rv = kstate_set_arena(again, arena_name, 2);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(again, "State1", KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_state(&again);
+
+  rv = kstate_set_arena(again = kstate_new_state(), arena_name,
+                        2 * 1024 * 1024);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_journal(again, "/tmp/some.journal", 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_arena(again, arena_name, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_state(&again);
+
+  for (ii = 0; ii < 3; ii++)
+    kstate_free_state(&states[ii]);
+  free(arena_name);
+}
+END_TEST
+
+START_TEST(dead_arena_subscribers_are_tidied_up_after)
+{
+  char *arena_name = kstate_get_unique_name("Arena");
+  char *state_name = kstate_get_unique_name("Fred");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_arena(state, arena_name, 4);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // The child pins every slot but the current one, and then dies without
+  // letting go of any of them
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p child = kstate_new_state();
+    if (kstate_set_arena(child, arena_name, 0)) _exit(1);
+    if (kstate_subscribe_state(child, state_name, KSTATE_WRITE)) _exit(2);
+    kstate_transaction_p write = kstate_new_transaction();
+    int ii;
+    for (ii = 0; ii < 7; ii++) {
+      kstate_transaction_p read = kstate_new_transaction();
+      if (kstate_start_transaction(read, child, KSTATE_READ)) _exit(3);
+      if (kstate_start_transaction(write, child, KSTATE_WRITE)) _exit(4);
+      uint32_t *ptr = kstate_get_transaction_ptr(write);
+      ptr[0] = ii + 1;
+      if (kstate_commit_transaction(write)) _exit(5);
+    }
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  // So there would be no free slots, if we didn't notice it had gone, and
+  // we can now use all of them
+  kstate_transaction_p transaction = kstate_new_transaction();
+  kstate_transaction_p reads[7];
+  int ii;
+  for (ii = 0; ii < 7; ii++) {
+    reads[ii] = kstate_new_transaction();
+    rv = kstate_start_transaction(reads[ii], state, KSTATE_READ);
+    ck_assert_int_eq(rv, 0);
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+    ptr[0] = ii + 100;
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+  }
+  for (ii = 0; ii < 7; ii++)
+    kstate_free_transaction(&reads[ii]);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&state);
+  free(arena_name);
+  free(state_name);
+}
+END_TEST
+
+#define NUM_THREADS 4
+#define THREAD_COMMITS 500
+
+struct thread_data {
+  kstate_state_p state;
+  uint32_t       ids[THREAD_COMMITS];
+  int            rv;
+};
+
+static void *increment_state(void *data)
+{
+  struct thread_data *td = data;
+  int ii;
+  for (ii = 0; ii < THREAD_COMMITS; ii++) {
+    int rv;
+    do {
+      kstate_transaction_p transaction = kstate_new_transaction();
+      rv = kstate_start_transaction(transaction, td->state, KSTATE_WRITE);
+      if (rv == 0) {
+        td->ids[ii] = kstate_get_transaction_id(transaction);
+        uint32_t *count = kstate_get_transaction_ptr(transaction);
+        (*count)++;
+        rv = kstate_commit_transaction(transaction);
+      }
+      kstate_free_transaction(&transaction);
+    } while (rv == -EPERM || rv == -EAGAIN);
+    if (rv) {
+      td->rv = rv;
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  uint32_t id_a = *(const uint32_t *)a;
+  uint32_t id_b = *(const uint32_t *)b;
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+START_TEST(threads_can_share_a_state)
+{
+  kstate_state_p state = kstate_new_state();
+  char *name = kstate_get_unique_name("Threads");
+  int rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  pthread_t threads[NUM_THREADS];
+  static struct thread_data data[NUM_THREADS];
+  int ii, jj;
+  for (ii = 0; ii < NUM_THREADS; ii++) {
+    data[ii].state = state;
+    data[ii].rv = 0;
+    rv = pthread_create(&threads[ii], NULL, increment_state, &data[ii]);
+    ck_assert_int_eq(rv, 0);
+  }
+  for (ii = 0; ii < NUM_THREADS; ii++) {
+    pthread_join(threads[ii], NULL);
+    ck_assert_int_eq(data[ii].rv, 0);
+  }
+
+  // Every increment should have made it, and no two threads should have
+  // been given the same transaction id
+  uint32_t *count = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*count, NUM_THREADS * THREAD_COMMITS);
+  static uint32_t ids[NUM_THREADS * THREAD_COMMITS];
+  for (ii = 0; ii < NUM_THREADS; ii++)
+    memcpy(&ids[ii * THREAD_COMMITS], data[ii].ids, sizeof(data[ii].ids));
+  qsort(ids, NUM_THREADS * THREAD_COMMITS, sizeof(ids[0]), compare_ids);
+  for (jj = 1; jj < NUM_THREADS * THREAD_COMMITS; jj++)
+    ck_assert_int_ne(ids[jj], ids[jj - 1]);
+
+  kstate_free_state(&state);
+  free(name);
+}
+END_TEST
+
+START_TEST(persistent_state_survives_unsubscribing)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  char filename[300];
+  snprintf(filename, sizeof(filename), "/tmp/%s.kstate", state_name);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_persistent(state, filename);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_persistent(state, filename);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_persistent(state, "/tmp/some.other.file");
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_persistent(state, filename);
+  ck_assert_int_eq(rv, -EINVAL);
+  fail_unless(access(filename, F_OK) == 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+  ptr[0] = 0x1234;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_sync(state);
+  ck_assert_int_eq(rv, 0);
+
+  // Which leaves the file behind
+  kstate_unsubscribe_state(state);
+  fail_unless(access(filename, F_OK) == 0);
+
+  // And subscribing again (even just to read) maps it as it was
+  rv = kstate_set_persistent(state, filename);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(ptr[0], 0x1234);
+  ck_assert_int_eq(kstate_sync(state), 0);
+
+  // Whereas without the file, it's a different (new) state
+  kstate_state_p other = kstate_new_state();
+  rv = kstate_subscribe_state(other, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ptr = kstate_get_state_ptr(other);
+  ck_assert_int_eq(ptr[0], 0);
+
+  kstate_free_transaction(&transaction);
+  kstate_free_state(&other);
+  kstate_free_state(&state);
+  unlink(filename);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(persistent_state_flushes_in_background)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  char filename[300];
+  snprintf(filename, sizeof(filename), "/tmp/%s.kstate", state_name);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_flush(state, 10, 1);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_persistent(state, filename);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_flush(state, 10, 1);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_transaction_p transaction = kstate_new_transaction();
+  uint32_t ii;
+  for (ii = 1; ii <= 100; ii++) {
+    rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+    ptr[0] = ii;
+    rv = kstate_commit_transaction(transaction);
+    ck_assert_int_eq(rv, 0);
+  }
+  kstate_free_transaction(&transaction);
+  kstate_unsubscribe_state(state);
+
+  // Someone else (as it might be, after a restart) sees the last commit
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p s = kstate_new_state();
+    if (kstate_set_persistent(s, filename)) _exit(1);
+    if (kstate_subscribe_state(s, state_name, KSTATE_READ)) _exit(2);
+    uint32_t *ptr = kstate_get_state_ptr(s);
+    _exit(ptr[0] == 100 ? 0 : 3);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  kstate_free_state(&state);
+  unlink(filename);
+  free(state_name);
+}
+END_TEST
+
+static int commit_uint32(kstate_state_p state, uint32_t value)
+{
+  kstate_transaction_p transaction = kstate_new_transaction();
+  int rv = kstate_start_transaction(transaction, state, KSTATE_WRITE);
+  if (rv == 0) {
+    uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+    ptr[0] = value;
+    ptr[1000] = value;
+    rv = kstate_commit_transaction(transaction);
+  }
+  kstate_free_transaction(&transaction);
+  return rv;
+}
+
+static void remove_journal(const char *filename)
+{
+  char checkpoint[320];
+  snprintf(checkpoint, sizeof(checkpoint), "%s.checkpoint", filename);
+  unlink(filename);
+  unlink(checkpoint);
+}
+
+START_TEST(journaled_state_is_restored)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  char filename[300];
+  snprintf(filename, sizeof(filename), "/tmp/%s.journal", state_name);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_journal(state, filename, 2);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_persistent(state, "/tmp/some.other.file");
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // Only one subscriber may journal to the same file
+  kstate_state_p other = kstate_new_state();
+  rv = kstate_set_journal(other, filename, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(other, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, -EBUSY);
+  kstate_free_state(&other);
+
+  // Enough commits to need a checkpoint or two
+  uint32_t ii;
+  for (ii = 1; ii <= 7; ii++) {
+    rv = commit_uint32(state, ii);
+    ck_assert_int_eq(rv, 0);
+    if (ii % 2)
+      ck_assert_int_eq(kstate_sync(state), 0);
+  }
+
+  // Which gets rid of the shared memory object...
+  kstate_unsubscribe_state(state);
+
+  // ...but the journal brings it back
+  rv = kstate_set_journal(state, filename, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_state_ptr(state);
+  ck_assert_int_eq(ptr[0], 7);
+  ck_assert_int_eq(ptr[1000], 7);
+
+  kstate_free_state(&state);
+  remove_journal(filename);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(journal_can_be_read_as_at_a_time)
+{
+  char *state_name = kstate_get_unique_name("Fred");
+  char filename[300];
+  snprintf(filename, sizeof(filename), "/tmp/%s.journal", state_name);
+
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_journal(state, filename, 0);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, state_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  rv = commit_uint32(state, 1);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_sync(state), 0);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t then = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+  rv = commit_uint32(state, 2);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_sync(state), 0);
+
+  size_t size = kstate_get_state_size(state);
+  uint32_t *data = malloc(size);
+  rv = kstate_read_journal(filename, then, data, size);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(data[0], 1);
+  rv = kstate_read_journal(filename, UINT64_MAX, data, size);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(data[0], 2);
+  ck_assert_int_eq(data[1000], 2);
+
+  // We can't go back before the checkpoint we started with
+  rv = kstate_read_journal(filename, 1, data, size);
+  ck_assert_int_eq(rv, -ERANGE);
+  rv = kstate_read_journal(filename, UINT64_MAX, data, size / 2);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  free(data);
+  kstate_free_state(&state);
+  remove_journal(filename);
+  free(state_name);
+}
+END_TEST
+
+START_TEST(history_holds_every_change)
+{
+  kstate_state_p writer = kstate_new_state();
+  kstate_state_p reader = kstate_new_state();
+  char *name = kstate_get_unique_name("History");
+  int rv = kstate_set_history(writer, 4);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(writer, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  // The reader takes whatever history the state already has
+  rv = kstate_subscribe_state(reader, name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  uint32_t changes = kstate_get_state_changes(reader);
+  uint32_t data[1024];
+  rv = kstate_read_history(reader, &changes, data, sizeof(data));
+  ck_assert_int_eq(rv, -EAGAIN);
+
+  uint32_t ii;
+  for (ii = 1; ii <= 3; ii++)
+    ck_assert_int_eq(commit_uint32(writer, ii * 10), 0);
+  for (ii = 1; ii <= 3; ii++) {
+    rv = kstate_read_history(reader, &changes, data, sizeof(data));
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(changes, ii);
+    ck_assert_int_eq(data[0], ii * 10);
+  }
+  rv = kstate_read_history(reader, &changes, data, sizeof(data));
+  ck_assert_int_eq(rv, -EAGAIN);
+
+  // If we fall too far behind, we're told, and carry on from the oldest
+  // version that's left
+  for (ii = 4; ii <= 9; ii++)
+    ck_assert_int_eq(commit_uint32(writer, ii * 10), 0);
+  rv = kstate_read_history(reader, &changes, data, sizeof(data));
+  ck_assert_int_eq(rv, -EOVERFLOW);
+  ck_assert_int_eq(changes, 5);
+  for (ii = 6; ii <= 9; ii++) {
+    rv = kstate_read_history(reader, &changes, data, sizeof(data));
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(data[0], ii * 10);
+  }
+  ck_assert_int_eq(changes, kstate_get_state_changes(reader));
+
+  rv = kstate_read_history(reader, &changes, data, 4);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  // Everyone has to agree how long the history is
+  kstate_state_p other = kstate_new_state();
+  rv = kstate_set_history(other, 8);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(other, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_arena(other, "Arena", 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_history(other, KSTATE_MAX_HISTORY + 1);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_state(&other);
+
+  kstate_free_state(&reader);
+  kstate_free_state(&writer);
+  free(name);
+}
+END_TEST
+
+// The start of a state's header, as laid out in kstate.c, so that a test
+// can move a state's generation on without making billions of commits, or
+// leave it looking as if someone died whilst committing to it
+struct state_header_start {
+  uint32_t   magic;
+  uint32_t   layout;
+  uint32_t   flags;
+  uint32_t   changes;
+  uint64_t   current;
+  uint64_t   length;
+  uint32_t   refs[8];
+  uint32_t   waiters;
+  uint32_t   history;
+  uint32_t   replicas;
+  uint32_t   locker;
+};
+
+static struct state_header_start *map_state_header(const char *name)
+{
+  char shm_name[300];
+  sprintf(shm_name, "/kstate.%s", name);
+  int fd = shm_open(shm_name, O_RDWR, 0);
+  if (fd < 0)
+    return NULL;
+  struct state_header_start *header = mmap(NULL, sizeof(*header),
+                                           PROT_READ|PROT_WRITE, MAP_SHARED,
+                                           fd, 0);
+  close(fd);
+  return header == MAP_FAILED ? NULL : header;
+}
+
+START_TEST(history_survives_generation_wrapping)
+{
+  kstate_state_p writer = kstate_new_state();
+  kstate_state_p reader = kstate_new_state();
+  char *name = kstate_get_unique_name("History");
+  int rv = kstate_set_history(writer, 3);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(writer, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+
+  // Put the generation just before its bottom 32 bits wrap around, which
+  // with a history that isn't a power of two length used to put the next
+  // two versions in the same entry
+  struct state_header_start *header = map_state_header(name);
+  fail_if(header == NULL);
+  uint64_t generation = 0xFFFFFFFEull;
+  header->current = generation << 8 | (header->current & 0xFF);
+  header->changes = (uint32_t)generation;
+  munmap(header, sizeof(*header));
+
+  rv = kstate_subscribe_state(reader, name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  uint32_t changes = kstate_get_state_changes(reader);
+  ck_assert_int_eq(changes, 0xFFFFFFFE);
+
+  uint32_t data[1024];
+  uint32_t ii;
+  for (ii = 1; ii <= 3; ii++)
+    ck_assert_int_eq(commit_uint32(writer, ii * 10), 0);
+  for (ii = 1; ii <= 3; ii++) {
+    rv = kstate_read_history(reader, &changes, data, sizeof(data));
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(changes, (uint32_t)(generation + ii));
+    ck_assert_int_eq(data[0], ii * 10);
+  }
+  rv = kstate_read_history(reader, &changes, data, sizeof(data));
+  ck_assert_int_eq(rv, -EAGAIN);
+
+  kstate_free_state(&reader);
+  kstate_free_state(&writer);
+  free(name);
+}
+END_TEST
+
+START_TEST(dead_lockers_are_tidied_up_after)
+{
+  kstate_state_p writer = kstate_new_state();
+  char *name = kstate_get_unique_name("History");
+  int rv = kstate_set_history(writer, 3);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(writer, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(commit_uint32(writer, 1), 0);
+
+  // The child takes the second entry in the subscriber table, and dies
+  // without leaving it
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    kstate_state_p child = kstate_new_state();
+    if (kstate_subscribe_state(child, name, KSTATE_WRITE)) _exit(1);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+  // Make it look as if it died part way through a commit
+  struct state_header_start *header = map_state_header(name);
+  fail_if(header == NULL);
+  header->locker = 2;
+  __atomic_or_fetch(&header->current, 0x80, __ATOMIC_SEQ_CST);
+
+  // Finding the state locked, we notice who locked it has gone, and
+  // unlock it, as it was before
+  ck_assert_int_eq(commit_uint32(writer, 2), -EPERM);
+  ck_assert_int_eq(header->current & 0x80, 0);
+  ck_assert_int_eq(header->locker, 0);
+  const uint32_t *data = kstate_get_state_ptr(writer);
+  ck_assert_int_eq(data[0], 1);
+  ck_assert_int_eq(commit_uint32(writer, 2), 0);
+  data = kstate_get_state_ptr(writer);
+  ck_assert_int_eq(data[0], 2);
+  munmap(header, sizeof(*header));
+
+  kstate_free_state(&writer);
+  free(name);
+}
+END_TEST
+
+START_TEST(batch_commits_many_updates_at_once)
+{
+  kstate_state_p state = kstate_new_state();
+  char *name = kstate_get_unique_name("Batch");
+  int rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *value = kstate_get_state_ptr(state);
+  uint32_t changes = kstate_get_state_changes(state);
+
+  kstate_batch_p batch = kstate_new_batch();
+  rv = kstate_start_batch(batch, state, 10, 0);
+  ck_assert_int_eq(rv, 0);
+  int ii;
+  for (ii = 0; ii < 25; ii++) {
+    rv = kstate_batch_update(batch, increment_fn, NULL);
+    ck_assert_int_eq(rv, 0);
+  }
+  // Only whole batches have been committed
+  ck_assert_int_eq(kstate_get_state_changes(state), changes + 2);
+  value = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*value, 20);
+
+  // We can't start the batch again whilst it still has updates
+  rv = kstate_start_batch(batch, state, 0, 1000);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_flush_batch(batch);
+  ck_assert_int_eq(rv, 0);
+  value = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*value, 25);
+  ck_assert_int_eq(kstate_get_state_changes(state), changes + 3);
+
+  // And with a deadline, polling commits once it's passed
+  rv = kstate_start_batch(batch, state, 0, 1000);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_batch_update(batch, increment_fn, NULL);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_changes(state), changes + 3);
+  usleep(2000);
+  rv = kstate_poll_batch(batch);
+  ck_assert_int_eq(rv, 0);
+  ck_assert_int_eq(kstate_get_state_changes(state), changes + 4);
+  value = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*value, 26);
+
+  // Freeing the batch discards anything it hasn't committed
+  rv = kstate_batch_update(batch, refuse_fn, NULL);
+  ck_assert_int_eq(rv, 42);
+  kstate_free_batch(&batch);
+  ck_assert(batch == NULL);
+  value = kstate_get_state_ptr(state);
+  ck_assert_int_eq(*value, 26);
+
+  kstate_state_p reader = kstate_new_state();
+  rv = kstate_subscribe_state(reader, name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  batch = kstate_new_batch();
+  rv = kstate_start_batch(batch, reader, 10, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_batch(&batch);
+  kstate_free_state(&reader);
+
+  kstate_free_state(&state);
+  free(name);
+}
+END_TEST
+
+START_TEST(state_mappings_can_be_populated_and_locked)
+{
+  char *name = kstate_get_unique_name("Locked");
+  kstate_state_p state = kstate_new_state();
+  int rv = kstate_set_mapping(state, 4);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_set_mapping(state, KSTATE_MAP_POPULATE | KSTATE_MAP_LOCKED);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_arena(state, "Arena", 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_mapping(state, 0);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  // A lazy transaction works on its slot, as for any other transaction
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  *t_ptr = 99;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&transaction);
+
+  // and anyone else can map it however they like
+  kstate_state_p reader = kstate_new_state();
+  rv = kstate_set_mapping(reader, KSTATE_MAP_POPULATE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(reader, name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *s_ptr = kstate_get_state_ptr(reader);
+  ck_assert_int_eq(*s_ptr, 99);
+
+  kstate_free_state(&reader);
+  kstate_free_state(&state);
+  free(name);
+}
+END_TEST
+
+static uint32_t read_uint32(kstate_state_p state, int index)
+{
+  kstate_transaction_p transaction = kstate_new_transaction();
+  int rv = kstate_start_transaction(transaction, state, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *ptr = kstate_get_transaction_ptr(transaction);
+  uint32_t value = ptr[index];
+  kstate_free_transaction(&transaction);
+  return value;
+}
+
+// Wait (for up to five seconds) for 'state' to hold 'value'
+static bool wait_for_uint32(kstate_state_p state, uint32_t value)
+{
+  int ii;
+  for (ii = 0; ii < 100; ii++) {
+    uint32_t changes = kstate_get_state_changes(state);
+    if (read_uint32(state, 0) == value && read_uint32(state, 1000) == value)
+      return true;
+    (void) kstate_wait_for_state_change(state, changes, 50);
+  }
+  return false;
+}
+
+START_TEST(replicated_state_follows_its_source)
+{
+  char *src_name = kstate_get_unique_name("Source");
+  char *dst_name = kstate_get_unique_name("Replica");
+
+  kstate_state_p source = kstate_new_state();
+  int rv = kstate_replicate_state(source, "127.0.0.1:1", 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(source, src_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = commit_uint32(source, 1);
+  ck_assert_int_eq(rv, 0);
+
+  kstate_state_p replica = kstate_new_state();
+  rv = kstate_subscribe_state(replica, dst_name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_receive_state(replica, "no-port");
+  ck_assert_int_eq(rv, -EINVAL);
+  int port = kstate_receive_state(replica, "127.0.0.1:0");
+  ck_assert_int_gt(port, 0);
+  rv = kstate_receive_state(replica, "127.0.0.1:0");
+  ck_assert_int_eq(rv, -EBUSY);
+
+  // The replica starts with all of the source
+  char address[32];
+  snprintf(address, sizeof(address), "127.0.0.1:%d", port);
+  rv = kstate_replicate_state(source, address, 0);
+  ck_assert_int_eq(rv, 0);
+  ck_assert(wait_for_uint32(replica, 1));
+
+  // and then follows it as it changes
+  int ii;
+  for (ii = 2; ii < 10; ii++) {
+    rv = commit_uint32(source, ii);
+    ck_assert_int_eq(rv, 0);
+  }
+  ck_assert(wait_for_uint32(replica, 9));
+
+  kstate_free_state(&source);
+  kstate_free_state(&replica);
+  free(src_name);
+  free(dst_name);
+}
+END_TEST
+
+START_TEST(readers_see_commits_through_numa_replicas)
+{
+  char *name = kstate_get_unique_name("Replicas");
+
+  // A state that already exists can't be given replicas afterwards
+  kstate_state_p plain = kstate_new_state();
+  int rv = kstate_subscribe_state(plain, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  kstate_state_p state = kstate_new_state();
+  rv = kstate_set_replicas(state, true);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, -EINVAL);
+  kstate_free_state(&plain);
+
+  rv = kstate_set_arena(state, "Arena", 0);
+  ck_assert_int_eq(rv, -EINVAL);
+  rv = kstate_subscribe_state(state, name, KSTATE_WRITE);
+  ck_assert_int_eq(rv, 0);
+  rv = kstate_set_replicas(state, false);
+  ck_assert_int_eq(rv, -EINVAL);
+
+  kstate_state_p reader = kstate_new_state();
+  rv = kstate_subscribe_state(reader, name, KSTATE_READ);
+  ck_assert_int_eq(rv, 0);
+
+  // Each way of reading the state sees each commit
+  int ii;
+  for (ii = 1; ii < 20; ii++) {
+    rv = commit_uint32(state, ii);
+    ck_assert_int_eq(rv, 0);
+    uint32_t *s_ptr = kstate_get_state_ptr(reader);
+    ck_assert_int_eq(s_ptr[0], ii);
+    ck_assert_int_eq(s_ptr[1000], ii);
+    ck_assert_int_eq(read_uint32(reader, 1000), ii);
+    uint64_t token;
+    const uint32_t *r_ptr = kstate_read_begin(reader, &token);
+    ck_assert_int_eq(r_ptr[0], ii);
+    ck_assert(!kstate_read_retry(reader, token));
+  }
+
+  // including what a lazy transaction starts from, and what it commits
+  kstate_transaction_p transaction = kstate_new_transaction();
+  rv = kstate_start_transaction(transaction, state, KSTATE_WRITE|KSTATE_LAZY);
+  ck_assert_int_eq(rv, 0);
+  uint32_t *t_ptr = kstate_get_transaction_ptr(transaction);
+  ck_assert_int_eq(t_ptr[1000], 19);
+  t_ptr[0] = 99;
+  rv = kstate_commit_transaction(transaction);
+  ck_assert_int_eq(rv, 0);
+  kstate_free_transaction(&transaction);
+  ck_assert_int_eq(read_uint32(reader, 0), 99);
+  ck_assert_int_eq(read_uint32(reader, 1000), 19);
+
+  kstate_free_state(&reader);
+  kstate_free_state(&state);
+  free(name);
+}
+END_TEST
+
 Suite *test_kstate_suite(void)
 {
   Suite *s = suite_create("Kstate");
@@ -1594,6 +4081,7 @@ Suite *test_kstate_suite(void)
   tcase_add_test(tc_core, commit_freed_transaction_fails);
   tcase_add_test(tc_core, transaction_aborted_after_state_freed);
   tcase_add_test(tc_core, transaction_committed_after_state_freed);
+  tcase_add_test(tc_core, transaction_name_survives_state_being_freed);
   tcase_add_test(tc_core, states_can_be_distinguished);
   tcase_add_test(tc_core, transactions_can_be_distinguished);
   tcase_add_test(tc_core, nested_transactions_same_state_commit_commit);
@@ -1609,6 +4097,58 @@ Suite *test_kstate_suite(void)
   tcase_add_test(tc_core, write_to_writeable_transaction_not_visible_after_abort);
   tcase_add_test(tc_core, commit_when_state_changed_during_transaction_fails);
   tcase_add_test(tc_core, abort_when_state_changed_during_transaction_succeeds);
+  tcase_add_test(tc_core, commit_when_state_changed_and_restored_during_transaction_fails);
+  tcase_add_test(tc_core, concurrent_commits_from_several_processes_are_not_lost);
+  tcase_add_test(tc_core, many_commits_in_succession);
+  tcase_add_test(tc_core, too_many_write_transactions_fails_until_one_ends);
+  tcase_add_test(tc_core, read_transaction_does_not_copy_state);
+  tcase_add_test(tc_core, read_transaction_on_readonly_state);
+  tcase_add_test(tc_core, read_transaction_not_affected_by_later_commits);
+  tcase_add_test(tc_core, start_lazy_transaction_without_read_or_write_fails);
+  tcase_add_test(tc_core, lazy_write_transaction_visible_after_commit);
+  tcase_add_test(tc_core, large_lazy_write_transaction_commits_all_of_it);
+  tcase_add_test(tc_core, lazy_write_transaction_not_visible_after_abort);
+  tcase_add_test(tc_core, lazy_read_transaction_is_just_a_read_transaction);
+  tcase_add_test(tc_core, mark_dirty_on_read_transaction_fails);
+  tcase_add_test(tc_core, mark_dirty_outside_state_fails);
+  tcase_add_test(tc_core, commit_with_many_dirty_ranges);
+  tcase_add_test(tc_core, set_size_on_subscribed_state_fails);
+  tcase_add_test(tc_core, large_state_can_be_written_and_read);
+  tcase_add_test(tc_core, subscribe_with_wrong_size_for_existing_state_fails);
+  tcase_add_test(tc_core, huge_state_can_be_written);
+  tcase_add_test(tc_core, wait_for_unchanged_state_times_out);
+  tcase_add_test(tc_core, wait_is_woken_by_commit_in_another_process);
+  tcase_add_test(tc_core, rate_limited_state_sees_changes_at_most_at_that_rate);
+  tcase_add_test(tc_core, commit_on_several_states);
+  tcase_add_test(tc_core, commit_on_several_states_fails_if_any_changed);
+  tcase_add_test(tc_core, add_state_to_transaction_fails_fast_if_already_changed);
+  tcase_add_test(tc_core, concurrent_commits_on_several_states_are_atomic);
+  tcase_add_test(tc_core, transaction_using_fn_commits_or_aborts);
+  tcase_add_test(tc_core, transaction_using_fn_retries_after_conflict);
+  tcase_add_test(tc_core, concurrent_transactions_using_fn_are_not_lost);
+  tcase_add_test(tc_core, log_fn_is_given_errors);
+  tcase_add_test(tc_core, log_level_controls_what_is_logged);
+  tcase_add_test(tc_core, contention_is_not_logged);
+  tcase_add_test(tc_core, state_stats_count_transactions);
+  tcase_add_test(tc_core, read_begin_and_retry);
+  tcase_add_test(tc_core, read_begin_and_retry_never_sees_torn_data);
+  tcase_add_test(tc_core, state_lasts_until_its_last_subscriber_leaves);
+  tcase_add_test(tc_core, dead_subscribers_are_tidied_up_after);
+  tcase_add_test(tc_core, states_can_share_an_arena);
+  tcase_add_test(tc_core, arena_has_room_for_so_many_states);
+  tcase_add_test(tc_core, dead_arena_subscribers_are_tidied_up_after);
+  tcase_add_test(tc_core, threads_can_share_a_state);
+  tcase_add_test(tc_core, persistent_state_survives_unsubscribing);
+  tcase_add_test(tc_core, persistent_state_flushes_in_background);
+  tcase_add_test(tc_core, journaled_state_is_restored);
+  tcase_add_test(tc_core, journal_can_be_read_as_at_a_time);
+  tcase_add_test(tc_core, history_holds_every_change);
+  tcase_add_test(tc_core, history_survives_generation_wrapping);
+  tcase_add_test(tc_core, dead_lockers_are_tidied_up_after);
+  tcase_add_test(tc_core, batch_commits_many_updates_at_once);
+  tcase_add_test(tc_core, state_mappings_can_be_populated_and_locked);
+  tcase_add_test(tc_core, replicated_state_follows_its_source);
+  tcase_add_test(tc_core, readers_see_commits_through_numa_replicas);
   // END TESTS
   suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,85 @@
+/*
+ * A check that kstate.hpp compiles cleanly, and works, as C++11.
+ *
+ * This doesn't use check, so that it needs nothing more than a C++ compiler.
+ * The C library itself is tested by check_kstate.c.
+ */
+
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS State library.
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2013
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "kstate.hpp"
+
+// Not assert, so that it still checks if NDEBUG is defined
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+struct Position {
+  double   x, y;
+  uint32_t fix;
+};
+
+int main(void)
+{
+  char *name = kstate_get_unique_name("Position");
+  kstate::State<Position> state;
+  CHECK(state.subscribe(name, KSTATE_WRITE) == 0);
+  CHECK(kstate_get_state_size(state.get()) == sizeof(Position));
+
+  {
+    kstate::WriteTransaction<Position> write(state);
+    CHECK(write);
+    CHECK(write.set(&Position::x, 1.5) == 0);
+    write.modify(&Position::fix) = 3;
+    CHECK(write.commit() == 0);
+  }
+
+  Position now = state.load();
+  CHECK(now.x == 1.5);
+  CHECK(now.y == 0);
+  CHECK(now.fix == 3);
+  CHECK(state.changes() == 1);
+
+  // A transaction that didn't start can't be written to
+  kstate::State<Position> unsubscribed;
+  kstate::WriteTransaction<Position> write(unsubscribed);
+  CHECK(!write);
+  CHECK(write.set(&Position::y, 2.0) == -EINVAL);
+
+  state.unsubscribe();
+  free(name);
+  printf("kstate.hpp is GREEN\n");
+  return 0;
+}
@@ -26,8 +26,11 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>   // for va_list
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>   // for offsetof
+#include <inttypes.h> // for PRIu64
 #include <errno.h>
 #include <ctype.h>    // for isalnum
 #include <time.h>     // for strftime
@@ -35,272 +38,1542 @@
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <sched.h>    // for sched_yield
+#include <signal.h>   // for kill
 
 // For shm_open and friends
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h> // for flock
 #include <fcntl.h>
 
+// For futexes
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// For placing NUMA replicas (via syscall, so we don't need libnuma)
+#include <linux/mempolicy.h>
+
+// For flushing persistent states in the background
+#include <pthread.h>
+
+// For replicating states to other hosts
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+// For copying large states without filling the cache
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "kstate.h"
 
+// Each state's shared memory object starts with a header, which occupies
+// the first page. That is followed by KSTATE_NUM_SLOTS version slots, each
+// big enough to hold a copy of the state data (rounded up to a whole number
+// of pages). For states of at least KSTATE_HUGE_PAGE_SIZE, the header and
+// slots are instead rounded up to whole huge pages, so that the kernel can
+// back them with huge pages if it is able to.
+//
+// One of the slots holds the current version of the state. The header's
+// 'current' word says which, and also holds a generation number, which is
+// incremented on each commit. A write transaction claims a free slot, copies
+// the current version into it, and works on it directly. Committing is then
+// just an atomic compare-and-exchange of 'current' from the value the
+// transaction started with to (next generation, our slot) - so at most one
+// commit can succeed for each generation, even across processes, without
+// needing a lock, and readers never see a version that is half written.
+//
+// Each slot has a reference count. Anyone who wants to look at a version
+// (including a write transaction, which wants to copy it) must "pin" it
+// by incrementing its count, and then check that it is still current. A
+// write transaction also holds a count on the slot it is writing to. A slot
+// is free when its count is zero and it is not current - being current does
+// not hold a count, so the old version becomes free as soon as a commit
+// replaces it and no-one has it pinned.
+//
+// A transaction on several states can't commit with a single compare-and-
+// exchange. Instead it sets the KSTATE_LOCKED bit in each state's 'current'
+// (by compare-and-exchange, so that fails if anyone else has committed), and
+// only once it has locked all of them does it store their new values. Any
+// other commit on a locked state fails, as its 'current' has changed. (A
+// commit on a state with a history locks it in the same way, whilst it adds
+// its version to the history.) Whoever locks a state records which
+// subscriber they are in its header, so that if they die before unlocking
+// it, it can be unlocked again.
+//
+// The header also has a table of subscribers. Each subscriber counts the pins
+// it holds in its own entry (as well as in the slot's reference count), and
+// the entry records the process id, so that if a process dies, the next
+// subscriber to find that it has gone can release whatever it had pinned.
+// The header's 'users' counts the subscribers, and the last one to leave
+// unlinks the shared memory object.
+//
+// Alternatively, many (small) states can share an arena - a single shared
+// memory object with its own header and subscriber table, an index from
+// state name to entry, an entry for each state, and then each state's slots.
+// Each entry has a state header, as above. The slots start on a page of
+// their own, after all the entries, and are aligned only to cache lines.
+#define KSTATE_MAGIC    0x4B535441      // "KSTA"
+#define KSTATE_LAYOUT   13              // The version of this header layout
+
+#define KSTATE_HUGE_PAGE_SIZE   (2 * 1024 * 1024)
+
+// How many times we start flushing a persistent state again, if it changes
+// whilst we are flushing it (see sync_shm)
+#define KSTATE_SYNC_TRIES       3
+
+// How long we wait for someone else to finish setting up a state's shared
+// memory object, when we're not the one that created it.
+#define KSTATE_SETUP_TRIES      1000    // each of...
+#define KSTATE_SETUP_WAIT_US    1000    // ...this many microseconds
+
+#define KSTATE_NUM_SLOTS        8
+
+// The most NUMA nodes a state can have replicas on (one node mask's worth)
+#define KSTATE_MAX_REPLICAS     64
+
+// Where the kernel says which NUMA nodes there may be
+#define KSTATE_NUMA_NODES_FILE  "/sys/devices/system/node/possible"
+#define KSTATE_SLOT_BITS        8       // The bottom bits of 'current'
+#define KSTATE_LOCKED           (1 << (KSTATE_SLOT_BITS - 1))
+#define KSTATE_SLOT_MASK        (KSTATE_LOCKED - 1)
+
+// How often a persistent state is flushed to its file, by default
+#define KSTATE_DEFAULT_FLUSH_MS 1000
+
+// How many separate altered ("dirty") ranges a transaction remembers. If it
+// is told about more than that, it merges them.
+#define KSTATE_MAX_DIRTY_RANGES 8
+
+// How many subscriptions a state can have at once (in all processes). Each
+// has an entry in the header's subscriber table, which must all fit in the
+// header's page. For an arena, it's how many processes can be using it.
+#define KSTATE_MAX_SUBSCRIBERS  64
+
+// The table's 'users' once the last subscriber has gone, so that no-one
+// else can join it whilst it is being unlinked
+#define KSTATE_USERS_GONE       0x80000000
+
+// A subscriber table entry's 'pid' whilst someone is tidying up after it
+#define KSTATE_REAPING          UINT32_MAX
+
+// An arena's states have this size by default
+#define KSTATE_DEFAULT_ARENA_STATE_SIZE 64
+
+// and it has room for this many of them by default, or at most...
+#define KSTATE_DEFAULT_ARENA_STATES     1024
+#define KSTATE_MAX_ARENA_STATES         (1024 * 1024)
+
+// The longest name (of its shared memory object, including the terminating
+// NUL) a state in an arena can have
+#define KSTATE_ARENA_NAME_LEN   64
+
+// How many different slots (of any of its states) each subscriber to an
+// arena can have a record of pinning at once. Pins beyond that still work,
+// but aren't released if the subscriber's process dies.
+#define KSTATE_ARENA_PINS       32
+
+#define KSTATE_ARENA_MAGIC      0x4B534152      // "KSAR"
+
+// An entry in a subscriber table. For a state with its own shared memory
+// object, each subscription has one, and it records which slots the
+// subscription (and its transactions) have pinned, so that if the process
+// dies, whoever notices can let go of them on its behalf.
+struct kstate_subscriber {
+  uint32_t   pid;         // The subscribing process, or 0 if this is free
+  uint32_t   pins[KSTATE_NUM_SLOTS]; // How many of each slot it has pinned
+  uint64_t   start_time;  // When the process started, or 0 if not known
+};
+
+// Who is using a shared memory object, so that we can tidy up after any of
+// them that die
+struct kstate_subscribers {
+  uint32_t   users;       // How many subscribers, or KSTATE_USERS_GONE
+  struct kstate_subscriber table[KSTATE_MAX_SUBSCRIBERS];
+};
+
+// The header for a state. A state with its own shared memory object has one
+// at the start of it, and each state in an arena has one in its entry.
+struct kstate_header {
+  uint32_t   magic;       // KSTATE_MAGIC, once the header has been set up
+  uint32_t   layout;      // KSTATE_LAYOUT, for the same reason
+  uint32_t   flags;       // Reserved for future use, currently 0
+  uint32_t   changes;     // Incremented after each commit (a futex)
+  uint64_t   current;     // Generation << KSTATE_SLOT_BITS | current slot
+  uint64_t   length;      // The length of the state data, in bytes
+  uint32_t   refs[KSTATE_NUM_SLOTS]; // Reference counts for each slot
+  uint32_t   waiters;     // How many are waiting on 'changes'
+  uint32_t   history;     // How many versions its history holds, or 0
+  uint32_t   replicas;    // How many NUMA nodes have replicas, or 0
+  uint32_t   locker;      // The subscriber (numbered from 1) that has set
+                          // KSTATE_LOCKED in 'current', or 0
+
+  // Kept on their own cache lines, so that updating them doesn't get in the
+  // way of anyone looking at 'current'
+  struct kstate_stats stats __attribute__((aligned(64)));
+};
+
+// An entry in a state's history. The history follows the state's slots (and
+// their replicas, if any), and each entry is followed by a copy of the
+// version its commit made current.
+struct kstate_history_entry {
+  uint64_t   generation;  // The generation of that version, or 0 whilst the
+                          // entry is being written
+} __attribute__((aligned(64)));
+
+// The header page of a state's own shared memory object
+struct kstate_shm_header {
+  struct kstate_header       state;
+  struct kstate_subscribers  subscribers;
+};
+
+// The header of an arena, which holds many states in one shared memory
+// object. It is followed by an index, which maps a state's name to its entry
+// (each element is an entry number plus one, or 0 if unused), then by the
+// entries themselves, and then by the states' slots, in the same order as
+// the entries. States are added to an arena, but never removed.
+//
+// The magic number and layout come first, as they do for a state.
+struct kstate_arena_header {
+  uint32_t   magic;       // KSTATE_ARENA_MAGIC, once the arena has been set up
+  uint32_t   layout;      // KSTATE_LAYOUT, for the same reason
+  uint32_t   max_states;  // How many entries there are
+  uint32_t   num_states;  // How many of them have been handed out
+  uint64_t   length;      // The length of each state's data, in bytes
+  uint32_t   index_size;  // How many elements the index has (a power of two)
+
+  struct kstate_subscribers subscribers __attribute__((aligned(64)));
+
+  // Each subscriber records the pins it holds on its states' slots in the
+  // row that matches its entry in the subscriber table, so that if its
+  // process dies, whoever notices can let go of them. Each record is 0 if
+  // unused, or a key (see arena_pin_key) in its top 32 bits and how many
+  // pins there are in its bottom 32 bits.
+  uint64_t   pins[KSTATE_MAX_SUBSCRIBERS][KSTATE_ARENA_PINS];
+};
+
+// An entry in an arena. Its state's version slots are amongst the data at
+// the end of the arena (see arena_state_offset).
+struct kstate_arena_entry {
+  struct kstate_header header;
+  char       name[KSTATE_ARENA_NAME_LEN]; // The state's name
+};
+
+// Our mappings of an arena. Each process maps an arena once, however many
+// of its states it subscribes to, and joins its subscribers once.
+struct kstate_arena {
+  struct kstate_arena *next;    // In our list of arenas
+  uint32_t   refs;        // How many of its states' mappings are using us
+  char      *name;        // The name of its shared memory object
+  int        fd;          // The shared memory object itself
+  size_t     length;      // The length of the whole object
+
+  // A mapping of the object, which is writable up to 'data_offset', and
+  // beyond that only for the states we have subscribed to for write, and a
+  // read-only mapping
+  struct kstate_arena_header *header;
+  void      *ro_addr;
+  size_t     data_offset; // Where the states' slots start
+
+  struct kstate_subscriber *subscriber; // Our entry in its table
+  pid_t      pid;         // The process the entry belongs to
+};
+
+// Our mappings of a state's shared memory object. These are made when we
+// subscribe to a state, and are shared by the state and any transactions
+// started on it, so that starting a transaction doesn't need to open and map
+// the shared memory object all over again. They are reference counted, so
+// that a transaction can outlive the state it was started on.
+//
+// A state in an arena has these too, but they are just its part of the
+// arena's mappings.
+struct kstate_shm {
+  uint32_t   refs;        // How many states and transactions are using us
+                          // (atomic, as they may be in different threads)
+  char      *name;        // The name of the shared memory object
+  int        fd;          // The shared memory object itself
+  size_t     map_length;  // The length of the state data (in each slot)
+
+  struct kstate_header *header; // A writable mapping of the object
+  size_t     rw_length;   // which may just be the header, if we're read-only
+  void      *ro_addr;     // A read-only mapping of the whole object
+  size_t     first_slot;  // The offset of the first slot from the header
+  size_t     slot_stride; // and the distance between slots
+  size_t     read_slot;   // The offset of the first slot we read from, which
+                          // is in our NUMA node's replica, if it has one
+  uint32_t   history;     // How many versions its history holds, or 0
+  uint32_t   replicas;    // How many NUMA nodes have replicas, or 0
+
+  struct kstate_subscribers *subscribers; // Its subscriber table, and
+  struct kstate_subscriber  *subscriber;  // our entry in it
+  pid_t      pid;         // The process the entry belongs to
+  bool       persistent;  // If so, the object is never unlinked
+  bool       locked;      // Are our mappings locked into memory?
+  uint32_t  *pins;        // Where we count the slots we have pinned, or
+                          // NULL for a state in an arena, which has
+  uint64_t  *arena_pins;  // our row of pin records in the arena instead
+
+  struct kstate_arena *arena;   // If the state is in an arena, or NULL
+  uint32_t   arena_entry; // and its entry number there
+
+  struct kstate_flusher *flusher; // For a persistent state, or NULL
+  struct kstate_journal *journal; // For a journaled state, or NULL
+};
+
+// A thread that flushes a persistent state's file every so often, so that
+// committing doesn't have to wait for the disk. It belongs to the state's
+// mappings, and stops when they are released.
+struct kstate_flusher {
+  struct kstate_shm *shm;       // What we're flushing
+  uint32_t   interval_ms;       // Flush at least this often, or 0
+  uint32_t   commits;           // Flush after this many commits, or 0
+  uint32_t   flushed;           // The change count when we last flushed
+
+  pthread_t  thread;
+  pthread_mutex_t lock;         // Protects 'stop' and 'wake'
+  pthread_cond_t  cond;         // Signalled when either is set
+  bool       stop;              // Time to stop
+  bool       wake;              // Time to flush
+};
+
 struct kstate_state {
-  char      *name;        // The name of our shared memory object
+  char      *name;        // The name of our shared memory object (which
+                          // belongs to 'shm', once we have subscribed)
   uint32_t   permissions; // Our idea of its permissions
 
   uint32_t   id;          // A simple id for this state
+  size_t     size;        // The size asked for by kstate_set_size, or 0
+  uint32_t   history;     // The history asked for by kstate_set_history, or 0
+  uint32_t   mapping;     // How kstate_set_mapping asked for it to be mapped
+  bool       replicas;    // Did kstate_set_replicas ask for NUMA replicas?
+
+  // If kstate_set_persistent has been called, the file that holds the state,
+  // and how we should flush it
+  char      *filename;
+  uint32_t   flush_interval_ms;
+  uint32_t   flush_commits;
+
+  // If kstate_set_journal has been called, the file to journal it to
+  char      *journal_filename;
+  uint32_t   checkpoint_records;
 
-  void      *map_addr;    // The shared memory associated with it
-  size_t     map_length;  // and how much shared memory there is
+  // If kstate_set_arena has been called, the name of the arena's shared
+  // memory object, and how many states it should have room for
+  char      *arena_name;
+  uint32_t   arena_states;
+
+  struct kstate_shm *shm; // Our mappings of the shared memory object
+
+  // If we're sending the state to another host, or receiving it from one
+  struct kstate_replication *replication;
+
+  // If we've been asked to see the state at most 'max_rate' times a second,
+  // then we look at the version that was current at our last "tick", which
+  // we keep pinned so that it doesn't get reused.
+  uint32_t   max_rate;    // Ticks per second, or 0 for no limit
+  pthread_mutex_t tick_lock; // Any thread using the state may move it on
+  bool       tick_pinned; // Have we got a version pinned?
+  uint64_t   tick_current;// The 'current' at our last tick
+  uint32_t   tick_changes;// and the change count at that time
+  uint64_t   next_tick;   // When our next tick is due (CLOCK_MONOTONIC ns)
 };
 
 
 struct kstate_transaction {
-  char      *name;        // The name of our shared memory object
+  char      *name;        // The name of our shared memory object (which
+                          // belongs to 'shm')
 
   uint32_t   id;          // A simple id for this transaction
   uint32_t   permissions; // The permissions for this transaction
 
-  void      *state_map_addr; // The shared memory associated with the state
-  uint8_t   *state_map_copy; // A copy of the original values therein
-  void      *map_addr;       // Our own shared memory, starting as another copy
-  size_t     map_length;     // The length of those
+  // The states we are a transaction on. The first is the state we were
+  // started on, and any others were added by kstate_add_state_to_transaction.
+  uint32_t   num_parts;
+  struct kstate_part {
+    struct kstate_shm *shm;  // The mappings of the state's shared memory
+    uint64_t   current;      // The state's 'current' when we started
+    bool       pinned;       // Do we have that version pinned?
+    int        slot;         // The slot we're writing to, or -1
+    void      *map_addr;     // Our version of the state data
+    bool       lazy;         // Is that a private copy-on-write mapping?
+    bool       copied;       // and if so, has it been copied to our slot?
+  } parts[KSTATE_MAX_TRANSACTION_STATES];
+
+  uint64_t   start_ns;    // When a write transaction started, for stats
+
+  // The parts of the (first) state's data we've been told we have altered.
+  // If there are none, we assume any of it may have been altered.
+  uint32_t   num_dirty;
+  struct kstate_range {
+    size_t   offset;
+    size_t   length;
+  } dirty[KSTATE_MAX_DIRTY_RANGES];
 };
 
-static int num_digits(int value)
+// A batch of updates to a state, which are made within one write transaction
+// and committed together.
+struct kstate_batch {
+  kstate_state_p state;   // The state we're updating, or NULL
+  uint32_t   max_updates; // Commit after this many updates, or 0
+  uint32_t   max_delay_us;// or this long after the first of them, or 0
+
+  uint32_t   updates;     // How many updates the transaction holds
+  uint64_t   first_ns;    // When the first of them was made
+
+  struct kstate_transaction transaction;
+};
+
+/*
+ * Return the alignment of the header and slots in a shared memory object,
+ * given the length of the state data.
+ *
+ * That's normally a page, but large states are aligned to huge pages.
+ */
+static size_t slot_align(size_t map_length)
 {
-  int count = 0;
-  do
-  {
-    ++count;
-    value /= 10;
-  }
-  while (value);
-  return count;
+  if (map_length >= KSTATE_HUGE_PAGE_SIZE)
+    return KSTATE_HUGE_PAGE_SIZE;
+  else
+    return sysconf(_SC_PAGESIZE);
 }
 
 /*
- * Given a state name, is it valid?
+ * Return the size of the header at the start of a shared memory object.
  *
- * Returns the name length if it's OK, 0 if it's naughty
+ * We give the header a page (or huge page) to itself, so that the state data
+ * that follows it is aligned.
  */
-static size_t check_state_name(const char *caller, const char *name)
+static size_t header_size(size_t map_length)
 {
-  size_t ii;
-  int dot_at = 1;
+  return slot_align(map_length);
+}
 
-  if (name == NULL) {
-    fprintf(stderr, "!!! %s: State name may not be NULL\n", caller);
-    return 0;
-  }
+/*
+ * Return the distance between the start of each slot.
+ */
+static size_t slot_size(size_t map_length)
+{
+  size_t align = slot_align(map_length);
+  return (map_length + align - 1) & ~(align - 1);
+}
 
-  size_t name_len = strlen(name);
+/*
+ * Return the distance between the start of each entry in a state's history.
+ */
+static size_t history_entry_size(size_t map_length)
+{
+  size_t align = __alignof__(struct kstate_history_entry);
+  return sizeof(struct kstate_history_entry) +
+         ((map_length + align - 1) & ~(align - 1));
+}
 
-  if (name_len == 0) {
-    fprintf(stderr, "!!! %s: State name may not be zero length\n", caller);
-    return 0;
-  }
-  if (name_len > KSTATE_MAX_NAME_LEN) {
-    // Would it be more helpful to give all the characters?
-    // Is anyone reading this?
-    fprintf(stderr, "!!! %s: State name '%.5s..%s' is %u"
-            " characters long, but the maximum length is %d characters\n",
-            caller, name, &name[name_len-5],
-            (unsigned) name_len, KSTATE_MAX_NAME_LEN);
-    return 0;
-  }
+/*
+ * Return the offset of a NUMA node's replica of the version slots, which
+ * follow the slots themselves.
+ */
+static size_t replica_offset(size_t map_length, uint32_t node)
+{
+  return header_size(map_length) +
+         (1 + node) * KSTATE_NUM_SLOTS * slot_size(map_length);
+}
 
-  if (name[0] == '.' || name[name_len-1] == '.') {
-    fprintf(stderr, "!!! %s: State name '%s' may not start or"
-            " end with '.'\n", caller, name);
-    return 0;
-  }
+/*
+ * Return the total size of a shared memory object, header and all, given
+ * the length of the state data, how many versions its history holds, and
+ * how many NUMA nodes have replicas of its slots.
+ */
+static size_t shm_size(size_t map_length, uint32_t history, uint32_t replicas)
+{
+  return replica_offset(map_length, replicas) +
+         history * history_entry_size(map_length);
+}
 
-  for (ii = 0; ii < name_len; ii++) {
-    if (name[ii] == '.') {
-      if (dot_at == ii - 1) {
-        fprintf(stderr, "!!! %s: State name '%s' may not have"
-                " adjacent '.'s\n", caller, name);
-        return 0;
-      }
-      dot_at = ii;
-    } else if (!isalnum(name[ii])) {
-      fprintf(stderr, "!!! %s: State name '%s' may not"
-              " contain '%c' (not alphanumeric)\n", caller, name, name[ii]);
-      return 0;
-    }
-  }
-  return name_len;
+/*
+ * Return the address of a slot's data, given the address of the state's
+ * header in the mapping it is in (which may be one of an arena's mappings).
+ */
+static void *slot_data(struct kstate_shm *shm, void *base, int slot)
+{
+  return (uint8_t *)base + shm->first_slot + slot * shm->slot_stride;
 }
 
 /*
- * Return a kstate state name.
+ * Return the address of a slot's data for reading, in our read-only mapping.
  *
- * Returns NULL if it is not possible to make such a name.
+ * This is in the replica on our NUMA node, if the state has replicas.
  */
-static int new_state_name(const char *caller, const char *name, char **state_name)
+static const void *read_data(struct kstate_shm *shm, int slot)
 {
-  if (name == NULL) {
-    fprintf(stderr, "!!! %s: Supplied 'name' may not be NULL\n", caller);
-    return -EINVAL;
-  }
-
-  size_t name_len = check_state_name(caller, name);
-  if (name_len == 0) {
-    return -EINVAL;
-  }
-
-  char *new = malloc(1 + 6 + 1 + name_len + 1);
-  if (new == NULL) return -ENOMEM;
-  sprintf(new, "/kstate.%s", name);
-
-  *state_name = new;
-
-  return 0;
+  return (uint8_t *)shm->ro_addr + shm->read_slot + slot * shm->slot_stride;
 }
 
 /*
- * Return a unique valid state name starting with prefix.
- *
- * The name is composed of:
- *
- * * the normal kstate name prefix
- * * the prefix string
- * * the number of microseconds since the epoch
- * * our process id
- * * a statically increasing integer
- *
- * separated by dots. Thus it is only as "unique" as afforded by the
- * accuracy of gettimeofday - i.e., it relies on the apparent time
- * thus reported having changed.
- *
- * For most purposes, this should be sufficient.
- *
- * The caller is responsible for freeing the returned string.
+ * Return the history entry for a generation, given the address of the
+ * state's header in one of our mappings.
  *
- * Returns NULL if it is not possible to make such a name with the given
- * prefix.
+ * This must be given the whole generation, and not just its bottom 32 bits
+ * (which is all the change count holds), as otherwise a history whose length
+ * isn't a power of two would jump when they wrap around.
  */
-extern char *kstate_get_unique_name(const char *prefix)
+static struct kstate_history_entry *history_entry(struct kstate_shm *shm,
+                                                  void              *base,
+                                                  uint64_t           generation)
 {
-  static uint32_t extra = 0;
+  size_t offset = replica_offset(shm->map_length, shm->replicas) +
+                  (generation % shm->history) *
+                  history_entry_size(shm->map_length);
+  return (struct kstate_history_entry *)((uint8_t *)base + offset);
+}
 
-  if (prefix == NULL) {
-    fprintf(stderr, "!!! kstate_get_unique_name: Prefix may not be NULL\n");
-    return NULL;
-  }
+// Copies of at least this much state data, which whoever makes them won't
+// be reading again soon, are made with non-temporal (streaming) stores, so
+// that they don't push everything else out of the cache...
+#define KSTATE_STREAM_MIN       (256 * 1024)
 
-  size_t prefix_len = strlen(prefix);
+// ...and a result that must be both compared and copied is done in chunks
+// of this size, so that each chunk is still in the cache when it is copied.
+#define KSTATE_STREAM_CHUNK     4096
 
-  struct timeval tv;
-  int rv = gettimeofday(&tv, NULL);
-  if (rv) {
-    fprintf(stderr, "!!! kstate_get_unique_name: Error getting time-of-day: %d %s\n",
-            errno, strerror(errno));
-    return NULL;
+#if defined(__x86_64__)
+static void stream_copy_sse2(void *dst, const void *src, size_t length)
+{
+  uint8_t *to = dst;
+  const uint8_t *from = src;
+  size_t ii;
+  // The stores must be aligned, though the loads needn't be
+  for (ii = 0; ii + 64 <= length && ((uintptr_t)(to + ii) & 15); ii++)
+    to[ii] = from[ii];
+  for (; ii + 64 <= length; ii += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(from + ii));
+    __m128i b = _mm_loadu_si128((const __m128i *)(from + ii + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(from + ii + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(from + ii + 48));
+    _mm_stream_si128((__m128i *)(to + ii), a);
+    _mm_stream_si128((__m128i *)(to + ii + 16), b);
+    _mm_stream_si128((__m128i *)(to + ii + 32), c);
+    _mm_stream_si128((__m128i *)(to + ii + 48), d);
   }
-
-  pid_t pid = getpid();
-
-  char *name = malloc(prefix_len + 1 +
-                      num_digits(tv.tv_sec) + 6 + 1 +
-                      num_digits(pid) + 1 + num_digits(extra) + 1);
-  if (name == NULL) return NULL;
-  sprintf(name, "%s.%ld%06ld.%u.%u", prefix, tv.tv_sec, tv.tv_usec, (uint32_t) pid, extra);
-
-  ++extra;
-
-  return name;
+  memcpy(to + ii, from + ii, length - ii);
+  // Streaming stores aren't ordered with respect to other stores, so make
+  // sure they're done before anyone is told about them
+  _mm_sfence();
 }
 
-static bool state_permissions_are_bad(uint32_t permissions)
+__attribute__((target("avx2")))
+static void stream_copy_avx2(void *dst, const void *src, size_t length)
 {
-  if (!permissions) {
-    fprintf(stderr, "!!! kstate_subscribe_state: Unset permissions bits (0x0) not allowed\n");
-    return true;
-  }
-  else if (permissions & ~(KSTATE_READ | KSTATE_WRITE)) {
-    fprintf(stderr, "!!! kstate_subscribe_state: Unexpected permission bits 0x%x in 0x%x\n",
-            permissions & ~(KSTATE_READ | KSTATE_WRITE),
-            permissions);
-    return true;
+  uint8_t *to = dst;
+  const uint8_t *from = src;
+  size_t ii;
+  for (ii = 0; ii + 64 <= length && ((uintptr_t)(to + ii) & 31); ii++)
+    to[ii] = from[ii];
+  for (; ii + 64 <= length; ii += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(from + ii));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(from + ii + 32));
+    _mm256_stream_si256((__m256i *)(to + ii), a);
+    _mm256_stream_si256((__m256i *)(to + ii + 32), b);
   }
-  return false;
+  memcpy(to + ii, from + ii, length - ii);
+  _mm_sfence();
 }
-
-static bool transaction_permissions_are_bad(uint32_t permissions)
+#elif defined(__aarch64__)
+static void stream_copy_neon(void *dst, const void *src, size_t length)
 {
-  if (!permissions) {
-    fprintf(stderr, "!!! kstate_start_transaction: Unset permissions bits (0x0) not allowed\n");
-    return true;
-  }
-  else if (permissions & ~(KSTATE_READ | KSTATE_WRITE)) {
-    fprintf(stderr, "!!! kstate_start_transaction: Unexpected permission bits 0x%x in 0x%x\n",
-            permissions & ~(KSTATE_READ | KSTATE_WRITE),
-            permissions);
-    return true;
+  uint8_t *to = dst;
+  const uint8_t *from = src;
+  size_t ii;
+  for (ii = 0; ii + 64 <= length; ii += 64) {
+    uint8x16_t a = vld1q_u8(from + ii);
+    uint8x16_t b = vld1q_u8(from + ii + 16);
+    uint8x16_t c = vld1q_u8(from + ii + 32);
+    uint8x16_t d = vld1q_u8(from + ii + 48);
+    // Non-temporal store pairs. These are ordered like any other store, so
+    // the release when the version is made current is enough.
+    __asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+                     "stnp %q3, %q4, [%0, #32]"
+                     : : "r" (to + ii), "w" (a), "w" (b), "w" (c), "w" (d)
+                     : "memory");
   }
-  return false;
+  memcpy(to + ii, from + ii, length - ii);
 }
+#endif
+
+typedef void (*stream_copy_fn_t)(void *dst, const void *src, size_t length);
 
 /*
- * Return true if the given state is subscribed.
+ * Return how to do streaming copies, according to what the CPU we're
+ * running on can do. Without any way of doing them, we just use memcpy.
  */
-extern bool kstate_state_is_subscribed(kstate_state_p state)
+static stream_copy_fn_t get_stream_copy(void)
 {
-  return state != NULL && state->name;
+  static stream_copy_fn_t stream_copy = NULL;
+  // If several threads choose at once, they all choose the same
+  stream_copy_fn_t fn = __atomic_load_n(&stream_copy, __ATOMIC_RELAXED);
+  if (fn == NULL) {
+#if defined(__x86_64__)
+    fn = __builtin_cpu_supports("avx2") ? stream_copy_avx2 : stream_copy_sse2;
+#elif defined(__aarch64__)
+    fn = stream_copy_neon;
+#else
+    fn = (stream_copy_fn_t) memcpy;
+#endif
+    __atomic_store_n(&stream_copy, fn, __ATOMIC_RELAXED);
+  }
+  return fn;
 }
 
 /*
- * Return true if the given transaction is active
+ * Copy state data that whoever is copying it won't be reading again soon -
+ * for instance the result of a transaction, as it is committed.
  */
-extern bool kstate_transaction_is_active(kstate_transaction_p transaction)
+static void copy_out(void *dst, const void *src, size_t length)
 {
-  // The detail of this is bound to change
-  return transaction != NULL && transaction->name;
+  if (length < KSTATE_STREAM_MIN)
+    memcpy(dst, src, length);
+  else
+    get_stream_copy()(dst, src, length);
 }
 
 /*
- * Return a state's name, or NULL if it is not subscribed.
+ * Copy 'src' to 'dst', and return whether 'src' differs from 'orig'.
+ *
+ * This reads each part of 'src' once, rather than once to compare and again
+ * to copy (and having found a difference, it stops comparing). The copy is
+ * made even if there is no difference, so this is only worth it for large
+ * states, where 'src' won't all fit in the cache.
  */
-extern const char *kstate_get_state_name(kstate_state_p state)
+static bool copy_and_compare(void *dst, const void *src, const void *orig,
+                             size_t length)
 {
-  if (kstate_state_is_subscribed(state)) {
-    // We ignore the leading '/kstate.' text, which the user did not specify
-    return &state->name[KSTATE_NAME_PREFIX_LEN];
-  } else {
-    return NULL;
+  stream_copy_fn_t stream_copy = get_stream_copy();
+  uint8_t *to = dst;
+  const uint8_t *from = src;
+  const uint8_t *theirs = orig;
+  bool differs = false;
+  size_t offset;
+  for (offset = 0; offset < length; offset += KSTATE_STREAM_CHUNK) {
+    size_t chunk = length - offset;
+    if (chunk > KSTATE_STREAM_CHUNK)
+      chunk = KSTATE_STREAM_CHUNK;
+    if (!differs)
+      differs = memcmp(from + offset, theirs + offset, chunk) != 0;
+    stream_copy(to + offset, from + offset, chunk);
   }
+  return differs;
 }
 
 /*
- * Return a transaction's name, or NULL if it is not active.
+ * Copy a slot into each NUMA node's replica of it, if the state has any.
+ *
+ * This must be done before the slot is made current - which is safe, as
+ * no-one reads a replica of a slot that isn't pinned or current (or at
+ * least, not without checking it is still current afterwards).
  */
-extern const char *kstate_get_transaction_name(kstate_transaction_p transaction)
+static void copy_to_replicas(struct kstate_shm *shm, int slot)
 {
-  if (kstate_transaction_is_active(transaction)) {
-    // We ignore the leading '/kstate.' text, which the user did not specify
-    return &transaction->name[KSTATE_NAME_PREFIX_LEN];
-  } else {
-    return NULL;
-  }
+  uint32_t node;
+  const void *data = slot_data(shm, shm->header, slot);
+  for (node = 0; node < shm->replicas; node++)
+    copy_out((uint8_t *)shm->header + replica_offset(shm->map_length, node) +
+             slot * shm->slot_stride, data, shm->map_length);
+}
+
+static inline uint64_t get_current(struct kstate_header *header)
+{
+  return __atomic_load_n(&header->current, __ATOMIC_SEQ_CST);
+}
+
+static inline int current_slot(uint64_t current)
+{
+  return current & KSTATE_SLOT_MASK;
+}
+
+static inline uint64_t next_current(uint64_t current, int slot)
+{
+  return ((current >> KSTATE_SLOT_BITS) + 1) << KSTATE_SLOT_BITS | slot;
 }
 
 /*
- * Return a state's permissions, or 0 if it is not subscribed.
+ * Return the key for a pin record in an arena, for a slot of the state with
+ * the given entry number. It is never 0, which marks an unused record.
  */
-extern uint32_t kstate_get_state_permissions(kstate_state_p state)
+static inline uint64_t arena_pin_key(uint32_t entry, int slot)
 {
-  if (kstate_state_is_subscribed(state)) {
-    return state->permissions;
-  } else {
-    return 0;
-  }
+  return (uint64_t)((entry << KSTATE_SLOT_BITS | slot) + 1) << 32;
 }
 
 /*
- * Return a transaction's permissions, or 0 if it is not active.
+ * Record that we have pinned a slot of a state in an arena.
+ *
+ * Other threads in our process may be recording pins in the same row, so
+ * each record is only ever changed as a whole. We look for a record of the
+ * same slot first, and only then for an unused record. If two threads both
+ * start a record for the same slot, it just takes up two records.
  */
-extern uint32_t kstate_get_transaction_permissions(kstate_transaction_p transaction)
+static void count_arena_pin(struct kstate_shm *shm, int slot)
+{
+  uint64_t key = arena_pin_key(shm->arena_entry, slot);
+  int pass, ii;
+  for (pass = 0; pass < 2; pass++) {
+    for (ii = 0; ii < KSTATE_ARENA_PINS; ii++) {
+      uint64_t *record = &shm->arena_pins[ii];
+      uint64_t value = __atomic_load_n(record, __ATOMIC_RELAXED);
+      for (;;) {
+        uint64_t want;
+        if ((value & ~0xFFFFFFFFull) == key)
+          want = value + 1;
+        else if (pass == 1 && value == 0)
+          want = key | 1;
+        else
+          break;
+        if (__atomic_compare_exchange_n(record, &value, want, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+          return;
+      }
+    }
+  }
+  // Every record is in use, so this pin goes unrecorded. If we die whilst
+  // holding it, it stays pinned - which is better than it being released
+  // twice, which is all that guessing could lead to.
+}
+
+/*
+ * Record that we have let go of a slot of a state in an arena.
+ *
+ * If we can't find a record of it, it was one of the pins we couldn't record.
+ * If we find a record that was for one of those, that's harmless, as the
+ * record then just holds fewer pins than we really have.
+ */
+static void uncount_arena_pin(struct kstate_shm *shm, int slot)
+{
+  uint64_t key = arena_pin_key(shm->arena_entry, slot);
+  int ii;
+  for (ii = 0; ii < KSTATE_ARENA_PINS; ii++) {
+    uint64_t *record = &shm->arena_pins[ii];
+    uint64_t value = __atomic_load_n(record, __ATOMIC_RELAXED);
+    while ((value & ~0xFFFFFFFFull) == key) {
+      // The last pin frees the record
+      uint64_t want = (value & 0xFFFFFFFF) == 1 ? 0 : value - 1;
+      if (__atomic_compare_exchange_n(record, &value, want, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return;
+    }
+  }
+}
+
+/*
+ * Record that we have pinned a slot, once we have it.
+ */
+static inline void count_pin(struct kstate_shm *shm, int slot)
+{
+  if (shm->arena)
+    count_arena_pin(shm, slot);
+  else
+    __atomic_add_fetch(&shm->pins[slot], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record that we are letting go of a slot, before we do.
+ */
+static inline void uncount_pin(struct kstate_shm *shm, int slot)
+{
+  if (shm->arena)
+    uncount_arena_pin(shm, slot);
+  else
+    __atomic_sub_fetch(&shm->pins[slot], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pin the current version of the state, so that it won't be reused.
+ *
+ * Returns the value of 'current' for the version we pinned.
+ */
+static uint64_t pin_current(struct kstate_shm *shm)
+{
+  struct kstate_header *header = shm->header;
+  for (;;) {
+    uint64_t current = get_current(header);
+    int slot = current_slot(current);
+    __atomic_add_fetch(&header->refs[slot], 1, __ATOMIC_SEQ_CST);
+    // If it's still current, then no-one can have reused it before we pinned
+    // it (and now they won't). Otherwise, let it go and try again.
+    if (get_current(header) == current) {
+      // Only count it as ours once we've got it - if we die in between, better
+      // that the pin is never released than that it is released twice
+      count_pin(shm, slot);
+      return current;
+    }
+    __atomic_sub_fetch(&header->refs[slot], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void release_slot(struct kstate_shm *shm, int slot)
+{
+  // The opposite way round to pinning, for the same reason
+  uncount_pin(shm, slot);
+  __atomic_sub_fetch(&shm->header->refs[slot], 1, __ATOMIC_SEQ_CST);
+}
+
+static int reap_subscribers(struct kstate_subscribers *subscribers,
+                            struct kstate_header      *header);
+static struct kstate_arena_entry *arena_entry(struct kstate_arena_header *hdr,
+                                              uint32_t                    num);
+
+/*
+ * Claim a free slot for a write transaction to use.
+ *
+ * If they are all in use, we check whether any of them were pinned by a
+ * process that has since died, and if so try again.
+ *
+ * Returns the slot, or -1 if they are all in use.
+ */
+static int claim_slot(struct kstate_shm *shm)
+{
+  struct kstate_header *header = shm->header;
+  int tries;
+  for (tries = 0; tries < 2; tries++) {
+    int slot;
+    for (slot = 0; slot < KSTATE_NUM_SLOTS; slot++) {
+      uint32_t expected = 0;
+      if (__atomic_compare_exchange_n(&header->refs[slot], &expected, 1, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        count_pin(shm, slot);
+        // Nothing else has it pinned, and now nothing else will be able to
+        // claim it. But if it's current, we mustn't write to it.
+        if (current_slot(get_current(header)) != slot)
+          return slot;
+        release_slot(shm, slot);
+      }
+    }
+    if (reap_subscribers(shm->subscribers, shm->arena ? NULL : header) == 0)
+      break;
+  }
+  return -1;
+}
+
+/*
+ * Return the time now, according to CLOCK_MONOTONIC, in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Statistics can be compiled out with -DKSTATE_STATS=0, in which case they
+// all stay at zero.
+#ifndef KSTATE_STATS
+#define KSTATE_STATS            1
+#endif
+
+// Add to a statistic. No-one relies on these for synchronisation, so they
+// need to be atomic, but not ordered.
+#define STAT_ADD(header, field, value)                                  \
+  do {                                                                  \
+    if (KSTATE_STATS)                                                   \
+      __atomic_add_fetch(&(header)->stats.field, (value), __ATOMIC_RELAXED); \
+  } while (0)
+
+#define STAT_SUB(header, field, value)                                  \
+  do {                                                                  \
+    if (KSTATE_STATS)                                                   \
+      __atomic_sub_fetch(&(header)->stats.field, (value), __ATOMIC_RELAXED); \
+  } while (0)
+
+// USDT probes, so that a tracer (such as bpftrace, with the scripts in
+// trace/) can watch subscriptions and transactions come and go without
+// rebuilding anything. Where <sys/sdt.h> is available, each probe is a
+// single nop until something attaches to it. Elsewhere they compile away,
+// as they also do with -DKSTATE_PROBES=0.
+//
+// Each probe's arguments are simple values we already have to hand, as
+// they are evaluated whether anyone is attached or not. States are named
+// without the "/kstate." prefix on their shared memory object.
+#ifndef KSTATE_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define KSTATE_PROBES           1
+#endif
+#endif
+#endif
+#ifndef KSTATE_PROBES
+#define KSTATE_PROBES           0
+#endif
+
+#if KSTATE_PROBES
+#include <sys/sdt.h>
+#define PROBE2(name, a, b)              DTRACE_PROBE2(kstate, name, a, b)
+#define PROBE3(name, a, b, c)           DTRACE_PROBE3(kstate, name, a, b, c)
+#define PROBE4(name, a, b, c, d)        DTRACE_PROBE4(kstate, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b)              do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)                                           \
+  do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d)                                        \
+  do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+/*
+ * Count a write transaction that took 'ns' nanoseconds from start to commit.
+ */
+static void stat_latency(struct kstate_header *header, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= KSTATE_STATS_LATENCY_BUCKETS)
+    bucket = KSTATE_STATS_LATENCY_BUCKETS - 1;
+  STAT_ADD(header, latency[bucket], 1);
+}
+
+/*
+ * If a rate limited state's next tick is due, move on to the version that is
+ * current now.
+ *
+ * Returns the 'current' for the version at the tick, and sets 'changes' (if
+ * it isn't NULL) to the change count at that time.
+ */
+static uint64_t update_tick(kstate_state_p state, uint32_t *changes)
+{
+  uint64_t now = monotonic_ns();
+  pthread_mutex_lock(&state->tick_lock);
+  if (!state->tick_pinned || now >= state->next_tick) {
+    struct kstate_header *header = state->shm->header;
+    // Look at the change count first, so that it is never newer than the
+    // version we pin (it is incremented after the commit)
+    uint32_t new_changes = __atomic_load_n(&header->changes, __ATOMIC_SEQ_CST);
+    uint64_t current = pin_current(state->shm);
+    if (state->tick_pinned)
+      release_slot(state->shm, current_slot(state->tick_current));
+    state->tick_pinned = true;
+    __atomic_store_n(&state->tick_current, current, __ATOMIC_RELEASE);
+    state->tick_changes = new_changes;
+    __atomic_store_n(&state->next_tick,
+                     now + 1000000000ULL / state->max_rate, __ATOMIC_RELAXED);
+  }
+  uint64_t current = state->tick_current;
+  if (changes)
+    *changes = state->tick_changes;
+  pthread_mutex_unlock(&state->tick_lock);
+  return current;
+}
+
+/*
+ * Let go of a rate limited state's version, if it has one.
+ */
+static void clear_tick(kstate_state_p state)
+{
+  pthread_mutex_lock(&state->tick_lock);
+  if (state->tick_pinned)
+    release_slot(state->shm, current_slot(state->tick_current));
+  state->tick_pinned = false;
+  state->tick_current = 0;
+  state->tick_changes = 0;
+  state->next_tick = 0;
+  pthread_mutex_unlock(&state->tick_lock);
+}
+
+static int num_digits(int value)
+{
+  int count = 0;
+  do
+  {
+    ++count;
+    value /= 10;
+  }
+  while (value);
+  return count;
+}
+
+// By default, we can log anything, but at run time only log errors.
+// Defining KSTATE_LOG_MAX_LEVEL (for instance, -DKSTATE_LOG_MAX_LEVEL=1 for
+// KSTATE_LOG_ERROR) compiles out the calls for any level above it.
+#ifndef KSTATE_LOG_MAX_LEVEL
+#define KSTATE_LOG_MAX_LEVEL    KSTATE_LOG_DEBUG
+#endif
+
+// The longest message we pass to a logging function
+#define KSTATE_LOG_MSG_LEN      1024
+
+static int log_level = KSTATE_LOG_ERROR;
+static kstate_log_fn_t log_fn = NULL;
+static void *log_fn_data = NULL;
+static pthread_mutex_t log_fn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Are we logging messages at 'level'? That is a constant false for any level
+// above KSTATE_LOG_MAX_LEVEL, and otherwise just an integer comparison.
+#define LOGGING(level)  ((level) <= KSTATE_LOG_MAX_LEVEL && \
+                         (level) <= __atomic_load_n(&log_level, \
+                                                    __ATOMIC_RELAXED))
+
+// So the arguments to a log message are not evaluated unless it is logged.
+#define KSTATE_LOG(level, ...)                  \
+  do {                                          \
+    if (LOGGING(level))                         \
+      log_message((level), __VA_ARGS__);        \
+  } while (0)
+
+#define LOG_ERROR(...)  KSTATE_LOG(KSTATE_LOG_ERROR, __VA_ARGS__)
+#define LOG_INFO(...)   KSTATE_LOG(KSTATE_LOG_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)  KSTATE_LOG(KSTATE_LOG_DEBUG, __VA_ARGS__)
+
+/*
+ * Log a message.
+ *
+ * If we have a logging function, pass it the message (without any trailing
+ * newline). Otherwise, errors go to stderr prefixed with "!!! ", information
+ * to stderr prefixed with "... ", and debugging to stdout as it is.
+ */
+static void log_message(kstate_log_level_t level, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void log_message(kstate_log_level_t level, const char *format, ...)
+{
+  char    message[KSTATE_LOG_MSG_LEN];
+  va_list args;
+  size_t  len;
+
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  len = strlen(message);
+  if (len > 0 && message[len-1] == '\n')
+    message[len-1] = '\0';
+
+  // The function and its data go together
+  pthread_mutex_lock(&log_fn_lock);
+  kstate_log_fn_t fn = log_fn;
+  void *fn_data = log_fn_data;
+  pthread_mutex_unlock(&log_fn_lock);
+
+  if (fn) {
+    fn(level, message, fn_data);
+  } else if (level == KSTATE_LOG_ERROR) {
+    fprintf(stderr, "!!! %s\n", message);
+  } else if (level == KSTATE_LOG_INFO) {
+    fprintf(stderr, "... %s\n", message);
+  } else {
+    printf("%s\n", message);
+  }
+}
+
+/*
+ * Set which messages kstate logs.
+ *
+ * 'level' is one of KSTATE_LOG_NONE (log nothing), KSTATE_LOG_ERROR (the
+ * default), KSTATE_LOG_INFO or KSTATE_LOG_DEBUG (log each subscription and
+ * transaction as it happens). Each level includes those before it.
+ *
+ * Messages above KSTATE_LOG_MAX_LEVEL are never logged, as they were not
+ * compiled in.
+ *
+ * Returns the previous level.
+ */
+extern int kstate_set_log_level(int level)
+{
+  if (level < KSTATE_LOG_NONE)
+    level = KSTATE_LOG_NONE;
+  else if (level > KSTATE_LOG_DEBUG)
+    level = KSTATE_LOG_DEBUG;
+  return __atomic_exchange_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set a function to be called with each message kstate logs, instead of
+ * writing it to stderr or stdout.
+ *
+ * 'fn' is called with the level of the message, the message itself (with no
+ * prefix or trailing newline) and 'data'. It may be called from any thread
+ * using kstate, and must not call kstate itself.
+ *
+ * If 'fn' is NULL, messages go back to stderr and stdout.
+ */
+extern void kstate_set_log_fn(kstate_log_fn_t fn, void *data)
+{
+  pthread_mutex_lock(&log_fn_lock);
+  log_fn = fn;
+  log_fn_data = data;
+  pthread_mutex_unlock(&log_fn_lock);
+}
+
+// Long enough to describe any state or transaction
+#define KSTATE_DESC_LEN         (NAME_MAX + 64)
+
+static char *describe_permissions(char *buf, uint32_t permissions)
+{
+  if (permissions) {
+    buf[0] = '\0';
+    if (permissions & KSTATE_READ)
+      strcat(buf, "read");
+    if ((permissions & KSTATE_READ) && (permissions & KSTATE_WRITE))
+      strcat(buf, "|");
+    if (permissions & KSTATE_WRITE)
+      strcat(buf, "write");
+    if (permissions & KSTATE_LAZY)
+      strcat(buf, "|lazy");
+  } else {
+    strcpy(buf, "<no permissions>");
+  }
+  return buf;
+}
+
+static char *describe_state(char       *buf,
+                            uint32_t    id,
+                            const char *name,
+                            uint32_t    permissions)
+{
+  char perms[32];
+  snprintf(buf, KSTATE_DESC_LEN, "State %u on '%s' for %s", id, name,
+           describe_permissions(perms, permissions));
+  return buf;
+}
+
+static char *describe_transaction(char       *buf,
+                                  uint32_t    id,
+                                  const char *name,
+                                  uint32_t    permissions)
+{
+  char perms[32];
+  snprintf(buf, KSTATE_DESC_LEN, "Transaction %u for %s on '%s'", id,
+           describe_permissions(perms, permissions), name);
+  return buf;
+}
+
+/*
+ * Return a description of 'state', for use in log messages.
+ *
+ * The description is in a (per-thread) static buffer, which is overwritten
+ * by the next call.
+ */
+static const char *state_desc(kstate_state_p state)
+{
+  static __thread char buf[KSTATE_DESC_LEN];
+  if (kstate_state_is_subscribed(state))
+    return describe_state(buf, state->id,
+                          state->name + KSTATE_NAME_PREFIX_LEN,
+                          state->permissions);
+  else
+    return "State <unsubscribed>";
+}
+
+/*
+ * Return a description of 'transaction', for use in log messages.
+ *
+ * The description is in a (per-thread) static buffer, which is overwritten
+ * by the next call.
+ */
+static const char *transaction_desc(kstate_transaction_p transaction)
+{
+  static __thread char buf[KSTATE_DESC_LEN];
+  if (kstate_transaction_is_active(transaction))
+    return describe_transaction(buf, transaction->id,
+                                transaction->name + KSTATE_NAME_PREFIX_LEN,
+                                transaction->permissions);
+  else
+    return "Transaction <not active>";
+}
+
+/*
+ * Given a state name, is it valid?
+ *
+ * Returns the name length if it's OK, 0 if it's naughty
+ */
+static size_t check_state_name(const char *caller, const char *name)
+{
+  size_t ii;
+  int dot_at = 1;
+
+  if (name == NULL) {
+    LOG_ERROR("%s: State name may not be NULL\n", caller);
+    return 0;
+  }
+
+  size_t name_len = strlen(name);
+
+  if (name_len == 0) {
+    LOG_ERROR("%s: State name may not be zero length\n", caller);
+    return 0;
+  }
+  if (name_len > KSTATE_MAX_NAME_LEN) {
+    // Would it be more helpful to give all the characters?
+    // Is anyone reading this?
+    LOG_ERROR("%s: State name '%.5s..%s' is %u"
+              " characters long, but the maximum length is %d characters\n",
+              caller, name, &name[name_len-5],
+              (unsigned) name_len, KSTATE_MAX_NAME_LEN);
+    return 0;
+  }
+
+  if (name[0] == '.' || name[name_len-1] == '.') {
+    LOG_ERROR("%s: State name '%s' may not start or"
+              " end with '.'\n", caller, name);
+    return 0;
+  }
+
+  for (ii = 0; ii < name_len; ii++) {
+    if (name[ii] == '.') {
+      if (dot_at == ii - 1) {
+        LOG_ERROR("%s: State name '%s' may not have"
+                  " adjacent '.'s\n", caller, name);
+        return 0;
+      }
+      dot_at = ii;
+    } else if (!isalnum(name[ii])) {
+      LOG_ERROR("%s: State name '%s' may not"
+                " contain '%c' (not alphanumeric)\n", caller, name, name[ii]);
+      return 0;
+    }
+  }
+  return name_len;
+}
+
+/*
+ * Return a kstate state name.
+ *
+ * Returns NULL if it is not possible to make such a name.
+ */
+static int new_state_name(const char *caller, const char *name, char **state_name)
+{
+  if (name == NULL) {
+    LOG_ERROR("%s: Supplied 'name' may not be NULL\n", caller);
+    return -EINVAL;
+  }
+
+  size_t name_len = check_state_name(caller, name);
+  if (name_len == 0) {
+    return -EINVAL;
+  }
+
+  char *new = malloc(1 + 6 + 1 + name_len + 1);
+  if (new == NULL) return -ENOMEM;
+  sprintf(new, "/kstate.%s", name);
+
+  *state_name = new;
+
+  return 0;
+}
+
+/*
+ * Return a unique valid state name starting with prefix.
+ *
+ * The name is composed of:
+ *
+ * * the normal kstate name prefix
+ * * the prefix string
+ * * the number of microseconds since the epoch
+ * * our process id
+ * * a statically increasing integer
+ *
+ * separated by dots. Thus it is only as "unique" as afforded by the
+ * accuracy of gettimeofday - i.e., it relies on the apparent time
+ * thus reported having changed.
+ *
+ * For most purposes, this should be sufficient.
+ *
+ * The caller is responsible for freeing the returned string.
+ *
+ * Returns NULL if it is not possible to make such a name with the given
+ * prefix.
+ */
+extern char *kstate_get_unique_name(const char *prefix)
+{
+  static uint32_t extra = 0;
+
+  if (prefix == NULL) {
+    LOG_ERROR("kstate_get_unique_name: Prefix may not be NULL\n");
+    return NULL;
+  }
+
+  size_t prefix_len = strlen(prefix);
+
+  struct timeval tv;
+  int rv = gettimeofday(&tv, NULL);
+  if (rv) {
+    LOG_ERROR("kstate_get_unique_name: Error getting time-of-day: %d %s\n",
+              errno, strerror(errno));
+    return NULL;
+  }
+
+  pid_t pid = getpid();
+  // So that two threads asking at once still get different names
+  uint32_t our_extra = __atomic_fetch_add(&extra, 1, __ATOMIC_RELAXED);
+
+  char *name = malloc(prefix_len + 1 +
+                      num_digits(tv.tv_sec) + 6 + 1 +
+                      num_digits(pid) + 1 + num_digits(our_extra) + 1);
+  if (name == NULL) return NULL;
+  sprintf(name, "%s.%ld%06ld.%u.%u", prefix, tv.tv_sec, tv.tv_usec, (uint32_t) pid, our_extra);
+
+  return name;
+}
+
+static bool state_permissions_are_bad(uint32_t permissions)
+{
+  if (!permissions) {
+    LOG_ERROR("kstate_subscribe_state: Unset permissions bits (0x0) not allowed\n");
+    return true;
+  }
+  else if (permissions & ~(KSTATE_READ | KSTATE_WRITE)) {
+    LOG_ERROR("kstate_subscribe_state: Unexpected permission bits 0x%x in 0x%x\n",
+              permissions & ~(KSTATE_READ | KSTATE_WRITE),
+              permissions);
+    return true;
+  }
+  return false;
+}
+
+static bool transaction_permissions_are_bad(uint32_t permissions)
+{
+  if (!(permissions & (KSTATE_READ | KSTATE_WRITE))) {
+    LOG_ERROR("kstate_start_transaction: Neither read nor write"
+              " permission bits set in 0x%x\n", permissions);
+    return true;
+  }
+  else if (permissions & ~(KSTATE_READ | KSTATE_WRITE | KSTATE_LAZY)) {
+    LOG_ERROR("kstate_start_transaction: Unexpected permission bits 0x%x in 0x%x\n",
+              permissions & ~(KSTATE_READ | KSTATE_WRITE | KSTATE_LAZY),
+              permissions);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Return true if the given state is subscribed.
+ */
+extern bool kstate_state_is_subscribed(kstate_state_p state)
+{
+  return state != NULL && state->name;
+}
+
+/*
+ * Return true if the given transaction is active
+ */
+extern bool kstate_transaction_is_active(kstate_transaction_p transaction)
+{
+  // The detail of this is bound to change
+  return transaction != NULL && transaction->name;
+}
+
+/*
+ * Return a state's name, or NULL if it is not subscribed.
+ */
+extern const char *kstate_get_state_name(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    // We ignore the leading '/kstate.' text, which the user did not specify
+    return &state->name[KSTATE_NAME_PREFIX_LEN];
+  } else {
+    return NULL;
+  }
+}
+
+/*
+ * Return a transaction's name, or NULL if it is not active.
+ */
+extern const char *kstate_get_transaction_name(kstate_transaction_p transaction)
+{
+  if (kstate_transaction_is_active(transaction)) {
+    // We ignore the leading '/kstate.' text, which the user did not specify
+    return &transaction->name[KSTATE_NAME_PREFIX_LEN];
+  } else {
+    return NULL;
+  }
+}
+
+/*
+ * Return a state's permissions, or 0 if it is not subscribed.
+ */
+extern uint32_t kstate_get_state_permissions(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    return state->permissions;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Return the size of a state's data, in bytes, or 0 if it is not subscribed.
+ */
+extern size_t kstate_get_state_size(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    return state->shm->map_length;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Return a state's change count, or 0 if it is not subscribed.
+ *
+ * The change count is incremented each time a transaction on the state is
+ * committed (by anyone). It wraps around, so only compare it for equality.
+ * See kstate_wait_for_state_change.
+ */
+extern uint32_t kstate_get_state_changes(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    if (state->max_rate) {
+      uint32_t changes;
+      (void) update_tick(state, &changes);
+      return changes;
+    }
+    return __atomic_load_n(&state->shm->header->changes, __ATOMIC_SEQ_CST);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Get a state's statistics.
+ *
+ * - ``state`` is the state, which may be subscribed for read or write.
+ * - ``stats`` is filled in with the state's statistics.
+ *
+ * The statistics are kept in the state's shared memory, so they count what
+ * all the subscribers to the state (in any process) have done with it. A
+ * transaction on several states counts towards each of their statistics.
+ * Each count is read atomically, but they are not all read at the
+ * same instant, so they may not quite add up whilst the state is busy.
+ *
+ * A process that crashes during a read transaction leaves 'readers' counting
+ * it. A process that crashes whilst subscribed is taken off 'subscribers'
+ * when someone next subscribes to the state.
+ *
+ * If the library was built with KSTATE_STATS defined as 0, then the
+ * statistics are all zero.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is not subscribed.
+ */
+extern int kstate_get_state_stats(kstate_state_p       state,
+                                  struct kstate_stats *stats)
+{
+  if (stats == NULL) {
+    LOG_ERROR("kstate_get_state_stats: stats argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_get_state_stats: Cannot get statistics for an"
+              " unsubscribed state\n");
+    return -EINVAL;
+  }
+
+  uint64_t *from = (uint64_t *)&state->shm->header->stats;
+  uint64_t *to = (uint64_t *)stats;
+  size_t ii;
+  for (ii = 0; ii < sizeof(*stats) / sizeof(uint64_t); ii++)
+    to[ii] = __atomic_load_n(&from[ii], __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * Wait for a state's change count to be other than 'changes', or for
+ * 'timeout' (which may be NULL) to pass.
+ *
+ * Returns 0 if it has changed, or a negative value (``-errno``) otherwise.
+ */
+static int wait_for_change(struct kstate_header *header,
+                           uint32_t              changes,
+                           struct timespec      *timeout)
+{
+  int rv = 0;
+  __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+  // We may be woken when the state hasn't changed (for instance, when its
+  // change count goes all the way round), so we just ask again - which means
+  // a long wait can be a bit longer than asked for.
+  while (__atomic_load_n(&header->changes, __ATOMIC_SEQ_CST) == changes) {
+    if (syscall(SYS_futex, &header->changes, FUTEX_WAIT, changes,
+                timeout, NULL, 0)) {
+      if (errno == EAGAIN) {
+        break;            // it changed before we could start waiting
+      } else {
+        rv = -errno;      // including timing out or being interrupted
+        break;
+      }
+    }
+  }
+  __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+  return rv;
+}
+
+/*
+ * Wait for a state to change.
+ *
+ * - ``state`` is the state to wait on.
+ * - ``changes`` is the change count the caller has already seen, as returned
+ *   by kstate_get_state_changes.
+ * - ``timeout_ms`` is how long to wait, in milliseconds, or a negative
+ *   number to wait for as long as it takes.
+ *
+ * This returns as soon as the state's change count is not ``changes`` -
+ * that is, as soon as a transaction has been committed since the caller
+ * looked - which may be immediately. It does not busy-wait. So a consumer
+ * might do::
+ *
+ *     uint32_t changes = kstate_get_state_changes(state);
+ *     for (;;) {
+ *       // look at the state...
+ *       kstate_wait_for_state_change(state, changes, -1);
+ *       changes = kstate_get_state_changes(state);
+ *     }
+ *
+ * Returns 0 if the state has changed, -ETIMEDOUT if it did not change in
+ * time, -EINTR if the wait was interrupted by a signal, or another negative
+ * value (``-errno``) if it fails.
+ */
+extern int kstate_wait_for_state_change(kstate_state_p  state,
+                                        uint32_t        changes,
+                                        int             timeout_ms)
+{
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_wait_for_state_change: Cannot wait on an"
+              " unsubscribed state\n");
+    return -EINVAL;
+  }
+
+  struct kstate_header *header = state->shm->header;
+  struct timespec timeout;
+  struct timespec *timeout_p = NULL;
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    timeout_p = &timeout;
+  }
+
+  int rv = wait_for_change(header, changes, timeout_p);
+
+  // If we're rate limited, then we don't want to know about the change
+  // until our next tick
+  uint64_t next_tick = __atomic_load_n(&state->next_tick, __ATOMIC_RELAXED);
+  if (rv == 0 && state->max_rate && next_tick) {
+    uint64_t now = monotonic_ns();
+    if (now < next_tick) {
+      uint64_t delay = next_tick - now;
+      if (timeout_ms >= 0 && delay > (uint64_t)timeout_ms * 1000000ULL)
+        return -ETIMEDOUT;
+      struct timespec wait;
+      wait.tv_sec = delay / 1000000000ULL;
+      wait.tv_nsec = delay % 1000000000ULL;
+      if (nanosleep(&wait, NULL))
+        return -errno;
+    }
+  }
+  return rv;
+}
+
+/*
+ * Return a transaction's permissions, or 0 if it is not active.
+ */
+extern uint32_t kstate_get_transaction_permissions(kstate_transaction_p transaction)
 {
   if (kstate_transaction_is_active(transaction)) {
     return transaction->permissions;
@@ -310,795 +1583,5079 @@ extern uint32_t kstate_get_transaction_permissions(kstate_transaction_p transact
 }
 
 /*
- * Return a state's id, or 0 if it is not subscribed.
+ * Return a state's id, or 0 if it is not subscribed.
+ *
+ * We do not say anything about the value of the id, except that 0 means the
+ * state is unsubscribed, the same state always has the same id, and two
+ * separate states have distinct ids.
+ */
+extern uint32_t kstate_get_state_id(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    return state->id;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Return a transaction's id, or 0 if it is not active.
+ *
+ * We do not say anything about the value of the id, except that 0 means the
+ * transaction is not active, the same transaction always has the same id, and
+ * two separate transactions have distinct ids.
+ */
+extern uint32_t kstate_get_transaction_id(kstate_transaction_p transaction)
+{
+  if (kstate_transaction_is_active(transaction)) {
+    return transaction->id;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Return a state's shared memory pointer, or NULL if it is not subscribed.
+ *
+ * Note that this is always a pointer to read-only shared memory, as
+ * one must use a transaction to write.
+ *
+ * The pointer is to the current version of the state's data. Committing a
+ * transaction makes a new version current (at a different address), so call
+ * this again to see the result of a commit. Once a version is no longer
+ * current, its memory may be reused for a later version at any time, so use
+ * a transaction if you need a consistent view of the data.
+ *
+ * If the state is rate limited (see kstate_set_max_rate), then this is the
+ * version that was current at the last tick, which will stay put until the
+ * next tick.
+ *
+ * Beware that this pointer stops being valid as soon as the state is
+ * unsubscribed (or freed, which implicitly unsubscribes it).
+ */
+extern void *kstate_get_state_ptr(kstate_state_p state)
+{
+  if (kstate_state_is_subscribed(state)) {
+    struct kstate_shm *shm = state->shm;
+    uint64_t current;
+    if (state->max_rate)
+      current = update_tick(state, NULL);
+    else
+      current = get_current(shm->header);
+    return (void *)read_data(shm, current_slot(current));
+  } else {
+    return NULL;
+  }
+}
+
+/*
+ * Start reading a state's data directly, without a transaction.
+ *
+ * - ``state`` is the state, which may be subscribed for read or write.
+ * - ``token`` is set to a token for the version being read, to be passed
+ *   to kstate_read_retry.
+ *
+ * Returns a pointer to the current version of the state's data, in the
+ * (read-only) shared memory, or NULL if the state is not subscribed.
+ *
+ * This doesn't pin the version, so it costs no more than a couple of loads,
+ * and doesn't write to the shared memory at all - but the version may be
+ * reused (and overwritten) at any time after someone commits a newer one.
+ * So copy out the fields wanted, and then call kstate_read_retry to check
+ * that they were all read from the same version::
+ *
+ *     uint64_t token;
+ *     const struct my_data *data;
+ *     uint32_t a, b;
+ *     do {
+ *       data = kstate_read_begin(state, &token);
+ *       a = data->a;
+ *       b = data->b;
+ *     } while (kstate_read_retry(state, token));
+ *
+ * Until kstate_read_retry has said the values are good, don't act on them
+ * (in particular, don't follow any offsets or pointers they contain without
+ * checking them first), as they may be a mixture of two versions, or
+ * partially written.
+ *
+ * If the state is rate limited (see kstate_set_max_rate), then this reads
+ * the version that was current at the last tick, which is pinned and so
+ * doesn't need retrying (unless there is a new tick in the meantime).
+ */
+extern const void *kstate_read_begin(kstate_state_p  state,
+                                     uint64_t       *token)
+{
+  if (!kstate_state_is_subscribed(state)) {
+    *token = 0;
+    return NULL;
+  }
+
+  struct kstate_shm *shm = state->shm;
+  uint64_t current;
+  if (state->max_rate) {
+    current = update_tick(state, NULL);
+  } else {
+    // If someone is committing to several states, their new version isn't
+    // current yet, so we look at the old one
+    current = __atomic_load_n(&shm->header->current, __ATOMIC_ACQUIRE);
+    current &= ~(uint64_t)KSTATE_LOCKED;
+  }
+  *token = current;
+  return read_data(shm, current_slot(current));
+}
+
+/*
+ * Check whether data read since kstate_read_begin needs to be read again.
+ *
+ * - ``state`` is the state, as given to kstate_read_begin.
+ * - ``token`` is the token that kstate_read_begin returned.
+ *
+ * Returns false if the version that kstate_read_begin returned was current
+ * the whole time since then - in which case no-one can have written to it,
+ * and everything read from it is consistent. Returns true if the data must
+ * be read again (starting with another call of kstate_read_begin), or if the
+ * state is not subscribed.
+ */
+extern bool kstate_read_retry(kstate_state_p  state,
+                              uint64_t        token)
+{
+  if (!kstate_state_is_subscribed(state))
+    return true;
+
+  // Make sure our reads of the data happen before we look at anything that
+  // says whether they were consistent. (An acquire load by itself wouldn't
+  // stop the reads before it moving after it.)
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  // A version we have pinned can't have been altered
+  if (state->max_rate &&
+      __atomic_load_n(&state->tick_current, __ATOMIC_ACQUIRE) == token &&
+      __atomic_load_n(&state->next_tick, __ATOMIC_RELAXED))
+    return false;
+
+  // Every commit changes the generation in 'current', so if it is the same
+  // (apart from being locked), our version stayed current, and a version
+  // that is current is never written to.
+  uint64_t current = __atomic_load_n(&state->shm->header->current,
+                                     __ATOMIC_RELAXED);
+  return (current & ~(uint64_t)KSTATE_LOCKED) != token;
+}
+
+/*
+ * Return a transaction's shared memory pointer, or NULL if it is not active.
+ *
+ * Whether this can be used to write to the shared memory depends upon the
+ * protection requested for the transaction.
+ *
+ * Beware that this pointer stops being valid as soon as the transaction is
+ * committed or aborted (or freed, which implicitly aborts it).
+ */
+extern void *kstate_get_transaction_ptr(kstate_transaction_p transaction)
+{
+  if (kstate_transaction_is_active(transaction)) {
+    return transaction->parts[0].map_addr;
+  } else {
+    return NULL;
+  }
+}
+
+/*
+ * Return a transaction's shared memory pointer for one of the states it is
+ * on, or NULL if it is not active, or not on that state.
+ *
+ * This is the same as kstate_get_transaction_ptr for the state the
+ * transaction was started on, and is how to get at the data for any state
+ * added with kstate_add_state_to_transaction.
+ *
+ * Beware that this pointer stops being valid as soon as the transaction is
+ * committed or aborted (or freed, which implicitly aborts it).
+ */
+extern void *kstate_get_transaction_state_ptr(kstate_transaction_p  transaction,
+                                              kstate_state_p        state)
+{
+  if (kstate_transaction_is_active(transaction) &&
+      kstate_state_is_subscribed(state)) {
+    uint32_t ii;
+    for (ii = 0; ii < transaction->num_parts; ii++) {
+      if (!strcmp(transaction->parts[ii].shm->name, state->name))
+        return transaction->parts[ii].map_addr;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Print a representation of 'state' on output 'stream'.
+ *
+ * Assumes the state is valid.
+ *
+ * If 'start' is non-NULL, print it before the state (with no added whitespace).
+ * If 'eol' is true, then print a newline after the state.
+ */
+extern void kstate_print_state(FILE           *stream,
+                               const char     *start,
+                               kstate_state_p  state,
+                               bool            eol)
+{
+  if (start)
+    fprintf(stream, "%s", start);
+
+  fprintf(stream, "%s", state_desc(state));
+
+  if (eol)
+    fprintf(stream, "\n");
+}
+
+/*
+ * Print a representation of 'transaction' on output 'stream'.
+ *
+ * Assumes the transaction is valid.
+ *
+ * If 'start' is non-NULL, print it before the transaction (with no added
+ * whitespace).
+ * If 'eol' is true, then print a newline after the transaction.
+ */
+extern void kstate_print_transaction(FILE                 *stream,
+                                     const char           *start,
+                                     kstate_transaction_p  transaction,
+                                     bool                  eol)
+{
+  if (start)
+    fprintf(stream, "%s", start);
+
+  fprintf(stream, "%s", transaction_desc(transaction));
+
+  if (eol)
+    fprintf(stream, "\n");
+}
+
+/*
+ * Create a new "empty" state.
+ *
+ * The normal usage is to create an empty state and then immediately
+ * populate it::
+ *
+ *     kstate_state_p state = kstate_new_state();
+ *     int ret = kstate_subscribe_state("State.Name", KSTATE_READ|KSTATE_WRITE, state);
+ *
+ * and then eventually to destroy it::
+ *
+ *     int ret = kstate_unsubscribe_state(state);
+ *     if (ret) {
+ *       // deal with the error
+ *     }
+ *     kstate_free_state(&state);
+ *
+ * After which it can safely be reused, if you wish.
+ *
+ * Once a state is subscribed, any number of threads may use it at the same
+ * time, to start and commit transactions on it, get pointers to its data
+ * or wait for it to change. Subscribing, unsubscribing and freeing a state,
+ * and the 'kstate_set_...' functions, must not be called while any other
+ * thread is using that state. If the state is rate limited, the version
+ * it is showing moves on for all of the threads at once.
+ *
+ * Returns the new state, or NULL if there was insufficient memory.
+ */
+extern kstate_state_p kstate_new_state(void)
+{
+  static uint32_t next_state_id = 1;    // because 0 is reserved
+
+  kstate_state_p new = malloc(sizeof(*new));
+  if (new == NULL)
+    return NULL;
+  memset(new, 0, sizeof(*new));
+  pthread_mutex_init(&new->tick_lock, NULL);
+  // Other threads may be making states at the same time (and 0 comes round
+  // again eventually)
+  do {
+    new->id = __atomic_fetch_add(&next_state_id, 1, __ATOMIC_RELAXED);
+  } while (new->id == 0);
+
+  return new;
+}
+
+/*
+ * Free a state created with 'kstate_new_state'.
+ *
+ * If a NULL pointer is given, then it is ignored, otherwise the state is
+ * freed and the pointer is set to NULL.
+ */
+extern void kstate_free_state(kstate_state_p *state)
+{
+  if (state && *state) {
+    if (kstate_state_is_subscribed(*state)) {
+      kstate_unsubscribe_state(*state);
+    }
+    struct kstate_state *s = (struct kstate_state *)(*state);
+    free(s->filename);
+    free(s->journal_filename);
+    free(s->arena_name);
+    pthread_mutex_destroy(&s->tick_lock);
+    free(s);
+    *state = NULL;
+  }
+}
+
+/*
+ * Tell anyone waiting for a state to change that it has.
+ *
+ * Waiters count themselves in before they wait, so we can save ourselves
+ * the system call if there aren't any.
+ */
+static void notify_changed(struct kstate_header *header)
+{
+  __atomic_add_fetch(&header->changes, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST)) {
+    // Not FUTEX_PRIVATE_FLAG, as the waiters may be in other processes
+    syscall(SYS_futex, &header->changes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/*
+ * Return when a process started, in clock ticks since boot, or 0 if we can't
+ * tell.
+ *
+ * Together with its process id, this identifies a process, even if its
+ * process id is later reused.
+ */
+static uint64_t process_start_time(pid_t pid)
+{
+  char path[32];
+  char buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+
+  // The command name comes first, in brackets, and may contain anything at
+  // all - so we start looking after the last closing bracket, which is
+  // followed by the process state (field 3) and so on to the start time
+  // (field 22)
+  char *field = strrchr(buf, ')');
+  int num;
+  for (num = 3; field && num <= 22; num++) {
+    field = strchr(field, ' ');
+    if (field)
+      field++;
+  }
+  return field ? strtoull(field, NULL, 10) : 0;
+}
+
+/*
+ * Return when our own process started, as process_start_time() would.
+ */
+static uint64_t our_start_time(void)
+{
+  // Remembered (by each thread), but a child of fork() must work its own out
+  static __thread pid_t     pid = 0;
+  static __thread uint64_t  start_time = 0;
+  if (pid != getpid()) {
+    pid = getpid();
+    start_time = process_start_time(pid);
+  }
+  return start_time;
+}
+
+/*
+ * Is the process that made a subscriber table entry still alive?
+ *
+ * If we don't know when it started (because it hasn't filled that in yet,
+ * or /proc wasn't available to it), we can only go by the process id.
+ */
+static bool subscriber_is_alive(uint32_t pid, uint64_t start_time)
+{
+  if (kill((pid_t) pid, 0) && errno == ESRCH)
+    return false;
+  if (start_time == 0)
+    return true;
+  uint64_t actual = process_start_time((pid_t) pid);
+  return actual == 0 || actual == start_time;
+}
+
+/*
+ * Record that we have locked a state (set KSTATE_LOCKED in its 'current'),
+ * so that if we die before unlocking it, whoever tidies up after us can.
+ */
+static void set_locker(struct kstate_shm *shm)
+{
+  uint32_t locker = 0;
+  if (shm->subscriber)
+    locker = (uint32_t)(shm->subscriber - shm->subscribers->table) + 1;
+  __atomic_store_n(&shm->header->locker, locker, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Unlock a state we locked, by setting its 'current'.
+ */
+static void unlock_current(struct kstate_header *header, uint64_t current)
+{
+  __atomic_store_n(&header->locker, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&header->current, current, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * If a state is locked by the subscriber 'locker' (numbered from 1), which
+ * has died, unlock it, leaving whatever was current before it was locked.
+ */
+static void unlock_dead_locker(struct kstate_header *header, uint32_t locker)
+{
+  uint64_t current = get_current(header);
+  if (!(current & KSTATE_LOCKED) ||
+      __atomic_load_n(&header->locker, __ATOMIC_SEQ_CST) != locker)
+    return;
+  // It cleared 'locker' before unlocking, so it must still have the lock
+  LOG_INFO("Unlocking a state locked by subscriber %u, which has died\n",
+           locker - 1);
+  __atomic_store_n(&header->locker, 0, __ATOMIC_SEQ_CST);
+  __atomic_compare_exchange_n(&header->current, &current,
+                              current & ~(uint64_t)KSTATE_LOCKED, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * If a state is locked, and whoever locked it has died, tidy up after them.
+ *
+ * A commit that fails calls this, as that's when a state that stays locked
+ * gets in anyone's way.
+ */
+static void reap_locker(struct kstate_shm *shm)
+{
+  struct kstate_header *header = shm->header;
+  if (!(get_current(header) & KSTATE_LOCKED) || shm->subscribers == NULL)
+    return;
+  uint32_t locker = __atomic_load_n(&header->locker, __ATOMIC_SEQ_CST);
+  if (locker == 0 || locker > KSTATE_MAX_SUBSCRIBERS)
+    return;
+  struct kstate_subscriber *sub = &shm->subscribers->table[locker - 1];
+  uint32_t pid = __atomic_load_n(&sub->pid, __ATOMIC_ACQUIRE);
+  if (pid == 0 || pid == KSTATE_REAPING ||
+      subscriber_is_alive(pid, __atomic_load_n(&sub->start_time,
+                                               __ATOMIC_ACQUIRE)))
+    return;
+  reap_subscribers(shm->subscribers, shm->arena ? NULL : header);
+}
+
+/*
+ * Tidy up after any subscribers whose processes have died without
+ * unsubscribing, releasing whatever slots they had pinned.
+ *
+ * If it died whilst committing, any state it had locked is unlocked again,
+ * with the version it had before. For a transaction on several states, that
+ * may leave some of them committed and some not.
+ *
+ * We can't undo everything a process was doing when it died. If it died just
+ * after locking a state, before recording that it had, or just before
+ * unlocking it, the state stays locked. If it was waiting for a state to
+ * change, the state's count of waiters will be one too high, so committers
+ * will wake waiters that aren't there. And if it died between pinning a slot
+ * and recording that it had, that slot will never be free again.
+ *
+ * 'header' is the state the table belongs to. For an arena, it is NULL, and
+ * the pins are recorded in the arena's header instead.
+ *
+ * Returns how many subscribers we tidied up after.
+ */
+static int reap_subscribers(struct kstate_subscribers *subscribers,
+                            struct kstate_header      *header)
+{
+  int reaped = 0;
+  int ii, slot;
+  for (ii = 0; ii < KSTATE_MAX_SUBSCRIBERS; ii++) {
+    struct kstate_subscriber *sub = &subscribers->table[ii];
+    uint32_t pid = __atomic_load_n(&sub->pid, __ATOMIC_ACQUIRE);
+    if (pid == 0 || pid == KSTATE_REAPING)
+      continue;
+    uint64_t start_time = __atomic_load_n(&sub->start_time, __ATOMIC_ACQUIRE);
+    if (subscriber_is_alive(pid, start_time))
+      continue;
+    // Make sure that no-one else tidies up after it as well
+    if (!__atomic_compare_exchange_n(&sub->pid, &pid, KSTATE_REAPING, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      continue;
+
+    LOG_INFO("Tidying up after subscriber %d, process %u, which has died\n",
+             ii, pid);
+    if (header) {
+      for (slot = 0; slot < KSTATE_NUM_SLOTS; slot++) {
+        uint32_t pins = sub->pins[slot];
+        if (pins)
+          __atomic_sub_fetch(&header->refs[slot], pins, __ATOMIC_SEQ_CST);
+        sub->pins[slot] = 0;
+      }
+      unlock_dead_locker(header, ii + 1);
+      STAT_SUB(header, subscribers, 1);
+    } else {
+      // An arena's table is in its header, along with a row of pin records
+      // for each entry in the table. Anything it was committing to, it had
+      // pinned, so that's also how we find what it may have left locked.
+      struct kstate_arena_header *arena = (struct kstate_arena_header *)
+        ((uint8_t *)subscribers - offsetof(struct kstate_arena_header,
+                                           subscribers));
+      uint32_t num_states = __atomic_load_n(&arena->num_states,
+                                            __ATOMIC_ACQUIRE);
+      if (num_states > arena->max_states)
+        num_states = arena->max_states;
+      int record;
+      for (record = 0; record < KSTATE_ARENA_PINS; record++) {
+        uint64_t value = arena->pins[ii][record];
+        if (value == 0)
+          continue;
+        uint32_t key = (uint32_t)(value >> 32) - 1;
+        uint32_t index = key >> KSTATE_SLOT_BITS;
+        slot = key & KSTATE_SLOT_MASK;
+        if (index < num_states) {
+          struct kstate_arena_entry *entry = arena_entry(arena, index);
+          __atomic_sub_fetch(&entry->header.refs[slot], (uint32_t)value,
+                             __ATOMIC_SEQ_CST);
+          unlock_dead_locker(&entry->header, ii + 1);
+        }
+        arena->pins[ii][record] = 0;
+      }
+    }
+    // It was a user, and we still are, so this can't be the last
+    __atomic_sub_fetch(&subscribers->users, 1, __ATOMIC_SEQ_CST);
+    sub->start_time = 0;
+    __atomic_store_n(&sub->pid, 0, __ATOMIC_RELEASE);
+    reaped++;
+  }
+  return reaped;
+}
+
+/*
+ * Return how many NUMA nodes this host may have, counting from node 0 to the
+ * highest numbered, or 1 if we can't tell (or it isn't NUMA at all).
+ */
+static uint32_t count_numa_nodes(void)
+{
+  char buf[256];
+  uint32_t nodes = 1;
+  FILE *file = fopen(KSTATE_NUMA_NODES_FILE, "r");
+  if (file == NULL)
+    return nodes;
+  if (fgets(buf, sizeof(buf), file)) {
+    // It's a list of ranges, such as "0-1,4", and we want the last number
+    char *ptr = buf;
+    while (*ptr) {
+      if (isdigit((unsigned char)*ptr)) {
+        unsigned long node = strtoul(ptr, &ptr, 10);
+        if (node < KSTATE_MAX_REPLICAS && node + 1 > nodes)
+          nodes = node + 1;
+      } else {
+        ptr ++;
+      }
+    }
+  }
+  fclose(file);
+  return nodes;
+}
+
+/*
+ * Return the NUMA node that we are running on, or 0 if we can't tell.
+ */
+static uint32_t this_numa_node(void)
+{
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL))
+    return 0;
+  return node;
+}
+
+/*
+ * Ask for each NUMA node's replica of a state's slots to be placed on that
+ * node, given a writable mapping of the whole of the state.
+ *
+ * For a shared memory object, the kernel remembers this for the object
+ * itself. For a persistent state's file, it only lasts as long as the
+ * mapping - but that's the mapping a writer copies each version into the
+ * replicas through, so it is what decides where their pages go. Either way,
+ * not getting it isn't an error (the replicas still work, they just aren't
+ * necessarily local), so we only say so.
+ */
+static void bind_replicas(const char *caller, struct kstate_shm *shm)
+{
+  uint32_t node;
+  size_t length = KSTATE_NUM_SLOTS * shm->slot_stride;
+  for (node = 0; node < shm->replicas; node++) {
+    unsigned long mask = 1UL << node;
+    void *addr = (uint8_t *)shm->header + replica_offset(shm->map_length, node);
+    if (syscall(SYS_mbind, addr, length, MPOL_BIND, &mask,
+                sizeof(mask) * 8, MPOL_MF_MOVE)) {
+      int rv = errno;
+      LOG_INFO("%s: Cannot bind replica to NUMA node %u: %d %s\n",
+               caller, node, rv, strerror(rv));
+      return;
+    }
+  }
+}
+
+/*
+ * Map a state's shared memory object.
+ *
+ * - 'name' is the name of the shared memory object.
+ * - 'fd' is the shared memory object, which must be open for read and write.
+ * - 'map_length' is the length of the state data in each version slot.
+ * - 'history' is how many versions the state's history holds, or 0.
+ * - 'replicas' is how many NUMA nodes have replicas of its slots, or 0.
+ * - 'mapping' is the state's KSTATE_MAP_xxx flags.
+ * - 'writable' says whether we want to be able to write to the version slots,
+ *   as well as to the header.
+ *
+ * If we succeed, we take ownership of both 'name' and 'fd', and they will be
+ * freed/closed when the mappings are released for the last time.
+ *
+ * Returns 0 and sets 'shm' if it succeeds, or a negative value (``-errno``)
+ * if it fails.
+ */
+static int map_shm(const char         *caller,
+                   char               *name,
+                   int                 fd,
+                   size_t              map_length,
+                   uint32_t            history,
+                   uint32_t            replicas,
+                   uint32_t            mapping,
+                   bool                writable,
+                   struct kstate_shm **shm)
+{
+  struct kstate_shm *new = malloc(sizeof(*new));
+  if (new == NULL) return -ENOMEM;
+
+  new->refs = 1;
+  new->name = name;
+  new->fd = fd;
+  new->map_length = map_length;
+  new->first_slot = header_size(map_length);
+  new->slot_stride = slot_size(map_length);
+  new->history = history;
+  new->replicas = replicas;
+
+  // We read from the replica on the node we're subscribing from, if there is
+  // one. Threads that move to another node afterwards still use it.
+  new->read_slot = new->first_slot;
+  if (replicas) {
+    uint32_t node = this_numa_node();
+    if (node < replicas)
+      new->read_slot = replica_offset(map_length, node);
+  }
+  new->subscriber = NULL;
+  new->pid = 0;
+  new->persistent = false;
+  new->locked = false;
+  new->arena = NULL;
+  new->flusher = NULL;
+  new->journal = NULL;
+
+  // Note that the read-only mapping is what is used to look at the state
+  // data, regardless of the permissions - the caller must use a transaction
+  // if they want to write to the memory.
+  size_t length = shm_size(map_length, history, replicas);
+  int flags = MAP_SHARED;
+  if (mapping & (KSTATE_MAP_POPULATE | KSTATE_MAP_LOCKED))
+    flags |= MAP_POPULATE;
+  new->ro_addr = mmap(NULL, length, PROT_READ, flags, fd, 0);
+  if (new->ro_addr == MAP_FAILED) {
+    int rv = errno;
+    LOG_ERROR("%s: Error in mapping shared memory (read-only): %d %s\n",
+              caller, rv, strerror(rv));
+    free(new);
+    return -rv;
+  }
+
+  // Everyone needs to be able to write to the header
+  new->rw_length = writable ? length : header_size(map_length);
+  new->header = mmap(NULL, new->rw_length, PROT_READ|PROT_WRITE, flags, fd, 0);
+  if (new->header == MAP_FAILED) {
+    int rv = errno;
+    LOG_ERROR("%s: Error in mapping shared memory (read/write): %d %s\n",
+              caller, rv, strerror(rv));
+    munmap(new->ro_addr, length);
+    free(new);
+    return -rv;
+  }
+  // Our subscriber table follows the state's header
+  new->subscribers = &((struct kstate_shm_header *) new->header)->subscribers;
+
+  if (slot_align(map_length) == KSTATE_HUGE_PAGE_SIZE) {
+    // Ask for huge pages. Whether we get them depends on how the kernel is
+    // configured (transparent_hugepage/shmem_enabled), and not getting them
+    // isn't an error, so we ignore the result.
+    (void) madvise(new->ro_addr, length, MADV_HUGEPAGE);
+    (void) madvise(new->header, new->rw_length, MADV_HUGEPAGE);
+  }
+
+  // Only a writer copies versions into the replicas
+  if (replicas && writable)
+    bind_replicas(caller, new);
+
+  // Locking the mappings faults in anything MAP_POPULATE didn't, and keeps
+  // it all in memory. Unmapping unlocks them again.
+  if (mapping & KSTATE_MAP_LOCKED) {
+    if (mlock(new->ro_addr, length) || mlock(new->header, new->rw_length)) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in locking shared memory: %d %s\n",
+                caller, rv, strerror(rv));
+      munmap(new->header, new->rw_length);
+      munmap(new->ro_addr, length);
+      free(new);
+      return -rv;
+    }
+    new->locked = true;
+  }
+
+  *shm = new;
+  return 0;
+}
+
+/*
+ * Flush the current version of a persistent state to its file.
+ *
+ * We write the data before the header that says it is current, so that if
+ * we stop part way through, the file still has the previous version. If a
+ * new version is committed whilst we are writing the data, the header would
+ * name a version we haven't written, so we start again with that one -
+ * though only a few times, so that a busy writer can't keep us here, after
+ * which we write the header anyway. Even then, a version committed between
+ * our last look and writing the header may be named before its data is
+ * written, as may anything the kernel writes back of its own accord, so this
+ * narrows the window rather than closing it.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int sync_shm(const char *caller, struct kstate_shm *shm)
+{
+  int rv;
+  int tries = 0;
+  for (;;) {
+    uint64_t current = pin_current(shm);
+    int slot = current_slot(current);
+    rv = msync(slot_data(shm, shm->ro_addr, slot),
+               slot_size(shm->map_length), MS_SYNC);
+    // and each replica of it, which readers will read after a restart
+    uint32_t node;
+    for (node = 0; rv == 0 && node < shm->replicas; node++)
+      rv = msync((uint8_t *)shm->ro_addr +
+                 replica_offset(shm->map_length, node) +
+                 slot * shm->slot_stride,
+                 slot_size(shm->map_length), MS_SYNC);
+    bool changed = get_current(shm->header) != current;
+    release_slot(shm, slot);
+    if (rv || !changed || ++tries >= KSTATE_SYNC_TRIES)
+      break;
+  }
+  if (rv == 0)
+    rv = msync(shm->ro_addr, header_size(shm->map_length), MS_SYNC);
+  if (rv) {
+    rv = -errno;
+    LOG_ERROR("%s: Error flushing state %s: %d %s\n", caller,
+              shm->name + KSTATE_NAME_PREFIX_LEN, -rv, strerror(-rv));
+  }
+  return rv;
+}
+
+static void *flusher_thread(void *arg)
+{
+  struct kstate_flusher *flusher = arg;
+  struct kstate_header *header = flusher->shm->header;
+
+  pthread_mutex_lock(&flusher->lock);
+  while (!flusher->stop) {
+    if (!flusher->wake) {
+      if (flusher->interval_ms) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += flusher->interval_ms / 1000;
+        until.tv_nsec += (flusher->interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+          until.tv_sec ++;
+          until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher->cond, &flusher->lock, &until);
+      } else {
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+      }
+      if (flusher->stop)
+        break;
+    }
+    flusher->wake = false;
+    pthread_mutex_unlock(&flusher->lock);
+
+    // There's no need to flush if nothing has been committed
+    uint32_t changes = __atomic_load_n(&header->changes, __ATOMIC_SEQ_CST);
+    if (changes != __atomic_load_n(&flusher->flushed, __ATOMIC_RELAXED)) {
+      sync_shm("kstate flusher", flusher->shm);
+      __atomic_store_n(&flusher->flushed, changes, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&flusher->lock);
+  }
+  pthread_mutex_unlock(&flusher->lock);
+  return NULL;
+}
+
+/*
+ * Start a thread to flush a persistent state's file in the background.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int start_flusher(const char          *caller,
+                         struct kstate_shm   *shm,
+                         uint32_t             interval_ms,
+                         uint32_t             commits)
+{
+  struct kstate_flusher *flusher = malloc(sizeof(*flusher));
+  if (flusher == NULL) return -ENOMEM;
+
+  flusher->shm = shm;
+  flusher->interval_ms = interval_ms;
+  flusher->commits = commits;
+  flusher->flushed = __atomic_load_n(&shm->header->changes, __ATOMIC_SEQ_CST);
+  flusher->stop = false;
+  flusher->wake = false;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&flusher->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&flusher->lock, NULL);
+
+  int rv = pthread_create(&flusher->thread, NULL, flusher_thread, flusher);
+  if (rv) {
+    LOG_ERROR("%s: Error starting flusher thread: %d %s\n",
+              caller, rv, strerror(rv));
+    pthread_cond_destroy(&flusher->cond);
+    pthread_mutex_destroy(&flusher->lock);
+    free(flusher);
+    return -rv;
+  }
+  shm->flusher = flusher;
+  return 0;
+}
+
+/*
+ * Stop a persistent state's flusher thread, after a last flush.
+ */
+static void stop_flusher(const char *caller, struct kstate_shm *shm)
+{
+  struct kstate_flusher *flusher = shm->flusher;
+
+  pthread_mutex_lock(&flusher->lock);
+  flusher->stop = true;
+  pthread_cond_signal(&flusher->cond);
+  pthread_mutex_unlock(&flusher->lock);
+  pthread_join(flusher->thread, NULL);
+
+  if (__atomic_load_n(&shm->header->changes, __ATOMIC_SEQ_CST) !=
+      flusher->flushed)
+    sync_shm(caller, shm);
+
+  pthread_cond_destroy(&flusher->cond);
+  pthread_mutex_destroy(&flusher->lock);
+  free(flusher);
+  shm->flusher = NULL;
+}
+
+/*
+ * After a commit, wake up the state's flusher if enough commits have
+ * happened since it last flushed.
+ *
+ * This is on the commit path, so it's only a couple of loads unless there
+ * is something to do.
+ */
+static inline void poke_flusher(struct kstate_shm *shm)
+{
+  struct kstate_flusher *flusher = shm->flusher;
+  if (flusher == NULL || flusher->commits == 0)
+    return;
+
+  uint32_t changes = __atomic_load_n(&shm->header->changes, __ATOMIC_RELAXED);
+  uint32_t flushed = __atomic_load_n(&flusher->flushed, __ATOMIC_RELAXED);
+  if (changes - flushed >= flusher->commits) {
+    pthread_mutex_lock(&flusher->lock);
+    flusher->wake = true;
+    pthread_cond_signal(&flusher->cond);
+    pthread_mutex_unlock(&flusher->lock);
+  }
+}
+
+// A journal is a file that starts with a 'struct journal_file_header', and
+// is followed by a record for each version of the state that we saw, as a
+// 'struct journal_record' and then that record's ranges - each a 'struct
+// journal_range' and then the data for that range. Alongside it, the
+// "<journal>.checkpoint" file has a 'struct journal_checkpoint' and then a
+// whole copy of the state's data, as it was at the last record before the
+// journal was started afresh.
+#define KSTATE_JOURNAL_MAGIC    0x4B534A4C      // "KSJL"
+#define KSTATE_RECORD_MAGIC     0x4B534A52      // "KSJR"
+#define KSTATE_CHECKPOINT_MAGIC 0x4B534A43      // "KSJC"
+#define KSTATE_JOURNAL_VERSION  1
+
+// How many records we write before writing a checkpoint, by default
+#define KSTATE_DEFAULT_CHECKPOINT_RECORDS 1000
+
+// We compare versions in chunks of this many bytes, so that a record's
+// ranges don't get too fragmented
+#define KSTATE_JOURNAL_CHUNK    64
+
+// How long the journal thread waits for a change before checking that it
+// hasn't been told to stop
+#define KSTATE_JOURNAL_WAIT_MS  50
+
+struct journal_file_header {
+  uint32_t   magic;       // KSTATE_JOURNAL_MAGIC
+  uint32_t   version;     // KSTATE_JOURNAL_VERSION
+  uint64_t   length;      // The length of the state data
+};
+
+struct journal_record {
+  uint32_t   magic;       // KSTATE_RECORD_MAGIC
+  uint32_t   num_ranges;  // How many ranges follow
+  uint64_t   seq;         // Sequence number, one more than the last record's
+  uint64_t   time_ns;     // When we saw this version (CLOCK_REALTIME)
+  uint32_t   payload_len; // The length of the ranges, with their data
+  uint32_t   checksum;    // Of the ranges, with their data
+};
+
+struct journal_range {
+  uint32_t   offset;
+  uint32_t   length;
+};
+
+struct journal_checkpoint {
+  uint32_t   magic;       // KSTATE_CHECKPOINT_MAGIC
+  uint32_t   version;     // KSTATE_JOURNAL_VERSION
+  uint64_t   length;      // The length of the state data
+  uint64_t   seq;         // The sequence number of the last record included
+  uint64_t   time_ns;     // and when that record was written
+  uint32_t   checksum;    // Of the data
+  uint32_t   unused;
+};
+
+// A thread that journals a state. It belongs to the state's mappings, and
+// stops when they are released.
+struct kstate_journal {
+  struct kstate_shm *shm;       // What we're journaling
+  char      *filename;          // The journal file (which we own)
+  char      *checkpoint_name;   // and its checkpoint (likewise)
+  int        fd;                // The journal file itself
+  uint32_t   checkpoint_records;// How many records before a checkpoint
+
+  // Only used by the journal thread, once it's started
+  uint32_t   records;           // Records written since the last checkpoint
+  uint64_t   seq;               // The last record's sequence number
+  uint64_t   time_ns;           // and when it was written
+  off_t      offset;            // Where the next record goes
+  uint32_t   seen;              // The change count for the last record
+  uint8_t   *previous;          // The version we last journaled
+  uint8_t   *buffer;            // For putting together a record
+
+  pthread_t  thread;
+  bool       stop;              // Time to stop (atomic)
+  pthread_mutex_t lock;         // Protects 'synced' and 'error'
+  pthread_cond_t  cond;         // Broadcast when either changes
+  uint32_t   synced;            // The change count we've journaled up to
+  int        error;             // Non-zero if journaling has failed
+};
+
+// A simple (FNV-1a) checksum, which is enough to spot a record that was
+// only partly written
+static uint32_t checksum(const uint8_t *data, size_t length)
+{
+  uint32_t sum = 2166136261U;
+  size_t ii;
+  for (ii = 0; ii < length; ii++) {
+    sum ^= data[ii];
+    sum *= 16777619U;
+  }
+  return sum;
+}
+
+static uint64_t realtime_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// The most room a record's ranges can need, for a state of 'length' bytes
+static size_t max_payload_len(size_t length)
+{
+  return length +
+         sizeof(struct journal_range) * (length / KSTATE_JOURNAL_CHUNK + 1);
+}
+
+static int write_all(int fd, const void *data, size_t length, off_t offset)
+{
+  const uint8_t *ptr = data;
+  while (length > 0) {
+    ssize_t done = pwrite(fd, ptr, length, offset);
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    ptr += done;
+    offset += done;
+    length -= done;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *data, size_t length, off_t offset)
+{
+  uint8_t *ptr = data;
+  while (length > 0) {
+    ssize_t done = pread(fd, ptr, length, offset);
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    } else if (done == 0) {
+      return -ENODATA;          // it's shorter than we expected
+    }
+    ptr += done;
+    offset += done;
+    length -= done;
+  }
+  return 0;
+}
+
+/*
+ * Put together the ranges of 'data' that differ from 'previous' (both of
+ * 'length' bytes), each followed by its data, in 'payload' - which must have
+ * room for max_payload_len(length) bytes - and update 'previous' to match.
+ *
+ * Returns the length of the ranges, with their data, and sets 'num_ranges'
+ * to how many ranges there are.
+ */
+static size_t diff_version(uint8_t       *previous,
+                           const uint8_t *data,
+                           size_t         length,
+                           uint8_t       *payload,
+                           uint32_t      *num_ranges)
+{
+  size_t payload_len = 0;
+  size_t offset = 0;
+  *num_ranges = 0;
+  while (offset < length) {
+    size_t chunk = length - offset < KSTATE_JOURNAL_CHUNK ?
+                   length - offset : KSTATE_JOURNAL_CHUNK;
+    if (!memcmp(previous + offset, data + offset, chunk)) {
+      offset += chunk;
+      continue;
+    }
+    // Carry on to the end of this run of altered chunks
+    size_t start = offset;
+    while (offset < length) {
+      chunk = length - offset < KSTATE_JOURNAL_CHUNK ?
+              length - offset : KSTATE_JOURNAL_CHUNK;
+      if (!memcmp(previous + offset, data + offset, chunk))
+        break;
+      offset += chunk;
+    }
+    struct journal_range range = { start, offset - start };
+    memcpy(payload + payload_len, &range, sizeof(range));
+    payload_len += sizeof(range);
+    memcpy(payload + payload_len, data + start, range.length);
+    memcpy(previous + start, data + start, range.length);
+    payload_len += range.length;
+    (*num_ranges) ++;
+  }
+  return payload_len;
+}
+
+/*
+ * Copy the ranges put together by diff_version into 'data' (of 'length'
+ * bytes), and if 'transaction' isn't NULL, mark them dirty in it.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the ranges don't make sense (in
+ * which case any before the first bad one have been copied).
+ */
+static int apply_ranges(uint8_t              *data,
+                        size_t                length,
+                        const uint8_t        *payload,
+                        size_t                payload_len,
+                        uint32_t              num_ranges,
+                        kstate_transaction_p  transaction)
+{
+  uint32_t ii;
+  size_t pos = 0;
+  for (ii = 0; ii < num_ranges; ii++) {
+    struct journal_range range;
+    if (pos + sizeof(range) > payload_len)
+      return -EINVAL;
+    memcpy(&range, payload + pos, sizeof(range));
+    pos += sizeof(range);
+    if (range.length > payload_len - pos ||
+        range.offset > length || range.length > length - range.offset)
+      return -EINVAL;
+    memcpy(data + range.offset, payload + pos, range.length);
+    if (transaction)
+      (void) kstate_transaction_mark_dirty(transaction, range.offset,
+                                           range.length);
+    pos += range.length;
+  }
+  return 0;
+}
+
+static char *checkpoint_filename(const char *filename, const char *suffix)
+{
+  size_t len = strlen(filename) + strlen(".checkpoint") + strlen(suffix) + 1;
+  char *name = malloc(len);
+  if (name)
+    snprintf(name, len, "%s.checkpoint%s", filename, suffix);
+  return name;
+}
+
+/*
+ * Reconstruct a state's data from its journal (and checkpoint).
+ *
+ * - 'data' is where to put it, and 'length' its length, which must match
+ *   that of the state that was journaled.
+ * - Records later than 'until_ns' (CLOCK_REALTIME) are ignored.
+ * - 'seq' and 'time_ns' are set to the sequence number and time of the last
+ *   record used (or the checkpoint), or 0 if there was nothing.
+ *
+ * Neither file need exist, in which case the data is all zeroes. A record
+ * that was only partly written (at the end) is ignored.
+ *
+ * Returns 0 if it succeeds, -EINVAL if the journal is for a state of a
+ * different length, -ERANGE if 'until_ns' is before the checkpoint, or
+ * another negative value (``-errno``) if it fails.
+ */
+static int load_journal(const char *caller,
+                        const char *filename,
+                        uint64_t    until_ns,
+                        void       *data,
+                        size_t      length,
+                        uint64_t   *seq,
+                        uint64_t   *time_ns)
+{
+  int rv = 0;
+  memset(data, 0, length);
+  *seq = 0;
+  *time_ns = 0;
+
+  char *checkpoint_name = checkpoint_filename(filename, "");
+  if (checkpoint_name == NULL)
+    return -ENOMEM;
+  int fd = open(checkpoint_name, O_RDONLY);
+  if (fd < 0 && errno != ENOENT) {
+    rv = -errno;
+    LOG_ERROR("%s: Error opening journal checkpoint %s: %d %s\n", caller,
+              checkpoint_name, -rv, strerror(-rv));
+  } else if (fd >= 0) {
+    struct journal_checkpoint checkpoint;
+    rv = read_all(fd, &checkpoint, sizeof(checkpoint), 0);
+    if (rv == 0 && (checkpoint.magic != KSTATE_CHECKPOINT_MAGIC ||
+                    checkpoint.version != KSTATE_JOURNAL_VERSION ||
+                    checkpoint.length != length)) {
+      LOG_ERROR("%s: Journal checkpoint %s is not for a state of"
+                " length %zu\n", caller, checkpoint_name, length);
+      rv = -EINVAL;
+    }
+    if (rv == 0)
+      rv = read_all(fd, data, length, sizeof(checkpoint));
+    if (rv == 0 && checksum(data, length) != checkpoint.checksum) {
+      LOG_ERROR("%s: Journal checkpoint %s is corrupt\n", caller,
+                checkpoint_name);
+      rv = -EIO;
+    }
+    if (rv == 0 && checkpoint.time_ns > until_ns) {
+      LOG_ERROR("%s: Journal %s does not go back that far\n", caller,
+                filename);
+      rv = -ERANGE;
+    }
+    close(fd);
+    *seq = checkpoint.seq;
+    *time_ns = checkpoint.time_ns;
+  }
+  free(checkpoint_name);
+  if (rv)
+    return rv;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT)
+      return 0;
+    rv = -errno;
+    LOG_ERROR("%s: Error opening journal %s: %d %s\n", caller,
+              filename, -rv, strerror(-rv));
+    return rv;
+  }
+
+  struct journal_file_header file_header;
+  rv = read_all(fd, &file_header, sizeof(file_header), 0);
+  if (rv == -ENODATA) {
+    // We must have stopped before we'd finished starting it
+    close(fd);
+    return 0;
+  } else if (rv == 0 && (file_header.magic != KSTATE_JOURNAL_MAGIC ||
+                         file_header.version != KSTATE_JOURNAL_VERSION ||
+                         file_header.length != length)) {
+    LOG_ERROR("%s: Journal %s is not for a state of length %zu\n", caller,
+              filename, length);
+    rv = -EINVAL;
+  }
+
+  size_t max_len = max_payload_len(length);
+  uint8_t *payload = NULL;
+  if (rv == 0) {
+    payload = malloc(max_len);
+    if (payload == NULL)
+      rv = -ENOMEM;
+  }
+
+  off_t offset = sizeof(file_header);
+  while (rv == 0) {
+    struct journal_record record;
+    if (read_all(fd, &record, sizeof(record), offset))
+      break;
+    if (record.magic != KSTATE_RECORD_MAGIC || record.payload_len > max_len)
+      break;
+    if (read_all(fd, payload, record.payload_len, offset + sizeof(record)))
+      break;
+    if (checksum(payload, record.payload_len) != record.checksum)
+      break;
+    if (record.time_ns > until_ns)
+      break;
+    offset += sizeof(record) + record.payload_len;
+
+    // If we stopped between writing a checkpoint and starting the journal
+    // afresh, the checkpoint already includes this
+    if (record.seq <= *seq)
+      continue;
+
+    (void) apply_ranges(data, length, payload, record.payload_len,
+                        record.num_ranges, NULL);
+    *seq = record.seq;
+    *time_ns = record.time_ns;
+  }
+
+  free(payload);
+  close(fd);
+  return rv;
+}
+
+/*
+ * Write a checkpoint of the version we last journaled, and start the
+ * journal afresh.
+ *
+ * The checkpoint is written to a new file, which then replaces the old one,
+ * so there is always a whole checkpoint.
+ */
+static int write_checkpoint(const char *caller, struct kstate_journal *journal)
+{
+  size_t length = journal->shm->map_length;
+  int rv = 0;
+
+  char *new_name = checkpoint_filename(journal->filename, ".new");
+  if (new_name == NULL)
+    return -ENOMEM;
+
+  int fd = open(new_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    rv = -errno;
+  } else {
+    struct journal_checkpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.magic = KSTATE_CHECKPOINT_MAGIC;
+    checkpoint.version = KSTATE_JOURNAL_VERSION;
+    checkpoint.length = length;
+    checkpoint.seq = journal->seq;
+    checkpoint.time_ns = journal->time_ns;
+    checkpoint.checksum = checksum(journal->previous, length);
+    rv = write_all(fd, &checkpoint, sizeof(checkpoint), 0);
+    if (rv == 0)
+      rv = write_all(fd, journal->previous, length, sizeof(checkpoint));
+    if (rv == 0 && fdatasync(fd))
+      rv = -errno;
+    close(fd);
+    if (rv == 0 && rename(new_name, journal->checkpoint_name))
+      rv = -errno;
+  }
+  if (rv) {
+    LOG_ERROR("%s: Error writing journal checkpoint %s: %d %s\n", caller,
+              new_name, -rv, strerror(-rv));
+    free(new_name);
+    return rv;
+  }
+  free(new_name);
+
+  // And now the journal need only hold what happens next
+  struct journal_file_header file_header;
+  file_header.magic = KSTATE_JOURNAL_MAGIC;
+  file_header.version = KSTATE_JOURNAL_VERSION;
+  file_header.length = length;
+  if (ftruncate(journal->fd, 0))
+    rv = -errno;
+  if (rv == 0)
+    rv = write_all(journal->fd, &file_header, sizeof(file_header), 0);
+  if (rv == 0 && fdatasync(journal->fd))
+    rv = -errno;
+  if (rv) {
+    LOG_ERROR("%s: Error starting journal %s afresh: %d %s\n", caller,
+              journal->filename, -rv, strerror(-rv));
+    return rv;
+  }
+  journal->offset = sizeof(file_header);
+  journal->records = 0;
+  return 0;
+}
+
+/*
+ * Journal the current version of the state, if it differs from the one we
+ * last journaled. 'changes' is the state's change count, read before we
+ * look at the current version.
+ */
+static int journal_version(struct kstate_journal *journal, uint32_t changes)
+{
+  size_t length = journal->shm->map_length;
+  struct journal_record record;
+  uint8_t *payload = journal->buffer + sizeof(record);
+  uint32_t num_ranges;
+
+  uint64_t current = pin_current(journal->shm);
+  const uint8_t *data = slot_data(journal->shm, journal->shm->ro_addr,
+                                  current_slot(current));
+  size_t payload_len = diff_version(journal->previous, data, length, payload,
+                                    &num_ranges);
+  release_slot(journal->shm, current_slot(current));
+
+  journal->seen = changes;
+  if (num_ranges == 0)
+    return 0;
+
+  record.magic = KSTATE_RECORD_MAGIC;
+  record.num_ranges = num_ranges;
+  record.seq = journal->seq + 1;
+  record.time_ns = realtime_ns();
+  record.payload_len = payload_len;
+  record.checksum = checksum(payload, payload_len);
+  memcpy(journal->buffer, &record, sizeof(record));
+
+  int rv = write_all(journal->fd, journal->buffer, sizeof(record) + payload_len,
+                     journal->offset);
+  if (rv == 0 && fdatasync(journal->fd))
+    rv = -errno;
+  if (rv) {
+    LOG_ERROR("kstate journal: Error writing to journal %s: %d %s\n",
+              journal->filename, -rv, strerror(-rv));
+    return rv;
+  }
+  journal->offset += sizeof(record) + payload_len;
+  journal->seq = record.seq;
+  journal->time_ns = record.time_ns;
+  journal->records ++;
+
+  if (journal->checkpoint_records &&
+      journal->records >= journal->checkpoint_records)
+    rv = write_checkpoint("kstate journal", journal);
+  return rv;
+}
+
+static void *journal_thread(void *arg)
+{
+  struct kstate_journal *journal = arg;
+  struct kstate_header *header = journal->shm->header;
+  struct timespec timeout = { 0, KSTATE_JOURNAL_WAIT_MS * 1000000L };
+
+  for (;;) {
+    // Look before we read the change count, so that we always journal
+    // everything that was committed before we were told to stop
+    bool stopping = __atomic_load_n(&journal->stop, __ATOMIC_SEQ_CST);
+    uint32_t changes = __atomic_load_n(&header->changes, __ATOMIC_SEQ_CST);
+    if (changes == journal->seen) {
+      if (stopping)
+        break;
+      (void) wait_for_change(header, changes, &timeout);
+      continue;
+    }
+    // Everything committed whilst we are writing this record gets gathered
+    // up into the next one
+    int rv = journal_version(journal, changes);
+    pthread_mutex_lock(&journal->lock);
+    if (rv)
+      journal->error = rv;
+    else
+      journal->synced = changes;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->lock);
+    if (rv)
+      break;
+  }
+  return NULL;
+}
+
+static void free_journal(struct kstate_journal *journal)
+{
+  if (journal->fd >= 0)
+    close(journal->fd);       // which also lets go of our lock on it
+  free(journal->filename);
+  free(journal->checkpoint_name);
+  free(journal->previous);
+  free(journal->buffer);
+  free(journal);
+}
+
+/*
+ * Start journaling a state.
+ *
+ * If 'creating', then we've just created the state's shared memory, and
+ * have not yet told anyone else it is ready, so restore its data from the
+ * journal first.
+ *
+ * Returns 0 if it succeeds, -EBUSY if someone else is already journaling
+ * the state to the same file, or another negative value (``-errno``) if it
+ * fails.
+ */
+static int start_journal(const char          *caller,
+                         struct kstate_shm   *shm,
+                         const char          *filename,
+                         uint32_t             checkpoint_records,
+                         bool                 creating)
+{
+  size_t length = shm->map_length;
+  int rv;
+
+  struct kstate_journal *journal = malloc(sizeof(*journal));
+  if (journal == NULL) return -ENOMEM;
+  memset(journal, 0, sizeof(*journal));
+  journal->shm = shm;
+  journal->checkpoint_records = checkpoint_records;
+  journal->filename = strdup(filename);
+  journal->checkpoint_name = checkpoint_filename(filename, "");
+  journal->previous = malloc(length);
+  journal->buffer = malloc(sizeof(struct journal_record) +
+                           max_payload_len(length));
+  journal->fd = -1;
+  if (!journal->filename || !journal->checkpoint_name ||
+      !journal->previous || !journal->buffer) {
+    free_journal(journal);
+    return -ENOMEM;
+  }
+
+  journal->fd = open(filename, O_RDWR | O_CREAT, 0666);
+  if (journal->fd < 0) {
+    rv = -errno;
+    LOG_ERROR("%s: Error opening journal %s: %d %s\n", caller,
+              filename, -rv, strerror(-rv));
+    free_journal(journal);
+    return rv;
+  }
+  if (flock(journal->fd, LOCK_EX | LOCK_NB)) {
+    rv = errno == EWOULDBLOCK ? -EBUSY : -errno;
+    LOG_ERROR("%s: Cannot lock journal %s (is someone else journaling"
+              " to it?): %d %s\n", caller, filename, -rv, strerror(-rv));
+    free_journal(journal);
+    return rv;
+  }
+
+  struct kstate_header *header = shm->header;
+  if (creating) {
+    // No-one else can see the state yet, so we can write straight into its
+    // current version
+    int slot = current_slot(get_current(header));
+    rv = load_journal(caller, filename, UINT64_MAX,
+                      slot_data(shm, header, slot),
+                      length, &journal->seq, &journal->time_ns);
+    if (rv) {
+      free_journal(journal);
+      return rv;
+    }
+    copy_to_replicas(shm, slot);
+  } else {
+    // Carry on from the last sequence number, if there is one
+    rv = load_journal(caller, filename, UINT64_MAX, journal->previous,
+                      length, &journal->seq, &journal->time_ns);
+    if (rv) {
+      free_journal(journal);
+      return rv;
+    }
+  }
+
+  // Start with a checkpoint of the current version, so that the journal
+  // only needs to say what happens from now on
+  journal->seen = __atomic_load_n(&header->changes, __ATOMIC_SEQ_CST);
+  uint64_t current = pin_current(shm);
+  memcpy(journal->previous,
+         slot_data(shm, shm->ro_addr, current_slot(current)), length);
+  release_slot(shm, current_slot(current));
+  journal->time_ns = realtime_ns();
+  rv = write_checkpoint(caller, journal);
+  if (rv) {
+    free_journal(journal);
+    return rv;
+  }
+  journal->synced = journal->seen;
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->cond, NULL);
+  rv = pthread_create(&journal->thread, NULL, journal_thread, journal);
+  if (rv) {
+    LOG_ERROR("%s: Error starting journal thread: %d %s\n",
+              caller, rv, strerror(rv));
+    pthread_cond_destroy(&journal->cond);
+    pthread_mutex_destroy(&journal->lock);
+    free_journal(journal);
+    return -rv;
+  }
+  shm->journal = journal;
+  return 0;
+}
+
+/*
+ * Stop journaling a state, once everything committed so far is journaled.
+ */
+static void stop_journal(struct kstate_shm *shm)
+{
+  struct kstate_journal *journal = shm->journal;
+
+  __atomic_store_n(&journal->stop, true, __ATOMIC_SEQ_CST);
+  // This may wake other waiters on the state, but they will just wait again
+  syscall(SYS_futex, &shm->header->changes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  pthread_join(journal->thread, NULL);
+
+  pthread_cond_destroy(&journal->cond);
+  pthread_mutex_destroy(&journal->lock);
+  free_journal(journal);
+  shm->journal = NULL;
+}
+
+/*
+ * Wait until the journal has caught up with everything committed so far.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if journaling
+ * has failed.
+ */
+static int sync_journal(struct kstate_shm *shm)
+{
+  struct kstate_journal *journal = shm->journal;
+  uint32_t changes = __atomic_load_n(&shm->header->changes, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->error == 0 && (int32_t)(journal->synced - changes) < 0)
+    pthread_cond_wait(&journal->cond, &journal->lock);
+  int rv = journal->error;
+  pthread_mutex_unlock(&journal->lock);
+  return rv;
+}
+
+/*
+ * Read the header of someone else's shared memory object (a state's, or an
+ * arena's), which starts with its magic number and layout.
+ *
+ * Whoever created the object may still be setting it up, so we wait (a
+ * little while) for that to finish.
+ *
+ * Returns 0 and copies the first 'header_len' bytes of the object into
+ * 'header' if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int read_shm_header(const char *caller,
+                           int         fd,
+                           uint32_t    magic,
+                           void       *header,
+                           size_t      header_len)
+{
+  int tries;
+  for (tries = 0; tries < KSTATE_SETUP_TRIES; tries++) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in fstat on shared memory: %d %s\n",
+                caller, rv, strerror(rv));
+      return -rv;
+    }
+
+    // No header at all means it hasn't been given a size yet
+    if (st.st_size >= (off_t) header_len) {
+      uint32_t *theirs = mmap(NULL, header_len, PROT_READ, MAP_SHARED, fd, 0);
+      if (theirs == MAP_FAILED) {
+        int rv = errno;
+        LOG_ERROR("%s: Error in mapping shared memory header: %d %s\n",
+                  caller, rv, strerror(rv));
+        return -rv;
+      }
+      // The header is filled in before the magic number is set
+      uint32_t their_magic = __atomic_load_n(&theirs[0], __ATOMIC_ACQUIRE);
+      uint32_t layout = theirs[1];
+      if (their_magic == magic && layout == KSTATE_LAYOUT)
+        memcpy(header, theirs, header_len);
+      munmap(theirs, header_len);
+
+      if (their_magic == magic && layout == KSTATE_LAYOUT) {
+        return 0;
+      } else if (their_magic != 0) {
+        LOG_ERROR("%s: Shared memory header not recognised:"
+                  " magic 0x%x layout %u, expected 0x%x layout %u\n",
+                  caller, their_magic, layout, magic, KSTATE_LAYOUT);
+        return -EINVAL;
+      }
+    }
+    usleep(KSTATE_SETUP_WAIT_US);
+  }
+  LOG_ERROR("%s: Shared memory was not set up in time\n", caller);
+  return -ETIMEDOUT;
+}
+
+/*
+ * Find out the length of the state data in someone else's shared memory
+ * object, how many versions its history holds, and how many NUMA nodes have
+ * replicas of it, from its header.
+ *
+ * Returns 0 and sets 'map_length', 'history' and 'replicas' if it succeeds,
+ * or a negative value (``-errno``) if it fails.
+ */
+static int read_shm_length(const char *caller,
+                           int         fd,
+                           size_t     *map_length,
+                           uint32_t   *history,
+                           uint32_t   *replicas)
+{
+  struct kstate_header header;
+  int rv = read_shm_header(caller, fd, KSTATE_MAGIC, &header, sizeof(header));
+  if (rv == 0) {
+    *map_length = header.length;
+    *history = header.history;
+    *replicas = header.replicas;
+  }
+  return rv;
+}
+
+/*
+ * Join a shared memory object's subscribers, and set 'entry' to our entry in
+ * its table.
+ *
+ * 'header' is the state the table belongs to, or NULL for an arena. If
+ * 'creating', then we made the shared memory object, and no-one else can be
+ * using it yet.
+ *
+ * Returns 0 if it succeeds, -EAGAIN if the last subscriber has just left (so
+ * the object is being unlinked, and we need to open it all over again),
+ * -EUSERS if the table is full, or another negative value (``-errno``) if it
+ * fails.
+ */
+static int join_subscribers(const char                 *caller,
+                            struct kstate_subscribers  *subscribers,
+                            struct kstate_header       *header,
+                            bool                        creating,
+                            struct kstate_subscriber  **entry)
+{
+  if (creating) {
+    subscribers->users = 1;
+  } else {
+    uint32_t users = __atomic_load_n(&subscribers->users, __ATOMIC_SEQ_CST);
+    do {
+      if (users & KSTATE_USERS_GONE)
+        return -EAGAIN;
+    } while (!__atomic_compare_exchange_n(&subscribers->users, &users,
+                                          users + 1, false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+    // Whilst we're here, see if anyone has left without saying
+    (void) reap_subscribers(subscribers, header);
+  }
+
+  uint32_t pid = getpid();
+  int ii;
+  for (ii = 0; ii < KSTATE_MAX_SUBSCRIBERS; ii++) {
+    struct kstate_subscriber *sub = &subscribers->table[ii];
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&sub->pid, &expected, pid, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      // Until this is set, we can only be recognised by our process id
+      __atomic_store_n(&sub->start_time, our_start_time(), __ATOMIC_RELEASE);
+      *entry = sub;
+      if (header)
+        STAT_ADD(header, subscribers, 1);
+      return 0;
+    }
+  }
+
+  LOG_ERROR("%s: Shared memory already has the maximum of %d subscribers\n",
+            caller, KSTATE_MAX_SUBSCRIBERS);
+  __atomic_sub_fetch(&subscribers->users, 1, __ATOMIC_SEQ_CST);
+  return -EUSERS;
+}
+
+/*
+ * Leave a shared memory object's subscribers, giving up our 'entry' in its
+ * table.
+ *
+ * 'header' is the state the table belongs to, or NULL for an arena. If we
+ * were the last subscriber, we unlink the shared memory object, whose name is
+ * 'name' (unless it is 'persistent', in which case its file stays put).
+ */
+static void leave_subscribers(const char                 *caller,
+                              struct kstate_subscribers  *subscribers,
+                              struct kstate_header       *header,
+                              struct kstate_subscriber   *entry,
+                              const char                 *name,
+                              bool                        persistent)
+{
+  entry->start_time = 0;
+  __atomic_store_n(&entry->pid, 0, __ATOMIC_RELEASE);
+  if (header)
+    STAT_SUB(header, subscribers, 1);
+
+  // Once the last subscriber has gone, no-one else can join, so anyone who
+  // opened the object just beforehand knows to look for a new one
+  uint32_t users = __atomic_load_n(&subscribers->users, __ATOMIC_SEQ_CST);
+  uint32_t new_users;
+  do {
+    new_users = (users == 1 && !persistent) ? KSTATE_USERS_GONE : users - 1;
+  } while (!__atomic_compare_exchange_n(&subscribers->users, &users, new_users,
+                                        false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST));
+  if (new_users != KSTATE_USERS_GONE)
+    return;
+
+  if (shm_unlink(name)) {
+    int rv = errno;
+    if (rv == ENOENT) {
+      LOG_INFO("%s: Unable to unlink %s, it has already gone.\n",
+               caller, name);
+    } else {
+      LOG_ERROR("%s: Error unlinking %s: %d %s\n", caller, name,
+                rv, strerror(rv));
+    }
+  }
+}
+
+// Everything in an arena is aligned to a cache line, so that states don't
+// get in each other's way
+#define KSTATE_ARENA_ALIGN      64
+
+static size_t arena_align(size_t length)
+{
+  return (length + KSTATE_ARENA_ALIGN - 1) & ~(size_t)(KSTATE_ARENA_ALIGN - 1);
+}
+
+/*
+ * Return the offset of an arena's index, which follows its header.
+ */
+static size_t arena_index_offset(void)
+{
+  return arena_align(sizeof(struct kstate_arena_header));
+}
+
+/*
+ * Return the offset of an arena's first entry, which starts on a page of
+ * its own after the index.
+ */
+static size_t arena_entries_offset(uint32_t index_size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t end = arena_index_offset() + index_size * sizeof(uint32_t);
+  return (end + page - 1) & ~(page - 1);
+}
+
+/*
+ * Return the size of each entry in an arena.
+ */
+static size_t arena_entry_size(void)
+{
+  return arena_align(sizeof(struct kstate_arena_entry));
+}
+
+/*
+ * Return the offset of the states' slots in an arena, which start on a page
+ * of their own after the entries, so that they can be mapped differently.
+ */
+static size_t arena_data_offset(uint32_t index_size, uint32_t max_states)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t end = arena_entries_offset(index_size) +
+               max_states * arena_entry_size();
+  return (end + page - 1) & ~(page - 1);
+}
+
+/*
+ * Return the size of each state's slots in an arena, given its length.
+ */
+static size_t arena_state_size(size_t length)
+{
+  return KSTATE_NUM_SLOTS * arena_align(length);
+}
+
+/*
+ * Return the offset of the first slot of the state with the given entry
+ * number in an arena.
+ */
+static size_t arena_state_offset(struct kstate_arena *arena, uint32_t index)
+{
+  return arena->data_offset + index * arena_state_size(arena->header->length);
+}
+
+// The arenas we have mapped. Any thread may be subscribing to a state in
+// one, so the list has a lock.
+static struct kstate_arena *arenas = NULL;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Unmap an arena, and forget about it.
+ */
+static void free_arena(struct kstate_arena *arena)
+{
+  if (arena->header)
+    munmap(arena->header, arena->length);
+  if (arena->ro_addr)
+    munmap(arena->ro_addr, arena->length);
+  close(arena->fd);
+  free(arena->name);
+  free(arena);
+}
+
+/*
+ * Open (or create) and map an arena's shared memory object, and join its
+ * subscribers. A writer may create it, with room for 'max_states' states of
+ * 'length' bytes each.
+ *
+ * Returns 0 and sets 'arena' if it succeeds, or a negative value
+ * (``-errno``) if it fails.
+ */
+static int map_arena(const char           *caller,
+                     const char           *name,
+                     bool                  writer,
+                     uint32_t              max_states,
+                     size_t                length,
+                     struct kstate_arena **arena)
+{
+  // As for a state's own shared memory object (see open_shm)
+  mode_t shm_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+  for (;;) {
+    int fd;
+    bool creating = false;
+    for (;;) {
+      if (writer) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, shm_mode);
+        if (fd >= 0) {
+          creating = true;
+          break;
+        } else if (errno != EEXIST) {
+          break;
+        }
+      }
+      fd = shm_open(name, O_RDWR, 0);
+      // If someone unlinked it between our two attempts, try again
+      if (fd >= 0 || errno != ENOENT || !writer)
+        break;
+    }
+    if (fd < 0) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in shm_open(\"%s\"): %d %s\n",
+                caller, name, rv, strerror(rv));
+      return -rv;
+    }
+
+    uint32_t index_size = 1;
+    if (creating) {
+      while (index_size < 2 * max_states)
+        index_size <<= 1;
+    } else {
+      // Someone else decided how big it is
+      struct kstate_arena_header theirs;
+      int rv = read_shm_header(caller, fd, KSTATE_ARENA_MAGIC, &theirs,
+                               offsetof(struct kstate_arena_header,
+                                        subscribers));
+      if (rv) {
+        close(fd);
+        return rv;
+      }
+      max_states = theirs.max_states;
+      length = theirs.length;
+      index_size = theirs.index_size;
+    }
+
+    struct kstate_arena *new = malloc(sizeof(*new));
+    if (new == NULL) {
+      if (creating)
+        shm_unlink(name);
+      close(fd);
+      return -ENOMEM;
+    }
+    memset(new, 0, sizeof(*new));
+    new->refs = 1;
+    new->fd = fd;
+    new->data_offset = arena_data_offset(index_size, max_states);
+    new->length = new->data_offset + max_states * arena_state_size(length);
+    new->name = strdup(name);
+    if (new->name == NULL) {
+      if (creating)
+        shm_unlink(name);
+      free_arena(new);
+      return -ENOMEM;
+    }
+
+    if (creating && ftruncate(fd, new->length)) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in setting size of arena %s to 0x%zx: %d %s\n",
+                caller, name, new->length, rv, strerror(rv));
+      shm_unlink(name);
+      free_arena(new);
+      return -rv;
+    }
+
+    // Everyone needs to be able to write to the headers and entries, but
+    // the states' slots are only made writable as we subscribe to them for
+    // write (see open_arena_state)
+    new->header = mmap(NULL, new->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (new->header == MAP_FAILED) {
+      new->header = NULL;
+    } else if (mprotect(new->header, new->data_offset,
+                        PROT_READ|PROT_WRITE)) {
+      munmap(new->header, new->length);
+      new->header = NULL;
+    }
+    new->ro_addr = mmap(NULL, new->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (new->ro_addr == MAP_FAILED)
+      new->ro_addr = NULL;
+    if (new->header == NULL || new->ro_addr == NULL) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in mapping arena %s: %d %s\n",
+                caller, name, rv, strerror(rv));
+      if (creating)
+        shm_unlink(name);
+      free_arena(new);
+      return -rv;
+    }
+
+    int rv = join_subscribers(caller, &new->header->subscribers, NULL,
+                              creating, &new->subscriber);
+    if (rv == -EAGAIN) {
+      // The last subscriber has just left, so it is being unlinked
+      free_arena(new);
+      continue;
+    } else if (rv) {
+      free_arena(new);
+      return rv;
+    }
+    new->pid = getpid();
+
+    if (creating) {
+      struct kstate_arena_header *header = new->header;
+      header->max_states = max_states;
+      header->length = length;
+      header->index_size = index_size;
+      header->layout = KSTATE_LAYOUT;
+      __atomic_store_n(&header->magic, KSTATE_ARENA_MAGIC, __ATOMIC_RELEASE);
+    }
+    *arena = new;
+    return 0;
+  }
+}
+
+/*
+ * Start using an arena, mapping it if we haven't already.
+ *
+ * Returns 0 and sets 'arena' if it succeeds, or a negative value
+ * (``-errno``) if it fails.
+ */
+static int open_arena(const char           *caller,
+                      kstate_state_p        state,
+                      struct kstate_arena **arena)
+{
+  int rv = 0;
+  pthread_mutex_lock(&arenas_lock);
+  struct kstate_arena *this;
+  for (this = arenas; this; this = this->next) {
+    // A child of fork() can't use its parent's subscription to the arena
+    if (this->pid == getpid() && !strcmp(this->name, state->arena_name))
+      break;
+  }
+  if (this) {
+    this->refs++;
+  } else {
+    size_t length = state->size ? state->size : KSTATE_DEFAULT_ARENA_STATE_SIZE;
+    rv = map_arena(caller, state->arena_name,
+                   state->permissions & KSTATE_WRITE, state->arena_states,
+                   length, &this);
+    if (rv == 0) {
+      this->next = arenas;
+      arenas = this;
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+  *arena = this;
+  return rv;
+}
+
+/*
+ * Stop using an arena.
+ *
+ * If none of our states are using it any more, we unmap it, and leave its
+ * subscribers - so if we were the last, its shared memory object is unlinked.
+ */
+static void release_arena(const char          *caller,
+                          struct kstate_arena *arena)
+{
+  pthread_mutex_lock(&arenas_lock);
+  if (--arena->refs > 0) {
+    pthread_mutex_unlock(&arenas_lock);
+    return;
+  }
+  struct kstate_arena **prev;
+  for (prev = &arenas; *prev; prev = &(*prev)->next) {
+    if (*prev == arena) {
+      *prev = arena->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+
+  if (arena->pid == getpid())
+    leave_subscribers(caller, &arena->header->subscribers, NULL,
+                      arena->subscriber, arena->name, false);
+  free_arena(arena);
+}
+
+/*
+ * Return the address of entry number 'num' in an arena, given the arena's
+ * header in its writable mapping.
+ */
+static struct kstate_arena_entry *arena_entry(struct kstate_arena_header *hdr,
+                                              uint32_t                    num)
+{
+  return (struct kstate_arena_entry *)
+    ((uint8_t *)hdr + arena_entries_offset(hdr->index_size) +
+     num * arena_entry_size());
+}
+
+/*
+ * Make the slots of the state with the given entry number in an arena
+ * writable in our mapping of it.
+ *
+ * This works a page at a time, so any neighbouring states that share those
+ * pages become writable as well - but only in this process, and only by
+ * mistake, as nothing here writes to a state we haven't subscribed to for
+ * write. They stay writable until we unmap the arena.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int make_arena_state_writable(const char          *caller,
+                                     struct kstate_arena *arena,
+                                     uint32_t             index)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = arena_state_offset(arena, index);
+  size_t end = start + arena_state_size(arena->header->length);
+  start &= ~(page - 1);
+  end = (end + page - 1) & ~(page - 1);
+  if (mprotect((uint8_t *)arena->header + start, end - start,
+               PROT_READ|PROT_WRITE)) {
+    int rv = errno;
+    LOG_ERROR("%s: Error in making state %u in arena %s writable: %d %s\n",
+              caller, index, arena->name, rv, strerror(rv));
+    return -rv;
+  }
+  return 0;
+}
+
+/*
+ * Find the entry for the state with the given name in an arena, adding it if
+ * it isn't there and 'add' is true.
+ *
+ * The index is a hash table, with linear probing. Entries are filled in
+ * before they are added to the index, and never removed, so looking a state
+ * up doesn't need a lock. If two processes add the same state at once, one
+ * of them wins, and the other's entry is never used.
+ *
+ * Returns 0 and sets 'entry' if it succeeds, -ENOENT if the state isn't
+ * there (and 'add' is false), or -ENOSPC if the arena is full.
+ */
+static int find_arena_entry(const char                 *caller,
+                            struct kstate_arena        *arena,
+                            const char                 *name,
+                            bool                        add,
+                            struct kstate_arena_entry **entry)
+{
+  struct kstate_arena_header *header = arena->header;
+  uint32_t *index = (uint32_t *)((uint8_t *)header + arena_index_offset());
+  uint32_t mask = header->index_size - 1;
+  uint32_t start = checksum((const uint8_t *)name, strlen(name)) & mask;
+  struct kstate_arena_entry *ours = NULL;
+  uint32_t our_value = 0;
+  uint32_t probe;
+  for (probe = 0; probe <= mask; probe++) {
+    uint32_t *element = &index[(start + probe) & mask];
+    uint32_t value = __atomic_load_n(element, __ATOMIC_ACQUIRE);
+    if (value == 0) {
+      if (!add)
+        return -ENOENT;
+      if (ours == NULL) {
+        uint32_t num = __atomic_fetch_add(&header->num_states, 1,
+                                          __ATOMIC_SEQ_CST);
+        if (num >= header->max_states) {
+          LOG_ERROR("%s: Cannot add %s to arena %s, as it already has the"
+                    " maximum of %u states\n", caller, name, arena->name,
+                    header->max_states);
+          return -ENOSPC;
+        }
+        ours = arena_entry(header, num);
+        strcpy(ours->name, name);
+        ours->header.length = header->length;
+        ours->header.layout = KSTATE_LAYOUT;
+        ours->header.magic = KSTATE_MAGIC;
+        our_value = num + 1;
+      }
+      uint32_t expected = 0;
+      if (__atomic_compare_exchange_n(element, &expected, our_value, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        *entry = ours;
+        return 0;
+      }
+      // Someone else got this element first, so see what they put there
+      value = expected;
+    }
+    struct kstate_arena_entry *theirs = arena_entry(header, value - 1);
+    if (!strcmp(theirs->name, name)) {
+      *entry = theirs;
+      return 0;
+    }
+  }
+  // We make the index twice as big as the arena, so it can't fill up
+  return -ENOSPC;
+}
+
+/*
+ * Subscribe to a state in an arena, mapping the arena if necessary.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int open_arena_state(const char      *caller,
+                            kstate_state_p   state)
+{
+  if (strlen(state->name) >= KSTATE_ARENA_NAME_LEN) {
+    LOG_ERROR("%s: State name %s is too long for an arena\n",
+              caller, state->name);
+    return -ENAMETOOLONG;
+  }
+
+  struct kstate_arena *arena;
+  int rv = open_arena(caller, state, &arena);
+  if (rv)
+    return rv;
+
+  size_t length = arena->header->length;
+  if (state->size && state->size != length) {
+    LOG_ERROR("%s: Cannot set size for %s to %zu, as states in arena %s"
+              " are %zu\n", caller, state_desc(state), state->size,
+              arena->name, length);
+    release_arena(caller, arena);
+    return -EINVAL;
+  }
+
+  struct kstate_arena_entry *entry;
+  rv = find_arena_entry(caller, arena, state->name,
+                        state->permissions & KSTATE_WRITE, &entry);
+  if (rv) {
+    if (rv == -ENOENT)
+      LOG_ERROR("%s: There is no %s in arena %s\n",
+                caller, state->name, arena->name);
+    release_arena(caller, arena);
+    return rv;
+  }
+
+  uint32_t index = ((uint8_t *)entry - (uint8_t *)arena_entry(arena->header, 0))
+                   / arena_entry_size();
+  if (state->permissions & KSTATE_WRITE) {
+    rv = make_arena_state_writable(caller, arena, index);
+    if (rv) {
+      release_arena(caller, arena);
+      return rv;
+    }
+  }
+
+  struct kstate_shm *new = malloc(sizeof(*new));
+  if (new == NULL) {
+    release_arena(caller, arena);
+    return -ENOMEM;
+  }
+  memset(new, 0, sizeof(*new));
+  new->refs = 1;
+  new->name = state->name;
+  new->fd = -1;
+  new->map_length = length;
+  new->header = &entry->header;
+  new->ro_addr = (uint8_t *)arena->ro_addr +
+                 ((uint8_t *)entry - (uint8_t *)arena->header);
+  // The slots are a long way after the entry, but slot_data only wants to
+  // know where they are relative to it
+  new->first_slot = arena_state_offset(arena, index) -
+                    ((uint8_t *)entry - (uint8_t *)arena->header);
+  new->read_slot = new->first_slot;
+  new->slot_stride = arena_align(length);
+  new->subscribers = &arena->header->subscribers;
+  new->subscriber = arena->subscriber;
+  new->arena_pins = arena->header->pins[arena->subscriber -
+                                        arena->header->subscribers.table];
+  new->arena = arena;
+  new->arena_entry = index;
+  STAT_ADD(new->header, subscribers, 1);
+  state->shm = new;
+  return 0;
+}
+
+/*
+ * Stop using a state's shared memory mappings.
+ *
+ * If no-one else is using them, they are unmapped, and we leave the state's
+ * subscribers - so if we were the last, the shared memory object is unlinked.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int release_shm(const char *caller, struct kstate_shm *shm)
+{
+  int retval = 0;
+
+  if (__atomic_sub_fetch(&shm->refs, 1, __ATOMIC_SEQ_CST) > 0)
+    return 0;
+
+  if (shm->arena) {
+    // We're just using part of the arena's mappings
+    STAT_SUB(shm->header, subscribers, 1);
+    release_arena(caller, shm->arena);
+    free(shm->name);
+    free(shm);
+    return 0;
+  }
+
+  if (shm->flusher)
+    stop_flusher(caller, shm);
+  if (shm->journal)
+    stop_journal(shm);
+  // A child of fork() shares its parent's entry, which isn't its to give up
+  if (shm->subscriber && shm->pid == getpid())
+    leave_subscribers(caller, shm->subscribers, shm->header, shm->subscriber,
+                      shm->name, shm->persistent);
+
+  if (munmap(shm->header, shm->rw_length)) {
+    retval = -errno;
+    LOG_ERROR("%s: Error in freeing shared memory (read/write): %d %s\n",
+              caller, -retval, strerror(-retval));
+  }
+  if (munmap(shm->ro_addr, shm_size(shm->map_length, shm->history,
+                                     shm->replicas))) {
+    retval = -errno;
+    LOG_ERROR("%s: Error in freeing shared memory (read-only): %d %s\n",
+              caller, -retval, strerror(-retval));
+  }
+  close(shm->fd);
+  free(shm->name);
+  free(shm);
+  return retval;
+}
+
+/*
+ * Set the size of a state's data, in bytes.
+ *
+ * This must be done before subscribing to the state. If the subscription
+ * creates the state, it will be this size. Otherwise, the state must already
+ * be this size, or subscribing will fail.
+ *
+ * If this is not called, a new state is one page in size, and subscribing
+ * to an existing state accepts whatever size it is.
+ *
+ * States of KSTATE_HUGE_PAGE_SIZE (2MB) or more are laid out so that they can
+ * be backed by huge pages, and ask the kernel to do so (whether it does
+ * depends on how transparent huge pages are configured for shared memory).
+ * Note that creating a state makes room for several versions of its data.
+ *
+ * A state in an arena (see kstate_set_arena) is laid out differently, and
+ * must be the same size as the other states in its arena.
+ *
+ * Unsubscribing from the state forgets the size.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or the size is 0 or more than KSTATE_MAX_SIZE.
+ */
+extern int kstate_set_size(kstate_state_p  state,
+                           size_t          size)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_size: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_size: Cannot set the size of a"
+              " subscribed state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (size == 0 || size > KSTATE_MAX_SIZE) {
+    LOG_ERROR("kstate_set_size: Size %zu is not in the range 1..%u\n",
+              size, KSTATE_MAX_SIZE);
+    return -EINVAL;
+  }
+  state->size = size;
+  return 0;
+}
+
+/*
+ * Limit how often a state is seen to change.
+ *
+ * - ``state`` is the state, which may or may not be subscribed yet.
+ * - ``max_rate`` is the maximum number of times per second that the state
+ *   should appear to change, or 0 for no limit (the default).
+ *
+ * When a state is rate limited, kstate_get_state_ptr and
+ * kstate_get_state_changes show the version of the state that was current at
+ * the state's last "tick", and only move on to a newer version when the next
+ * tick is due - so it is as if the state were being updated at most that
+ * often. Likewise kstate_wait_for_state_change does not return (successfully)
+ * until the next tick. Transactions are not affected.
+ *
+ * Note that keeping the version from the last tick uses up one of the
+ * state's version slots (see kstate_start_transaction).
+ *
+ * Unsubscribing from the state forgets the rate limit.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if ``state`` is NULL.
+ */
+extern int kstate_set_max_rate(kstate_state_p  state,
+                               uint32_t        max_rate)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_max_rate: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (state->shm) {
+    clear_tick(state);
+  }
+  state->max_rate = max_rate;
+  return 0;
+}
+
+/*
+ * Make a state persistent, backed by a file.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``filename`` is the file that holds the state.
+ *
+ * This must be done before subscribing to the state. When it is subscribed,
+ * the file is mapped instead of a shared memory object - so everyone who
+ * wants to share the state must make it persistent with the same file. If
+ * subscribing for write and the file doesn't exist, it is created (and the
+ * state is set up as for a new state, with whatever size was given to
+ * kstate_set_size). Otherwise the file is mapped as it is, and the state
+ * carries on from the version that was current when it was last used - so
+ * starting up again is just a matter of mapping the file.
+ *
+ * Unsubscribing from a persistent state does not remove the file.
+ *
+ * Committing a transaction does not wait for the state to be written to the
+ * file. Instead, each write subscriber to a persistent state has a thread
+ * that flushes it in the background, by default once a second (see
+ * kstate_set_flush), and kstate_sync can be used to flush it explicitly.
+ * Stopping a process (or losing power) after a commit but before the next
+ * flush may leave the file without that commit. If the machine itself stops
+ * part way through writing back a version, the file may hold a mixture of
+ * that version and the previous one.
+ *
+ * Unsubscribing from the state forgets that it was persistent.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * if ``filename`` is NULL or empty, if the state has already been made
+ * persistent with a different file, or if it is journaled or in an arena.
+ */
+extern int kstate_set_persistent(kstate_state_p  state,
+                                 const char     *filename)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_persistent: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_persistent: Cannot make a subscribed state"
+              " persistent\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (filename == NULL || filename[0] == '\0') {
+    LOG_ERROR("kstate_set_persistent: filename may not be NULL or empty\n");
+    return -EINVAL;
+  }
+  if (state->journal_filename) {
+    LOG_ERROR("kstate_set_persistent: Cannot make a journaled state"
+              " persistent as well\n");
+    return -EINVAL;
+  }
+  if (state->arena_name) {
+    LOG_ERROR("kstate_set_persistent: Cannot make a state in an arena"
+              " persistent\n");
+    return -EINVAL;
+  }
+  if (state->filename) {
+    if (strcmp(state->filename, filename)) {
+      LOG_ERROR("kstate_set_persistent: State is already persistent,"
+                " with file %s\n", state->filename);
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  state->filename = strdup(filename);
+  if (state->filename == NULL)
+    return -ENOMEM;
+  state->flush_interval_ms = KSTATE_DEFAULT_FLUSH_MS;
+  state->flush_commits = 0;
+  return 0;
+}
+
+/*
+ * Say how often a persistent state should be flushed to its file.
+ *
+ * - ``state`` is the state, which must have been made persistent with
+ *   kstate_set_persistent, and not subscribed yet.
+ * - ``interval_ms`` is the longest (in milliseconds) that a commit should
+ *   wait to be flushed, or 0 for no limit.
+ * - ``commits`` is how many commits to allow before flushing, or 0 for no
+ *   limit.
+ *
+ * The state is flushed (in the background) when either limit is reached,
+ * as long as there has been a commit since it was last flushed. If both are
+ * 0, it is only flushed by kstate_sync, and when the subscription ends.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is not persistent or is
+ * already subscribed.
+ */
+extern int kstate_set_flush(kstate_state_p  state,
+                            uint32_t        interval_ms,
+                            uint32_t        commits)
+{
+  if (state == NULL || state->filename == NULL) {
+    LOG_ERROR("kstate_set_flush: Cannot set flushing for a state that"
+              " is not persistent\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_flush: Cannot set flushing for a subscribed"
+              " state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  state->flush_interval_ms = interval_ms;
+  state->flush_commits = commits;
+  return 0;
+}
+
+/*
+ * Flush a persistent state to its file now.
+ *
+ * - ``state`` is the state, which must be subscribed.
+ *
+ * When this returns, the version of the state that was current when it was
+ * called has been written to the file. For a journaled state (see
+ * kstate_set_journal) this instead waits for the journal to catch up. For a
+ * state that is neither, there is nothing to do.
+ *
+ * Returns 0 if it succeeds, -EINVAL if the state is not subscribed, or
+ * another negative value (``-errno``) if writing to the file fails.
+ */
+extern int kstate_sync(kstate_state_p  state)
+{
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_sync: Cannot flush an unsubscribed state\n");
+    return -EINVAL;
+  }
+  if (state->shm->journal)
+    return sync_journal(state->shm);
+  if (state->filename == NULL)
+    return 0;
+  return sync_shm("kstate_sync", state->shm);
+}
+
+/*
+ * Journal a state to a file.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``filename`` is the journal file. A checkpoint is also kept, in the same
+ *   place with ".checkpoint" appended to the name.
+ * - ``checkpoint_records`` is how many records to write to the journal
+ *   before writing a new checkpoint and starting the journal afresh, or 0
+ *   for the default (1000).
+ *
+ * This must be done before subscribing to the state. The subscription then
+ * has a thread which, each time the state changes, appends to the journal
+ * the parts of the state that are different from the last version it wrote,
+ * and flushes it. Committing doesn't wait for that, and if several commits
+ * happen whilst the thread is writing, the next record covers all of them.
+ * Use kstate_sync to wait for the journal to catch up.
+ *
+ * If the subscription creates the state, its data is first restored from
+ * the checkpoint and journal. In any case, journaling starts with a
+ * checkpoint of the current version. The state itself is an ordinary shared
+ * memory object, so this is an alternative to kstate_set_persistent, which
+ * suits states updated often in small pieces. kstate_read_journal can
+ * reconstruct the state as it was at any time since the last checkpoint.
+ *
+ * Only one subscriber (in any process) may journal a state to a given file
+ * at a time - subscribing fails with -EBUSY for any others. Its journal
+ * includes commits made by everyone.
+ *
+ * Unsubscribing from the state forgets the journal (after it has caught
+ * up).
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * ``filename`` is NULL or empty, or the state has been made persistent or
+ * put in an arena.
+ */
+extern int kstate_set_journal(kstate_state_p  state,
+                              const char     *filename,
+                              uint32_t        checkpoint_records)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_journal: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_journal: Cannot journal a subscribed state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (filename == NULL || filename[0] == '\0') {
+    LOG_ERROR("kstate_set_journal: filename may not be NULL or empty\n");
+    return -EINVAL;
+  }
+  if (state->filename) {
+    LOG_ERROR("kstate_set_journal: Cannot journal a persistent state\n");
+    return -EINVAL;
+  }
+  if (state->arena_name) {
+    LOG_ERROR("kstate_set_journal: Cannot journal a state in an arena\n");
+    return -EINVAL;
+  }
+
+  char *name = strdup(filename);
+  if (name == NULL)
+    return -ENOMEM;
+  free(state->journal_filename);
+  state->journal_filename = name;
+  state->checkpoint_records = checkpoint_records
+                              ? checkpoint_records
+                              : KSTATE_DEFAULT_CHECKPOINT_RECORDS;
+  return 0;
+}
+
+/*
+ * Reconstruct a journaled state as it was at a particular time.
+ *
+ * - ``filename`` is the journal file, as given to kstate_set_journal.
+ * - ``until_ns`` is the time, as nanoseconds since the epoch (so
+ *   CLOCK_REALTIME). Use UINT64_MAX for the latest version journaled.
+ * - ``data`` is where to put the state's data, and ``size`` is its size,
+ *   which must be the size of the state.
+ *
+ * This gives the last version journaled at or before ``until_ns``. The state
+ * need not be subscribed, and the journal may still be being written.
+ *
+ * Returns 0 if it succeeds, -EINVAL if ``size`` is not the size of the state
+ * that was journaled, -ERANGE if the last checkpoint is later than
+ * ``until_ns``, or another negative value (``-errno``) if it fails.
+ */
+extern int kstate_read_journal(const char *filename,
+                               uint64_t    until_ns,
+                               void       *data,
+                               size_t      size)
+{
+  if (filename == NULL || data == NULL || size == 0) {
+    LOG_ERROR("kstate_read_journal: filename, data and size must be given\n");
+    return -EINVAL;
+  }
+  uint64_t seq, time_ns;
+  return load_journal("kstate_read_journal", filename, until_ns, data, size,
+                      &seq, &time_ns);
+}
+
+/*
+ * Say how a state's shared memory should be mapped.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``mapping`` is constructed by OR'ing the flags KSTATE_MAP_POPULATE and
+ *   KSTATE_MAP_LOCKED, or is 0 for the default.
+ *
+ * By default, a state's shared memory is faulted in a page at a time, as it
+ * is first used, and the kernel may page it out again. That makes the first
+ * access to each page, after subscribing, slower than the rest - which
+ * matters to anyone who needs each access to take much the same time.
+ *
+ * With KSTATE_MAP_POPULATE, subscribing to the state faults in all of its
+ * shared memory (all of its versions, and its history if it has one), so
+ * subscribing takes longer, but nothing using it afterwards has to wait for
+ * a page to be found.
+ *
+ * KSTATE_MAP_LOCKED also locks it into memory (and implies
+ * KSTATE_MAP_POPULATE), so that it stays there. How much memory a process
+ * may lock is limited (see RLIMIT_MEMLOCK), and subscribing fails if the
+ * state won't fit. KSTATE_LAZY is ignored for transactions on a state with
+ * locked mappings, as a lazy transaction takes a page fault for each page
+ * it writes to. Other transactions use the state's version slots, which are
+ * already faulted in, and don't map anything.
+ *
+ * A state in an arena cannot be given mapping flags.
+ *
+ * Unsubscribing from the state forgets its mapping flags.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena, or ``mapping`` has flags other than those.
+ */
+extern int kstate_set_mapping(kstate_state_p  state,
+                              uint32_t        mapping)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_mapping: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_mapping: Cannot change how a subscribed state"
+              " is mapped\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (state->arena_name) {
+    LOG_ERROR("kstate_set_mapping: A state in an arena cannot have"
+              " mapping flags\n");
+    return -EINVAL;
+  }
+  if (mapping & ~(KSTATE_MAP_POPULATE | KSTATE_MAP_LOCKED)) {
+    LOG_ERROR("kstate_set_mapping: Unexpected mapping flags 0x%x\n", mapping);
+    return -EINVAL;
+  }
+  state->mapping = mapping;
+  return 0;
+}
+
+/*
+ * Give a state a replica of its data on each NUMA node.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``replicas`` says whether the state should have replicas.
+ *
+ * On a host with several NUMA nodes, a reader on a different node from the
+ * memory holding the state pays for the distance on every access, and the
+ * writer's cache lines bounce between the nodes. A state with replicas has a
+ * copy of its version slots for each node, placed on that node (with
+ * mbind), and each commit copies the version it is making current into
+ * every replica before anyone can see it. Subscribing picks the replica on
+ * the node the subscribing thread is running on, and the state's pointers
+ * and read transactions then look at that - so readers only ever read
+ * memory local to them (as long as they stay on that node), at the cost of
+ * one copy of the state data per node for each commit, and a set of slots'
+ * worth of memory per node.
+ *
+ * Whoever creates the state decides whether it has replicas, and how many
+ * nodes it has them for (all those the host may have). Subscribing to an
+ * existing state after asking for replicas fails if it has none, and
+ * subscribing without calling this accepts whatever the state has. A host
+ * with a single node still gets one replica, which works just the same, but
+ * gains nothing.
+ *
+ * A state in an arena cannot have replicas.
+ *
+ * Unsubscribing from the state forgets that replicas were asked for.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena.
+ */
+extern int kstate_set_replicas(kstate_state_p  state,
+                               bool            replicas)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_replicas: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_replicas: Cannot change the replicas of a"
+              " subscribed state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (state->arena_name) {
+    LOG_ERROR("kstate_set_replicas: A state in an arena cannot have"
+              " replicas\n");
+    return -EINVAL;
+  }
+  state->replicas = replicas;
+  return 0;
+}
+
+/*
+ * Keep a history of a state's recent versions.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``entries`` is how many of the most recently committed versions the
+ *   history should hold, or 0 for no history (the default). It may be at
+ *   most KSTATE_MAX_HISTORY.
+ *
+ * Each commit to a state with a history also copies the version it makes
+ * current into the history, tagged with the state's change count after the
+ * commit (as kstate_get_state_changes would return). So a reader that needs
+ * to see every change, and not just the latest, can use kstate_read_history
+ * to read each version in turn, as long as it doesn't fall more than
+ * ``entries`` commits behind.
+ *
+ * The history is kept in the state's shared memory object, after its
+ * version slots, so each entry costs about as much memory as the state data
+ * itself. Subscribing to an existing state after giving a different number
+ * of entries fails, and subscribing without calling this accepts whatever
+ * history the state already has.
+ *
+ * A state in an arena cannot have a history.
+ *
+ * Unsubscribing from the state forgets the history length.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena, or ``entries`` is more than KSTATE_MAX_HISTORY.
+ */
+extern int kstate_set_history(kstate_state_p  state,
+                              uint32_t        entries)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_history: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_history: Cannot set the history of a"
+              " subscribed state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (state->arena_name) {
+    LOG_ERROR("kstate_set_history: A state in an arena cannot have"
+              " a history\n");
+    return -EINVAL;
+  }
+  if (entries > KSTATE_MAX_HISTORY) {
+    LOG_ERROR("kstate_set_history: A history cannot have more than %u"
+              " entries, not %u\n", KSTATE_MAX_HISTORY, entries);
+    return -EINVAL;
+  }
+  state->history = entries;
+  return 0;
+}
+
+/*
+ * Read the next version of a state from its history.
+ *
+ * - ``state`` is the state, which must be subscribed, and have a history
+ *   (see kstate_set_history).
+ * - ``changes`` is the change count of the last version the caller has
+ *   seen. Start with the value of kstate_get_state_changes to see every
+ *   change from then on. If we succeed, it is incremented.
+ * - ``data`` and ``size`` are where to put the version, which must have room
+ *   for the whole of the state data (kstate_get_state_size).
+ *
+ * This copies the version committed after the one ``changes`` says the
+ * caller last saw - the version with change count ``changes + 1``. Calling
+ * it repeatedly walks through every committed version in turn. Commits that
+ * didn't alter the state (and so didn't change its change count) don't
+ * appear in the history. Rate limiting (kstate_set_max_rate) doesn't affect
+ * the history.
+ *
+ * Returns 0 if it succeeds, -EAGAIN if there is no newer version yet (so
+ * wait with kstate_wait_for_state_change, and try again), or -EINVAL if the
+ * state has no history or ``data`` is too small. If the version has already
+ * been overwritten, because the caller fell more than the history's length
+ * behind, it returns -EOVERFLOW, and sets ``changes`` so that calling it again
+ * carries on from the oldest version the history still holds.
+ */
+extern int kstate_read_history(kstate_state_p  state,
+                               uint32_t       *changes,
+                               void           *data,
+                               size_t          size)
+{
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_read_history: state is not subscribed\n");
+    return -EINVAL;
+  }
+  struct kstate_shm *shm = state->shm;
+  if (shm->history == 0) {
+    LOG_ERROR("kstate_read_history: %s has no history\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (changes == NULL || data == NULL || size < shm->map_length) {
+    LOG_ERROR("kstate_read_history: changes, and data of at least %zu"
+              " bytes, must be given\n", shm->map_length);
+    return -EINVAL;
+  }
+
+  for (;;) {
+    uint32_t wanted = *changes + 1;
+    // A version is in the history before it is current, so anything up to
+    // the current generation is there (unless it has been overwritten)
+    uint64_t current = get_current(shm->header);
+    uint32_t latest = (uint32_t)(current >> KSTATE_SLOT_BITS);
+    uint32_t newer = latest - wanted;
+    if ((int32_t)newer < 0)
+      return -EAGAIN;
+    if (newer >= shm->history) {
+      *changes = latest - shm->history;
+      return -EOVERFLOW;
+    }
+
+    // The change count is just the bottom of the generation, so work out
+    // which generation we want from the current one. The entry may be
+    // overwritten whilst we copy it, in which case we're now too far behind,
+    // and will find out when we go round again
+    uint64_t want = (current >> KSTATE_SLOT_BITS) - newer;
+    struct kstate_history_entry *entry = history_entry(shm, shm->ro_addr,
+                                                       want);
+    uint64_t generation = __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE);
+    memcpy(data, entry + 1, shm->map_length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (generation == want &&
+        __atomic_load_n(&entry->generation, __ATOMIC_RELAXED) == generation) {
+      *changes = wanted;
+      return 0;
+    }
+  }
+}
+
+/*
+ * Put a state in an arena, instead of giving it a shared memory object of
+ * its own.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``arena`` is the name of the arena, which follows the same rules as a
+ *   state name.
+ * - ``max_states`` is how many states the arena should have room for, if
+ *   subscribing creates it, or 0 for the default of 1024. It may be at most
+ *   1048576.
+ *
+ * An arena holds many small states in one shared memory object, which each
+ * process maps once, however many of its states it subscribes to. So
+ * subscribing to a state in an arena that is already mapped is just a
+ * matter of looking its name up in the arena's index. Transactions on the
+ * state work just as for any other state. Each process maps the states'
+ * data read-only, apart from the pages holding the states it has subscribed
+ * to for write.
+ *
+ * Each state in an arena has the same size. That is taken from the state
+ * that creates the arena (see kstate_set_size), or is 64 bytes by default.
+ * Subscribing to a state in an existing arena after giving a different size
+ * fails. The name of a state in an arena may be at most 55 characters long.
+ *
+ * The first write subscription to a state adds it to the arena, creating the
+ * arena if necessary. States are never removed from an arena, so once it is
+ * full (which gives -ENOSPC), no more states can be added to it. The arena
+ * itself is removed when the last process using it has unsubscribed from
+ * all its states.
+ *
+ * A state in an arena cannot be made persistent or journaled, keep a
+ * history, or be given mapping flags (see kstate_set_mapping). KSTATE_LAZY
+ * is ignored for transactions on states in an arena. If a process dies
+ * whilst using states in an arena, the versions it had pinned are released
+ * by the next process that runs out of free slots for one of them, just as
+ * for any other state - as long as it had no more than 32 different versions
+ * (of all the arena's states) pinned at once.
+ *
+ * Unsubscribing from the state forgets the arena.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * ``arena`` is not a valid name, ``max_states`` is too large, or the state
+ * has been made persistent or journaled or given a history or mapping flags.
+ */
+extern int kstate_set_arena(kstate_state_p  state,
+                            const char     *arena,
+                            uint32_t        max_states)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_set_arena: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_set_arena: Cannot put a subscribed state in an arena\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (arena == NULL) {
+    LOG_ERROR("kstate_set_arena: arena may not be NULL\n");
+    return -EINVAL;
+  }
+  if (max_states > KSTATE_MAX_ARENA_STATES) {
+    LOG_ERROR("kstate_set_arena: An arena cannot have more than %d states,"
+              " not %u\n", KSTATE_MAX_ARENA_STATES, max_states);
+    return -EINVAL;
+  }
+  if (state->filename || state->journal_filename || state->history ||
+      state->mapping || state->replicas) {
+    LOG_ERROR("kstate_set_arena: Cannot put a persistent or journaled state,"
+              " or one with a history, its own mapping flags or NUMA"
+              " replicas, in an arena\n");
+    return -EINVAL;
+  }
+  size_t name_len = check_state_name("kstate_set_arena", arena);
+  if (name_len == 0)
+    return -EINVAL;
+
+  // State names can't contain a '-', so this can't be the name of a state's
+  // own shared memory object
+  char *name = malloc(1 + 12 + 1 + name_len + 1);
+  if (name == NULL)
+    return -ENOMEM;
+  sprintf(name, "/kstate-arena.%s", arena);
+  free(state->arena_name);
+  state->arena_name = name;
+  state->arena_states = max_states ? max_states : KSTATE_DEFAULT_ARENA_STATES;
+  return 0;
+}
+
+/*
+ * Open a state's shared memory object - or its file, if it's persistent.
+ */
+static int open_object(kstate_state_p  state,
+                       int             flags,
+                       mode_t          mode)
+{
+  if (state->filename)
+    return open(state->filename, flags, mode);
+  else
+    return shm_open(state->name, flags, mode);
+}
+
+/*
+ * Remove a state's shared memory object (or file) that we have just created.
+ */
+static void unlink_object(kstate_state_p  state)
+{
+  if (state->filename)
+    unlink(state->filename);
+  else
+    shm_unlink(state->name);
+}
+
+/*
+ * Open (or create) and map a state's shared memory object, for subscribing.
+ *
+ * Sets 'created' to say whether we created it, in which case its header is
+ * all zeroes. If we succeed, the state's name belongs to its mappings.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int open_shm(const char      *caller,
+                    kstate_state_p   state,
+                    bool            *created)
+{
+  // We always open the shared memory object for read and write, as even
+  // a read-only subscriber needs to be able to update the header (to pin the
+  // versions of the state it is reading).
+  //
+  // A writer creates the object if it doesn't exist yet - in which case it
+  // gets to decide how big it is.
+  kstate_permissions_t permissions = state->permissions;
+  int shm_fd;
+  bool creating = false;
+  // XXX Allow everyone any access, at least for the moment
+  // XXX It is possible that we will want another version of this function
+  // XXX which allows specifying the mode (the "normal" version of the
+  // XXX function should always be the one that defaults to a "sensible"
+  // XXX mode, whatever we decide that to be).
+  mode_t shm_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+  if (state->filename)  // but a file has no reason to be executable
+    shm_mode &= ~(S_IXUSR | S_IXGRP | S_IXOTH);
+  for (;;) {
+    if (permissions & KSTATE_WRITE) {
+      shm_fd = open_object(state, O_RDWR | O_CREAT | O_EXCL, shm_mode);
+      if (shm_fd >= 0) {
+        creating = true;
+        break;
+      } else if (errno != EEXIST) {
+        break;
+      }
+    }
+    shm_fd = open_object(state, O_RDWR, 0);
+    // If someone unlinked it between our two attempts, try again
+    if (shm_fd >= 0 || errno != ENOENT || !(permissions & KSTATE_WRITE))
+      break;
+  }
+  if (shm_fd < 0) {
+    int rv = errno;
+    LOG_ERROR("%s:"
+              " Error in %s(\"%s\", 0x%x, 0x%x): %d %s\n",
+              caller, state->filename ? "open" : "shm_open",
+              state->filename ? state->filename : state->name,
+              O_RDWR | (creating ? O_CREAT : 0), shm_mode,
+              rv, strerror(rv));
+    return -rv;
+  }
+
+  size_t map_length;
+  uint32_t history;
+  uint32_t replicas;
+  if (creating) {
+    // We need to set a size, or it will be zero sized: one page (or huge
+    // page) of header, followed by a slot for each version, then a replica
+    // of the slots for each NUMA node (if wanted), and then the history (if
+    // any).
+    map_length = state->size ? state->size : (size_t) sysconf(_SC_PAGESIZE);
+    history = state->history;
+    replicas = state->replicas ? count_numa_nodes() : 0;
+    int rv = ftruncate(shm_fd, shm_size(map_length, history, replicas));
+    if (rv) {
+      int rv = errno;
+      LOG_ERROR("%s: Error in setting shared memory size"
+                " for %s to 0x%zx: %d %s\n", caller, state_desc(state),
+                shm_size(map_length, history, replicas), rv, strerror(rv));
+      // We created it, and no-one else can use it like this
+      unlink_object(state);
+      close(shm_fd);
+      return -rv;
+    }
+  } else {
+    // Someone else decided how big it is
+    int rv = read_shm_length(caller, shm_fd, &map_length, &history,
+                             &replicas);
+    if (rv == 0 && state->size && state->size != map_length) {
+      LOG_ERROR("%s: Cannot set size for existing %s"
+                " to %zu, as it is already %zu\n", caller, state_desc(state),
+                state->size, map_length);
+      rv = -EINVAL;
+    }
+    if (rv == 0 && state->history && state->history != history) {
+      LOG_ERROR("%s: Cannot set history for existing %s"
+                " to %u, as it is already %u\n", caller, state_desc(state),
+                state->history, history);
+      rv = -EINVAL;
+    }
+    if (rv == 0 && state->replicas && replicas == 0) {
+      LOG_ERROR("%s: Cannot ask for NUMA replicas of existing %s,"
+                " as it was created without them\n", caller,
+                state_desc(state));
+      rv = -EINVAL;
+    }
+    if (rv) {
+      close(shm_fd);
+      // NB: this isn't ours, so we're not doing shm_unlink...
+      return rv;
+    }
+  }
+
+  // Map the whole available area, starting at the start of the "file".
+  int rv = map_shm(caller, state->name, shm_fd, map_length, history,
+                   replicas, state->mapping, permissions & KSTATE_WRITE,
+                   &state->shm);
+  if (rv) {
+    LOG_ERROR("%s: Error in mapping shared memory"
+              " for %s\n", caller, state_desc(state));
+    if (creating)
+      unlink_object(state);
+    close(shm_fd);
+    return rv;
+  }
+  state->shm->persistent = (state->filename != NULL);
+  *created = creating;
+  return 0;
+}
+
+/*
+ * Subscribe to a state.
+ *
+ * - ``name`` is the name of the state to subscribe to.
+ * - ``permissions`` is constructed by OR'ing the permission flags
+ *   KSTATE_READ and/or KSTATE_WRITE. At least one of those must be given.
+ *   KSTATE_WRITE by itself is regarded as equivalent to KSTATE_WRITE|KSTATE_READ.
+ * - ``state`` is the actual state identifier, as amended by this function.
+ *
+ * A state name may contain A-Z, a-z, 0-9 and the dot (.) character. It may not
+ * start or end with a dot, and may not contain adjacent dots. It must contain
+ * at least one character. Note that the name will be copied into 'state'.
+ *
+ * If this is the first subscription to the named state, then the shared
+ * data for the state will be created.
+ *
+ * Note that the first subscription to a state cannot be read-only, as there is
+ * nothing to read -i.e., the first subscription to a state must be for
+ * KSTATE_WRITE|KSTATE_READ.
+ *
+ * A state can have at most 64 subscriptions at once, counting those in all
+ * processes, after which subscribing fails with -EUSERS. Subscribing also
+ * tidies up after any subscribers whose processes have died without
+ * unsubscribing, releasing the versions of the state they were using. A
+ * child of fork() should subscribe for itself, as using its parent's
+ * subscription counts as its parent using it.
+ *
+ * Returns 0 if the subscription succeeds, or a negative value if it fails.
+ * The negative value will be ``-errno``, giving an indication of why the
+ * function failed.
+ */
+extern int kstate_subscribe_state(kstate_state_p         state,
+                                  const char            *name,
+                                  kstate_permissions_t   permissions)
+{
+  if (state == NULL) {
+    LOG_ERROR("kstate_subscribe_state: state argument may not be NULL\n");
+    return -EINVAL;
+  }
+
+  if (kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_subscribe_state: state is still subscribeed\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+
+  if (LOGGING(KSTATE_LOG_DEBUG)) {
+    char desc[KSTATE_DESC_LEN];
+    describe_state(desc, state->id, name, permissions);
+    LOG_DEBUG("Subscribing to %s\n", desc);
+  }
+
+  if (state_permissions_are_bad(permissions)) {
+    return -EINVAL;
+  }
+
+  int rv = new_state_name("kstate_subscribe_state", name, &state->name);
+  if (rv) {
+    return rv;
+  }
+
+  // If we had a legitimate permissions set that doesn't include READ,
+  // add READ back in
+  if (!(permissions & KSTATE_READ)) {
+    permissions |= KSTATE_READ;
+  }
+
+  state->permissions = permissions;
+
+  // A state in an arena just needs finding (or adding) in the arena,
+  // which can't be persistent or journaled
+  if (state->arena_name) {
+    rv = open_arena_state("kstate_subscribe_state", state);
+    if (rv) {
+      free(state->name);
+      state->name = NULL;
+      state->permissions = 0;
+    } else {
+      PROBE3(subscribe, state->id, name, permissions);
+    }
+    return rv;
+  }
+
+  // If the last subscriber leaves whilst we're opening the object, it will
+  // be unlinked, and we need to open (or create) it all over again
+  bool creating = false;
+  for (;;) {
+    rv = open_shm("kstate_subscribe_state", state, &creating);
+    if (rv) {
+      free(state->name);
+      state->name = NULL;
+      state->permissions = 0;
+      return rv;
+    }
+    struct kstate_shm *shm = state->shm;
+    rv = join_subscribers("kstate_subscribe_state", shm->subscribers,
+                          shm->header, creating, &shm->subscriber);
+    if (rv == 0) {
+      shm->pid = getpid();
+      shm->pins = shm->subscriber->pins;
+    }
+    if (rv != -EAGAIN)
+      break;
+    // Keep our name, which would otherwise go with the mappings
+    state->shm->name = NULL;
+    release_shm("kstate_subscribe_state", state->shm);
+    state->shm = NULL;
+  }
+  if (rv) {
+    if (creating)
+      unlink_object(state);
+    // Our name belongs to our shared memory mappings
+    release_shm("kstate_subscribe_state", state->shm);
+    state->shm = NULL;
+    state->name = NULL;
+    state->permissions = 0;
+    return rv;
+  }
+
+  // If we're journaling the state, and have just created it, then we must
+  // restore it from the journal before anyone else can see it
+  if (state->journal_filename) {
+    rv = start_journal("kstate_subscribe_state", state->shm,
+                       state->journal_filename, state->checkpoint_records,
+                       creating);
+    if (rv) {
+      if (creating)
+        unlink_object(state);
+      // Our name belongs to our shared memory mappings
+      release_shm("kstate_subscribe_state", state->shm);
+      state->shm = NULL;
+      state->name = NULL;
+      state->permissions = 0;
+      return rv;
+    }
+  }
+
+  // If we've just created the shared memory object, then its header will be
+  // all zeroes, which we regard as a valid (but anonymous) initial header.
+  // Fill it in, and then mark it as ours, at which point anyone else
+  // waiting to subscribe to it can carry on.
+  if (creating) {
+    struct kstate_header *header = state->shm->header;
+    header->length = state->shm->map_length;
+    header->history = state->shm->history;
+    header->replicas = state->shm->replicas;
+    header->layout = KSTATE_LAYOUT;
+    __atomic_store_n(&header->magic, KSTATE_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  // Only writers can have anything to flush
+  if (state->filename && (permissions & KSTATE_WRITE) &&
+      (state->flush_interval_ms || state->flush_commits)) {
+    rv = start_flusher("kstate_subscribe_state", state->shm,
+                       state->flush_interval_ms, state->flush_commits);
+    if (rv) {
+      // Our name belongs to our shared memory mappings
+      release_shm("kstate_subscribe_state", state->shm);
+      state->shm = NULL;
+      state->name = NULL;
+      state->permissions = 0;
+      return rv;
+    }
+  }
+
+  PROBE3(subscribe, state->id, name, permissions);
+  return 0;
+}
+
+static void stop_replication(kstate_state_p state);
+
+/*
+ * Unsubscribe from a state.
+ *
+ * - ``state`` is the state from which to unsubscribe.
+ *
+ * After this, the content of the state datastructure will have been
+ * unset/freed. Unsubscribing from this same state value again will have no
+ * effect.
+ *
+ * Note that transactions using the state keep their own copy of the state
+ * information, and are not affected by this function - i.e., the state can
+ * still be accessed via any transactions that are still open on it.
+ *
+ * When the last subscriber to a state has unsubscribed (and any transactions
+ * on it have finished), the state's shared data is removed - unless it is
+ * persistent, in which case its file is left for next time.
+ *
+ * Returns 0 if the unsubscription succeeds, or a negative value if it fails.
+ * The negative value will be ``-errno``, giving an indication of why the
+ * function failed.
+ */
+extern void kstate_unsubscribe_state(kstate_state_p  state)
+{
+  if (state == NULL)      // What did they expect us to do?
+    return;
+
+  LOG_DEBUG("Unsubscribing from %s\n", state_desc(state));
+
+  if (state->replication)
+    stop_replication(state);
+
+  if (state->shm) {
+    PROBE2(unsubscribe, state->id, state->name + KSTATE_NAME_PREFIX_LEN);
+    clear_tick(state);
+    // Any transactions still using the shared memory will keep it mapped
+    // (and keep us subscribed to it, as far as anyone else is concerned)
+    release_shm("kstate_unsubscribe_state", state->shm);
+    state->shm = NULL;
+  }
+
+  // Our name belongs to our shared memory mappings
+  state->name = NULL;
+
+  free(state->filename);
+  state->filename = NULL;
+  state->flush_interval_ms = 0;
+  state->flush_commits = 0;
+
+  free(state->journal_filename);
+  state->journal_filename = NULL;
+  state->checkpoint_records = 0;
+
+  free(state->arena_name);
+  state->arena_name = NULL;
+  state->arena_states = 0;
+
+  state->permissions = 0;
+  state->size = 0;
+  state->history = 0;
+  state->mapping = 0;
+  state->replicas = false;
+  state->max_rate = 0;
+}
+
+/*
+ * Each thread keeps a few freed transactions to hand, so that a thread that
+ * frees and creates transactions over and over again doesn't keep going to
+ * malloc (and contending with the other threads in it). Nothing is shared,
+ * so no locking is needed.
+ */
+#define KSTATE_CACHED_TRANSACTIONS 4
+static __thread struct {
+  uint32_t count;
+  struct kstate_transaction *free[KSTATE_CACHED_TRANSACTIONS];
+} cached_transactions;
+
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  cache_key;
+
+/*
+ * Free a thread's cached transactions when the thread exits.
+ */
+static void free_cached_transactions(void *cache)
+{
+  (void) cache;         // It's our own thread's cache
+  while (cached_transactions.count)
+    free(cached_transactions.free[--cached_transactions.count]);
+}
+
+static void make_cache_key(void)
+{
+  (void) pthread_key_create(&cache_key, free_cached_transactions);
+}
+
+/*
+ * Set up an "empty" transaction, with a new id.
+ */
+static void init_transaction(struct kstate_transaction *transaction)
+{
+  static uint32_t next_transaction_id = 1;    // because 0 is reserved
+
+  memset(transaction, 0, sizeof(*transaction));
+  do {
+    transaction->id = __atomic_fetch_add(&next_transaction_id, 1,
+                                         __ATOMIC_RELAXED);
+  } while (transaction->id == 0);
+}
+
+/*
+ * Create a new "empty" transaction.
+ *
+ * The normal usage is to create an empty transaction and then immediately
+ * populate it::
+ *
+ *     struct kstate_transaction *transaction = kstate_new_transaction();
+ *     int ret = kstate_start_transaction(&transaction, state, KSTATE_WRITE);
+ *
+ * and then eventually to destroy it::
+ *
+ *     int ret = kstate_unsubscribe_state(transaction);
+ *     if (ret) {
+ *       // deal with the error
+ *     }
+ *     kstate_free_transaction(&transaction);
+ *
+ * A transaction that has been committed or aborted may be started again,
+ * as many times as is wanted, before it is freed. Neither starting nor
+ * ending a transaction allocates (or maps) any memory, so a loop that
+ * repeatedly starts, alters and commits the same transaction does no
+ * allocations at all.
+ *
+ * Returns the new transaction, or NULL if there was insufficient memory.
+ */
+extern struct kstate_transaction *kstate_new_transaction(void)
+{
+  struct kstate_transaction *new = NULL;
+  if (cached_transactions.count)
+    new = cached_transactions.free[--cached_transactions.count];
+  else
+    new = malloc(sizeof(struct kstate_transaction));
+  if (new == NULL)
+    return NULL;
+  init_transaction(new);
+  return new;
+}
+
+/*
+ * Destroy a transaction created with 'kstate_new_transaction'.
+ *
+ * If the transaction is still in progress, it will be aborted.
+ *
+ * If a NULL pointer is given, then it is ignored, otherwise the transaction is
+ * freed and the pointer is set to NULL.
+ */
+extern void kstate_free_transaction(kstate_transaction_p *transaction)
+{
+  if (transaction && *transaction) {
+    if (kstate_transaction_is_active(*transaction)) {
+      kstate_abort_transaction(*transaction);
+    }
+    struct kstate_transaction *t = (struct kstate_transaction *)(*transaction);
+    if (cached_transactions.count < KSTATE_CACHED_TRANSACTIONS) {
+      if (cached_transactions.count == 0)
+        (void) pthread_once(&cache_key_once, make_cache_key);
+      // Setting the key just tells the destructor there's something to do
+      (void) pthread_setspecific(cache_key, &cached_transactions);
+      cached_transactions.free[cached_transactions.count++] = t;
+    } else {
+      free(t);
+    }
+    *transaction = NULL;
+  }
+}
+
+/*
+ * Stop using one of a transaction's states.
+ */
+static int clear_part(const char           *caller,
+                      kstate_transaction_p  transaction,
+                      struct kstate_part   *part)
+{
+  int rv = 0;
+
+  if (part->map_addr && part->lazy) {
+    // Our private copy-on-write mapping of the original version
+    rv = munmap(part->map_addr, part->shm->map_length);
+    if (rv) {
+      rv = -errno;
+      LOG_ERROR("%s: Error unmapping transaction: %d %s\n",
+                caller, -rv, strerror(-rv));
+    }
+  }
+  part->map_addr = 0;
+  part->lazy = false;
+
+  if (part->shm) {
+    struct kstate_header *header = part->shm->header;
+    if (!(transaction->permissions & KSTATE_WRITE))
+      STAT_SUB(header, readers, 1);
+    if (part->slot >= 0) {
+      release_slot(part->shm, part->slot);
+    }
+    if (part->pinned) {
+      release_slot(part->shm, current_slot(part->current));
+    }
+    int ret = release_shm(caller, part->shm);
+    if (ret && !rv) rv = ret;
+    part->shm = NULL;
+  }
+  part->slot = -1;
+  part->pinned = false;
+  part->current = 0;
+  return rv;
+}
+
+static int clear_transaction(char *caller, kstate_transaction_p  transaction)
+{
+  int rv = 0;
+
+  uint32_t ii;
+  for (ii = 0; ii < transaction->num_parts; ii++) {
+    int ret = clear_part(caller, transaction, &transaction->parts[ii]);
+    if (ret && !rv) rv = ret;
+  }
+  transaction->num_parts = 0;
+  transaction->num_dirty = 0;
+
+  // Our name belonged to the shared memory mappings
+  transaction->name = NULL;
+
+  transaction->permissions = 0;
+  return rv;
+}
+
+/*
+ * Start using a state in a transaction, which already has its permissions.
+ *
+ * If this fails, 'part' will still need clearing.
+ *
+ * Returns 0 if it succeeds, or a negative value (``-errno``) if it fails.
+ */
+static int start_part(const char           *caller,
+                      kstate_transaction_p  transaction,
+                      struct kstate_part   *part,
+                      kstate_state_p        state)
+{
+  // We use the state's mappings of its shared memory (and its name), and
+  // keep them in use until we're finished, even if the state is unsubscribed
+  // in the meantime. So starting a transaction doesn't need to allocate
+  // anything.
+  struct kstate_shm *shm = state->shm;
+  __atomic_add_fetch(&shm->refs, 1, __ATOMIC_SEQ_CST);
+  part->shm = shm;
+  part->slot = -1;
+  part->lazy = false;
+  part->copied = false;
+  if (!(transaction->permissions & KSTATE_WRITE))
+    STAT_ADD(shm->header, readers, 1);
+
+  // Pin the current version of the state, so that it can't change (or be
+  // reused) whilst we're looking at it. Remember which version it was - if we
+  // are a write transaction, that's how we shall tell if someone else has
+  // committed when we come to commit. If someone is part way through
+  // committing to it, we remember the version before that commit, since it
+  // might yet fail.
+  part->current = pin_current(shm) & ~(uint64_t)KSTATE_LOCKED;
+  part->pinned = true;
+
+  if (transaction->permissions & KSTATE_WRITE) {
+    // We need our own version of the data, which is independent of that
+    // for the state - both in case the state changes during our transaction,
+    // and also because we might write to our own copy. That's a free slot,
+    // which will become the current version if we commit.
+    part->slot = claim_slot(shm);
+    if (part->slot < 0) {
+      STAT_ADD(shm->header, busy, 1);
+      LOG_DEBUG("%s: No free version slots for Transaction on %s - all %d"
+                " are in use\n", caller, state_desc(state), KSTATE_NUM_SLOTS);
+      return -EAGAIN;
+    }
+    if ((transaction->permissions & KSTATE_LAZY) && !shm->arena &&
+        !shm->locked) {
+      // Rather than copying the original version into our slot now, map it
+      // privately, so that the kernel only copies the pages we actually
+      // write to. It's pinned, so it won't change underneath us. We
+      // copy the result into our slot when we commit. (A state in an arena
+      // doesn't have its slots on page boundaries, but it is small enough
+      // that copying it is cheap anyway. And a state with locked mappings
+      // wants to avoid the page faults copy-on-write would take.)
+      void *addr = mmap(NULL, shm->map_length, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE, shm->fd,
+                        shm->read_slot +
+                        current_slot(part->current) * shm->slot_stride);
+      if (addr == MAP_FAILED) {
+        int rv = -errno;
+        LOG_ERROR("%s: Error mapping lazy Transaction on %s: %d %s\n",
+                  caller, state_desc(state), -rv, strerror(-rv));
+        return rv;
+      }
+      part->map_addr = addr;
+      part->lazy = true;
+    } else {
+      part->map_addr = slot_data(shm, shm->header, part->slot);
+      memcpy(part->map_addr, read_data(shm, current_slot(part->current)),
+             shm->map_length);
+    }
+    // We keep the original version pinned, as we need to compare against it
+    // when we commit.
+  } else {
+    // A read transaction just looks at the version it has pinned, which
+    // won't change until we let go of it. We look at it through the read-only
+    // mapping, so we can't change it either.
+    part->map_addr = (void *)read_data(shm, current_slot(part->current));
+  }
+  return 0;
+}
+
+/*
+ * Return true if a write transaction's version of one of its states' data
+ * differs from the original version (which it has pinned).
+ *
+ * If we've been told which parts of the data have been altered, we only
+ * need to look at those.
+ */
+static bool transaction_altered_data(kstate_transaction_p  transaction,
+                                     struct kstate_part   *part)
+{
+  size_t map_length = part->shm->map_length;
+  uint8_t *ours = part->map_addr;
+  const uint8_t *theirs = read_data(part->shm, current_slot(part->current));
+
+  // We only know which bits of the first state were altered
+  if (transaction->num_dirty == 0 || part != &transaction->parts[0]) {
+    if (part->lazy && map_length >= KSTATE_STREAM_MIN) {
+      // A large lazy result will need copying into our slot, so we copy it
+      // as we compare it, rather than reading it all over again afterwards
+      part->copied = true;
+      return copy_and_compare(slot_data(part->shm, part->shm->header,
+                                        part->slot),
+                              ours, theirs, map_length);
+    }
+    return memcmp(theirs, ours, map_length) != 0;
+  }
+
+  uint32_t ii;
+  for (ii = 0; ii < transaction->num_dirty; ii++) {
+    struct kstate_range *range = &transaction->dirty[ii];
+    if (memcmp(theirs + range->offset, ours + range->offset, range->length))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Start a new transaction on a state.
+ *
+ * If 'transaction' is still active, this will fail.
+ *
+ * * 'transaction' is the transaction to start.
+ * * 'state' is the state on which to start the transaction.
+ * - 'permissions' is constructed by OR'ing the permission flags
+ *   KSTATE_READ and/or KSTATE_WRITE. At least one of those must be given.
+ *   KSTATE_WRITE by itself is regarded as equivalent to KSTATE_WRITE|KSTATE_READ.
+ *   KSTATE_LAZY may also be given, and is ignored for read transactions.
+ *
+ * The transaction uses the state's own mapping of its shared memory, rather
+ * than mapping it again, but keeps that mapping in use until the transaction
+ * ends, so that the transaction can continue to access the state's shared
+ * memory even if the particular 'state' is unsubscribed.
+ *
+ * A read transaction looks directly at the version of the state that was
+ * current when it started, which will not be changed or reused until the
+ * transaction ends - so there's no copying involved.
+ *
+ * A write transaction needs a free version slot in the state's shared
+ * memory to work in. There are a limited number of those, so if too many
+ * transactions (in any process) are writing to the same state at the same
+ * time, starting another will fail with -EAGAIN. Try again later. Note that
+ * read transactions that are still looking at old versions of the state
+ * also keep those versions' slots in use.
+ *
+ * A write transaction normally starts by copying the current version of the
+ * state into its slot. If KSTATE_LAZY is given, it instead maps the current
+ * version privately (copy-on-write), so that only the pages it actually
+ * writes to get copied, and copies its result into its slot when it commits.
+ * That costs a mapping per transaction, so is worth it for large states, or
+ * for transactions that often look at the state and then don't change it.
+ * For states of 256KB or more, the result is copied into the slot as it is
+ * compared with the original, using non-temporal stores where the CPU has
+ * them, so that the commit reads the result once, and doesn't fill the cache.
+ *
+ * Returns 0 if starting the transaction succeeds, or a negative value if it
+ * fails. The negative value will be ``-errno``, giving an indication of why
+ * the function failed.
+ */
+extern int kstate_start_transaction(kstate_transaction_p  transaction,
+                                    kstate_state_p        state,
+                                    uint32_t              permissions)
+{
+  if (transaction == NULL) {
+    LOG_ERROR("kstate_start_transaction: transaction argument may"
+              " not be NULL\n");
+    return -EINVAL;
+  }
+  if (state == NULL) {
+    LOG_ERROR("kstate_start_transaction: Cannot start a transaction"
+              " on a NULL state\n");
+    return -EINVAL;
+  }
+  if (kstate_transaction_is_active(transaction)) {
+    LOG_ERROR("kstate_start_transaction: transaction is still active\n");
+    LOG_ERROR("%s\n", transaction_desc(transaction));
+    return -EINVAL;
+  }
+  // Remember, unsubscribing from a state unsets its name
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_start_transaction: Cannot start a transaction"
+              " on an unsubscribed state\n");
+    return -EINVAL;
+  }
+
+  LOG_DEBUG("Starting Transaction on %s\n", state_desc(state));
+
+  if (transaction_permissions_are_bad(permissions)) {
+    return -EINVAL;
+  }
+
+  // If we had a legitimate permissions set that doesn't include READ,
+  // add READ back in
+  if (!(permissions & KSTATE_READ)) {
+    permissions |= KSTATE_READ;
+  }
+
+  // Read transactions never copy the state anyway
+  if (!(permissions & KSTATE_WRITE)) {
+    permissions &= ~KSTATE_LAZY;
+  }
+
+  if ((permissions & KSTATE_WRITE) && !(state->permissions & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_start_transaction: Cannot start a write"
+              " transaction on a read-only state\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+
+  transaction->permissions = permissions;
+  transaction->name = state->shm->name;
+  transaction->num_parts = 1;
+  if (KSTATE_STATS && (permissions & KSTATE_WRITE))
+    transaction->start_ns = monotonic_ns();
+
+  int rv = start_part("kstate_start_transaction", transaction,
+                      &transaction->parts[0], state);
+  PROBE4(transaction__start, transaction->id,
+         transaction->name + KSTATE_NAME_PREFIX_LEN, permissions, rv);
+  if (rv) {
+    clear_transaction("kstate_start_transaction", transaction);
+    return rv;
+  }
+
+  LOG_DEBUG("Started %s\n", transaction_desc(transaction));
+
+  return 0;
+}
+
+/*
+ * Add another state to a transaction.
+ *
+ * - ``transaction`` is the (active) transaction.
+ * - ``state`` is the state to add to it. If ``transaction`` is a write
+ *   transaction, then ``state`` must be subscribed for write.
+ *
+ * A transaction may be on up to KSTATE_MAX_TRANSACTION_STATES states,
+ * including the one it was started on, and each must be a different state.
+ * Use kstate_get_transaction_state_ptr to get at the data for each of them.
+ *
+ * Committing a write transaction on several states commits all of them, or
+ * (if anyone else has committed to any of them since the transaction started
+ * on it) none of them. A read transaction on several states sees versions of
+ * the states that were all current at the same time.
+ *
+ * Since there's no point carrying on with a transaction that can't succeed,
+ * this checks the states already in the transaction, and fails with -EPERM
+ * if any of them has already changed (or is being committed to). The
+ * transaction is still active, with the states it already had, and should
+ * be aborted.
+ *
+ * Returns 0 if it succeeds, -EPERM as above, -EAGAIN if there is no free
+ * version slot for a write transaction (see kstate_start_transaction), or
+ * another negative value (``-errno``) if it fails.
+ */
+extern int kstate_add_state_to_transaction(kstate_transaction_p  transaction,
+                                           kstate_state_p        state)
+{
+  if (!kstate_transaction_is_active(transaction)) {
+    LOG_ERROR("kstate_add_state_to_transaction: transaction is not active\n");
+    return -EINVAL;
+  }
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("kstate_add_state_to_transaction: Cannot add an"
+              " unsubscribed state\n");
+    return -EINVAL;
+  }
+  if ((transaction->permissions & KSTATE_WRITE) &&
+      !(state->permissions & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_add_state_to_transaction: Cannot add a"
+              " read-only state to a write transaction\n");
+    LOG_ERROR("%s\n", state_desc(state));
+    return -EINVAL;
+  }
+  if (transaction->num_parts == KSTATE_MAX_TRANSACTION_STATES) {
+    LOG_ERROR("kstate_add_state_to_transaction: %s is already on %d states\n",
+              transaction_desc(transaction), KSTATE_MAX_TRANSACTION_STATES);
+    return -EINVAL;
+  }
+  if (kstate_get_transaction_state_ptr(transaction, state)) {
+    LOG_ERROR("kstate_add_state_to_transaction: %s is already in %s\n",
+              state_desc(state), transaction_desc(transaction));
+    return -EINVAL;
+  }
+
+  struct kstate_part *part = &transaction->parts[transaction->num_parts];
+  int rv = start_part("kstate_add_state_to_transaction", transaction, part,
+                      state);
+
+  // Every version we've got pinned must still be current (and not in the
+  // middle of being committed to). Since we've checked them all after we
+  // pinned the last one, there was a moment when they were all current
+  // together.
+  uint32_t ii;
+  for (ii = 0; rv == 0 && ii <= transaction->num_parts; ii++) {
+    struct kstate_part *this = &transaction->parts[ii];
+    if (get_current(this->shm->header) != this->current) {
+      LOG_DEBUG("kstate_add_state_to_transaction: A state in %s has"
+                " already changed\n", transaction_desc(transaction));
+      rv = -EPERM;
+    }
+  }
+
+  if (rv) {
+    clear_part("kstate_add_state_to_transaction", transaction, part);
+    return rv;
+  }
+  transaction->num_parts ++;
+  return 0;
+}
+
+/*
+ * Say which part of the state data a write transaction has altered.
+ *
+ * - ``transaction`` is the write transaction.
+ * - ``offset`` is the offset of the altered bytes within the state data.
+ * - ``length`` is how many bytes were altered.
+ *
+ * The range is within the data for the state the transaction was started on,
+ * even if other states have been added to the transaction.
+ *
+ * This may be called as many times as is needed. It is an optimisation:
+ * if it is never called for a transaction, then committing the transaction
+ * has to compare all of the state data with the original version, to see if
+ * anything has changed. Once it has been called, only the parts of the data
+ * that have been marked are compared.
+ *
+ * So if it is used, every alteration must be marked - if the transaction
+ * alters bytes that have not been marked, then it is undefined whether those
+ * alterations will be committed.
+ *
+ * Returns 0 if all goes well, or a negative value if it fails - -EINVAL if
+ * the transaction is not active, or the range is not within the state data,
+ * or -EPERM if the transaction is read-only.
+ */
+extern int kstate_transaction_mark_dirty(kstate_transaction_p  transaction,
+                                         size_t                offset,
+                                         size_t                length)
+{
+  if (!kstate_transaction_is_active(transaction)) {
+    LOG_ERROR("kstate_transaction_mark_dirty: transaction is not active\n");
+    return -EINVAL;
+  }
+  if (!(transaction->permissions & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_transaction_mark_dirty: Cannot alter a"
+              " read-only transaction\n");
+    LOG_ERROR("%s\n", transaction_desc(transaction));
+    return -EPERM;
+  }
+  size_t map_length = transaction->parts[0].shm->map_length;
+  if (offset > map_length || length > map_length - offset) {
+    LOG_ERROR("kstate_transaction_mark_dirty: Range %zu for %zu"
+              " is not within the %zu bytes of state data for %s\n",
+              offset, length, map_length, transaction_desc(transaction));
+    return -EINVAL;
+  }
+  if (length == 0)
+    return 0;
+
+  if (transaction->num_dirty == KSTATE_MAX_DIRTY_RANGES) {
+    // We've run out of room, so replace all the ranges we have with the
+    // single range that covers them, and carry on from there
+    size_t start = transaction->dirty[0].offset;
+    size_t end = start + transaction->dirty[0].length;
+    uint32_t ii;
+    for (ii = 1; ii < transaction->num_dirty; ii++) {
+      struct kstate_range *range = &transaction->dirty[ii];
+      if (range->offset < start)
+        start = range->offset;
+      if (range->offset + range->length > end)
+        end = range->offset + range->length;
+    }
+    transaction->dirty[0].offset = start;
+    transaction->dirty[0].length = end - start;
+    transaction->num_dirty = 1;
+  }
+  transaction->dirty[transaction->num_dirty].offset = offset;
+  transaction->dirty[transaction->num_dirty].length = length;
+  transaction->num_dirty ++;
+  return 0;
+}
+
+/*
+ * Abort a transaction.
  *
- * We do not say anything about the value of the id, except that 0 means the
- * state is unsubscribed, the same state always has the same id, and two
- * separate states have distinct ids.
+ * - ``transaction`` is the transaction to abort.
+ *
+ * After this, the content of the transaction datastructure will have been
+ * unset/freed, and the transaction may be started again (on the same state
+ * or another).
+ *
+ * It is not allowed to abort a transaction that has not been started.
+ * In other words, you cannot abort a transaction before it has been started,
+ * or after it has been aborted or committed.
+ *
+ * Returns 0 if the abort succeeds, or a negative value if it fails.
+ * The negative value will be ``-errno``, giving an indication of why the
+ * function failed.
  */
-extern uint32_t kstate_get_state_id(kstate_state_p state)
+extern int kstate_abort_transaction(kstate_transaction_p  transaction)
 {
-  if (kstate_state_is_subscribed(state)) {
-    return state->id;
+  if (transaction == NULL) {     // What did they expect us to do?
+    LOG_ERROR("kstate_abort_transaction: Cannot abort NULL transaction\n");
+    return -EINVAL;
+  }
+  if (!kstate_transaction_is_active(transaction)) {
+    LOG_ERROR("kstate_abort_transaction: transaction is not active\n");
+    LOG_ERROR("%s\n", transaction_desc(transaction));
+    return -EINVAL;
+  }
+
+  LOG_DEBUG("Aborting %s\n", transaction_desc(transaction));
+  PROBE3(transaction__abort, transaction->id,
+         transaction->name + KSTATE_NAME_PREFIX_LEN, transaction->permissions);
+
+  if (transaction->permissions & KSTATE_WRITE) {
+    uint32_t ii;
+    for (ii = 0; ii < transaction->num_parts; ii++)
+      STAT_ADD(transaction->parts[ii].shm->header, aborts, 1);
+  }
+
+  int rv = clear_transaction("kstate_abort_transaction", transaction);
+  return rv;
+}
+
+/*
+ * Copy the version that is about to become current into the state's
+ * history, if it has one.
+ *
+ * 'next' is the value 'current' is about to have. The state must be locked
+ * (KSTATE_LOCKED set in 'current'), so that versions are added to the
+ * history in order, and nobody can see the new version until it is there.
+ */
+static void record_history(struct kstate_shm *shm, uint64_t next)
+{
+  if (shm->history == 0)
+    return;
+
+  uint64_t generation = next >> KSTATE_SLOT_BITS;
+  struct kstate_history_entry *entry = history_entry(shm, shm->header,
+                                                     generation);
+  // Anyone reading the entry whilst we're writing it will see that it has
+  // changed, and look again
+  __atomic_store_n(&entry->generation, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  copy_out(entry + 1, slot_data(shm, shm->header, current_slot(next)),
+           shm->map_length);
+  __atomic_store_n(&entry->generation, generation, __ATOMIC_RELEASE);
+}
+
+/*
+ * Commit a write transaction on a single state.
+ *
+ * Returns 0 if it succeeds (which includes there being nothing to commit),
+ * or -EPERM if someone else has committed to the state since we started.
+ */
+static int commit_one_state(kstate_transaction_p  transaction)
+{
+  int retcode = 0;
+
+  // We can commit if no-one else has committed to the state since we started
+  // - i.e., it is as if no-one else has altered it. Since every commit
+  // changes the generation, we only need to check 'current'.
+  //
+  // (So someone altering it and putting it back again while we weren't
+  // looking still counts as a change.)
+  //
+  // If someone else has changed the state, then we're meant to fail.
+  //
+  // Maybe if we were nice we'd also check to see if we're trying to change
+  // it to the same thing as someone else has already set it to (!) - we
+  // could conveivably be trying to update <data> to the same value
+  struct kstate_part *part = &transaction->parts[0];
+  struct kstate_shm *shm = part->shm;
+  struct kstate_header *header = shm->header;
+  uint64_t current = part->current;
+  if (get_current(header) != current) {
+    LOG_DEBUG("kstate_commit_transaction: Cannot commit as the underlying"
+              " state for %s has changed during the transaction\n",
+              transaction_desc(transaction));
+    STAT_ADD(header, conflicts, 1);
+    reap_locker(shm);
+    retcode = -EPERM;
+  } else if (!transaction_altered_data(transaction, part)) {
+    // We still have the original version pinned, so it can't have changed
+    // whilst we were comparing
+    LOG_DEBUG("kstate_commit_transaction: No need to commit, as the underlying"
+              " state for %s matches the result of the transaction\n",
+              transaction_desc(transaction));
+    STAT_ADD(header, noop_commits, 1);
+    if (KSTATE_STATS)
+      stat_latency(header, monotonic_ns() - transaction->start_ns);
+    retcode = 0;
   } else {
-    return 0;
+    if (part->lazy && !part->copied) {
+      // A lazy transaction has been working on a private copy of the
+      // original version, and only now writes its result into its slot
+      copy_out(slot_data(shm, header, part->slot),
+               part->map_addr, shm->map_length);
+    }
+    copy_to_replicas(shm, part->slot);
+    // If the state has a history, we lock it whilst we add our version to
+    // the history, and only then make our version current
+    uint64_t next = next_current(current, part->slot);
+    if (!__atomic_compare_exchange_n(&header->current, &current,
+                                     shm->history ? current | KSTATE_LOCKED
+                                                  : next,
+                                     false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+      // Someone else committed after we looked
+      LOG_DEBUG("kstate_commit_transaction: Cannot commit as the underlying"
+                " state for %s has changed during the transaction\n",
+                transaction_desc(transaction));
+      STAT_ADD(header, conflicts, 1);
+      reap_locker(shm);
+      retcode = -EPERM;
+    } else {
+      // Our slot is now the current version. It doesn't need our reference to
+      // keep it so, and nor do we need it any more, so we just let go of it
+      // along with the original version (which is free to be reused once
+      // anyone else looking at it has finished).
+      if (shm->history) {
+        set_locker(shm);
+        record_history(shm, next);
+        unlock_current(header, next);
+      }
+      LOG_DEBUG("kstate_commit_transaction: OK to commit as the underlying"
+                " state for %s did not change during the transaction\n",
+                transaction_desc(transaction));
+      retcode = 0;
+      notify_changed(header);
+      poke_flusher(shm);
+      STAT_ADD(header, commits, 1);
+      if (KSTATE_STATS)
+        stat_latency(header, monotonic_ns() - transaction->start_ns);
+    }
   }
+
+  return retcode;
 }
 
 /*
- * Return a transaction's id, or 0 if it is not active.
+ * Count the result of committing a write transaction on several states, in
+ * each of those states' statistics.
  *
- * We do not say anything about the value of the id, except that 0 means the
- * transaction is not active, the same transaction always has the same id, and
- * two separate transactions have distinct ids.
+ * If 'altered' is NULL, the commit failed. Otherwise it says which states
+ * the transaction altered.
  */
-extern uint32_t kstate_get_transaction_id(kstate_transaction_p transaction)
+static void stat_several_states(kstate_transaction_p  transaction,
+                                bool                 *altered)
 {
-  if (kstate_transaction_is_active(transaction)) {
-    return transaction->id;
-  } else {
-    return 0;
+  if (!KSTATE_STATS)
+    return;
+
+  uint64_t latency_ns = monotonic_ns() - transaction->start_ns;
+  uint32_t ii;
+  for (ii = 0; ii < transaction->num_parts; ii++) {
+    struct kstate_header *header = transaction->parts[ii].shm->header;
+    if (altered == NULL) {
+      STAT_ADD(header, conflicts, 1);
+    } else {
+      if (altered[ii])
+        STAT_ADD(header, commits, 1);
+      else
+        STAT_ADD(header, noop_commits, 1);
+      stat_latency(header, latency_ns);
+    }
   }
 }
 
 /*
- * Return a state's shared memory pointer, or NULL if it is not subscribed.
+ * Commit a write transaction on several states.
  *
- * Note that this is always a pointer to read-only shared memory, as
- * one must use a transaction to write.
+ * Either all of the states are committed, or none of them are. Even states
+ * the transaction didn't alter mustn't have been committed to by anyone
+ * else, since what we wrote to the others may depend upon them.
  *
- * Beware that this pointer stops being valid as soon as the state is
- * unsubscribed (or freed, which implicitly unsubscribes it).
+ * Returns 0 if it succeeds (which includes there being nothing to commit),
+ * or -EPERM if someone else has committed to any of the states since we
+ * started.
  */
-extern void *kstate_get_state_ptr(kstate_state_p state)
+static int commit_several_states(kstate_transaction_p  transaction)
 {
-  if (kstate_state_is_subscribed(state)) {
-    return state->map_addr;
-  } else {
-    return NULL;
+  uint32_t num_parts = transaction->num_parts;
+  bool altered[KSTATE_MAX_TRANSACTION_STATES];
+  bool any_altered = false;
+  uint32_t ii;
+
+  // If we can see anyone else has committed already, we needn't go further
+  for (ii = 0; ii < num_parts; ii++) {
+    struct kstate_part *part = &transaction->parts[ii];
+    if (get_current(part->shm->header) != part->current) {
+      LOG_DEBUG("kstate_commit_transaction: Cannot commit as an underlying"
+                " state for %s has changed during the transaction\n",
+                transaction_desc(transaction));
+      stat_several_states(transaction, NULL);
+      reap_locker(part->shm);
+      return -EPERM;
+    }
+    altered[ii] = transaction_altered_data(transaction, part);
+    if (altered[ii])
+      any_altered = true;
+  }
+
+  if (!any_altered) {
+    LOG_DEBUG("kstate_commit_transaction: No need to commit, as the underlying"
+              " states for %s match the result of the transaction\n",
+              transaction_desc(transaction));
+    stat_several_states(transaction, altered);
+    return 0;
+  }
+
+  // A lazy transaction only now writes its results into its slots
+  if (transaction->permissions & KSTATE_LAZY) {
+    for (ii = 0; ii < num_parts; ii++) {
+      struct kstate_part *part = &transaction->parts[ii];
+      if (altered[ii] && part->lazy && !part->copied)
+        copy_out(slot_data(part->shm, part->shm->header, part->slot),
+                 part->map_addr, part->shm->map_length);
+    }
+  }
+  for (ii = 0; ii < num_parts; ii++) {
+    if (altered[ii])
+      copy_to_replicas(transaction->parts[ii].shm, transaction->parts[ii].slot);
   }
+
+  // Lock every state, so that no-one else can commit to any of them
+  for (ii = 0; ii < num_parts; ii++) {
+    struct kstate_part *part = &transaction->parts[ii];
+    uint64_t current = part->current;
+    if (!__atomic_compare_exchange_n(&part->shm->header->current, &current,
+                                     part->current | KSTATE_LOCKED,
+                                     false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+      // Someone else committed after we looked, so let go of the states
+      // we've already locked, unchanged
+      struct kstate_shm *theirs = part->shm;
+      while (ii-- > 0) {
+        part = &transaction->parts[ii];
+        unlock_current(part->shm->header, part->current);
+      }
+      LOG_DEBUG("kstate_commit_transaction: Cannot commit as an underlying"
+                " state for %s has changed during the transaction\n",
+                transaction_desc(transaction));
+      stat_several_states(transaction, NULL);
+      reap_locker(theirs);
+      return -EPERM;
+    }
+    set_locker(part->shm);
+  }
+
+  // And now we have them all, we can make our versions current
+  for (ii = 0; ii < num_parts; ii++) {
+    struct kstate_part *part = &transaction->parts[ii];
+    struct kstate_header *header = part->shm->header;
+    if (altered[ii]) {
+      uint64_t next = next_current(part->current, part->slot);
+      record_history(part->shm, next);
+      unlock_current(header, next);
+      notify_changed(header);
+      poke_flusher(part->shm);
+    } else {
+      unlock_current(header, part->current);
+    }
+  }
+
+  LOG_DEBUG("kstate_commit_transaction: OK to commit as the underlying"
+            " states for %s did not change during the transaction\n",
+            transaction_desc(transaction));
+  stat_several_states(transaction, altered);
+  return 0;
 }
 
 /*
- * Return a transaction's shared memory pointer, or NULL if it is not active.
+ * Commit a transaction.
  *
- * Whether this can be used to write to the shared memory depends upon the
- * protection requested for the transaction.
+ * - ``transaction`` is the transaction to commit.
  *
- * Beware that this pointer stops being valid as soon as the transaction is
- * committed or aborted (or freed, which implicitly aborts it).
+ * After this, the content of the transaction datastructure will have been
+ * unset/freed, and the transaction may be started again (on the same state
+ * or another).
+ *
+ * It is not allowed to commit a transaction that has not been started.
+ * In other words, you cannot commit a transaction before it has been started,
+ * or after it has been aborted or committed.
+ *
+ * It is also not allowed to commit a read-only transaction (such must be
+ * aborted).
+ *
+ * Returns 0 if the commit succeeds, or a negative value if it fails.
+ * The negative value will be ``-errno``, giving an indication of why the
+ * function failed.
  */
-extern void *kstate_get_transaction_ptr(kstate_transaction_p transaction)
+extern int kstate_commit_transaction(struct kstate_transaction  *transaction)
 {
-  if (kstate_transaction_is_active(transaction)) {
-    return transaction->map_addr;
-  } else {
-    return NULL;
+  if (transaction == NULL) {    // What did they expect us to do?
+    LOG_ERROR("kstate_commit_transaction: Cannot commit NULL transaction\n");
+    return -EINVAL;
+  }
+  if (!kstate_transaction_is_active(transaction)) {
+    LOG_ERROR("kstate_commit_transaction: transaction is not active\n");
+    LOG_ERROR("%s\n", transaction_desc(transaction));
+    return -EINVAL;
+  }
+
+  if (!(transaction->permissions & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_commit_transaction: Cannot commit a read-only transaction\n");
+    LOG_ERROR("%s\n", transaction_desc(transaction));
+    return -EPERM;
   }
+
+  LOG_DEBUG("Committing %s\n", transaction_desc(transaction));
+
+  int retcode;
+  if (transaction->num_parts == 1)
+    retcode = commit_one_state(transaction);
+  else
+    retcode = commit_several_states(transaction);
+
+  // A conflict is worth a probe of its own, as it is what a busy state's
+  // writers will be wanting to count
+  if (retcode == -EPERM)
+    PROBE3(transaction__conflict, transaction->id,
+           transaction->name + KSTATE_NAME_PREFIX_LEN, transaction->num_parts);
+  else
+    PROBE4(transaction__commit, transaction->id,
+           transaction->name + KSTATE_NAME_PREFIX_LEN, transaction->num_parts,
+           retcode);
+
+  int rv = clear_transaction("kstate_commit_transaction", transaction);
+  if (retcode)
+    return retcode;
+  else
+    return rv;
 }
 
-static void print_state(FILE       *stream,
-                        uint32_t    id,
-                        const char *name,
-                        uint32_t    permissions)
+/*
+ * Pause briefly, as politely as we can, whilst spinning.
+ */
+static inline void cpu_relax(void)
 {
-  fprintf(stream, "State %u on '%s' for ", id, name);
-  if (permissions) {
-    if (permissions & KSTATE_READ)
-      fprintf(stream, "read");
-    if ((permissions & KSTATE_READ) && (permissions & KSTATE_WRITE))
-      fprintf(stream, "|");
-    if (permissions & KSTATE_WRITE)
-      fprintf(stream, "write");
-  } else {
-    fprintf(stream, "<no permissions>");
-  }
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
 }
 
 /*
- * Print a representation of 'state' on output 'stream'.
+ * The default backoff policy for kstate_transaction_using_fn.
  *
- * Assumes the state is valid.
+ * - ``retries`` is how many times the transaction has been retried so far.
+ * - ``data`` is ignored.
  *
- * If 'start' is non-NULL, print it before the state (with no added whitespace).
- * If 'eol' is true, then print a newline after the state.
+ * For the first few retries this just spins (for an increasing number of
+ * iterations), on the basis that the other committer will be finished very
+ * soon. After that it yields the processor for a few retries, and after that
+ * it sleeps for a random time of up to an exponentially increasing limit
+ * (capped at a millisecond), so that writers that keep colliding spread
+ * themselves out.
  */
-extern void kstate_print_state(FILE           *stream,
-                               const char     *start,
-                               kstate_state_p  state,
-                               bool            eol)
+extern void kstate_default_backoff(uint32_t  retries,
+                                   void     *data)
 {
-  if (start)
-    fprintf(stream, "%s", start);
+  (void) data;
 
-  if (kstate_state_is_subscribed(state)) {
-    print_state(stream,
-                state->id,
-                state->name + KSTATE_NAME_PREFIX_LEN,
-                state->permissions);
+  if (retries < 4) {
+    int ii;
+    for (ii = 0; ii < (16 << retries); ii++)
+      cpu_relax();
+  } else if (retries < 8) {
+    sched_yield();
   } else {
-    fprintf(stream, "State <unsubscribed>");
-  }
+    uint32_t shift = retries - 8;
+    if (shift > 10)
+      shift = 10;
+    uint64_t limit_ns = 1000ULL << shift;       // 1us up to about 1ms
 
-  if (eol)
-    fprintf(stream, "\n");
-}
+    // We don't need good random numbers, just different ones in different
+    // processes (and threads)
+    uint64_t seed = monotonic_ns() ^ ((uint64_t)getpid() << 32) ^
+                    (uintptr_t)&seed;
+    seed ^= seed >> 33;
+    seed *= 0xff51afd7ed558ccdULL;
+    seed ^= seed >> 33;
 
-static void print_transaction(FILE       *stream,
-                              uint32_t    id,
-                              const char *name,
-                              uint32_t    permissions)
-{
-  fprintf(stream, "Transaction %u for ", id);
-  if (permissions) {
-    if (permissions & KSTATE_READ)
-      fprintf(stream, "read");
-    if ((permissions & KSTATE_READ) && (permissions & KSTATE_WRITE))
-      fprintf(stream, "|");
-    if (permissions & KSTATE_WRITE)
-      fprintf(stream, "write");
-  } else {
-    fprintf(stream, "<no permissions>");
+    struct timespec wait;
+    wait.tv_sec = 0;
+    wait.tv_nsec = 1 + seed % limit_ns;
+    nanosleep(&wait, NULL);
   }
-  fprintf(stream, " on '%s'", name);
 }
 
 /*
- * Print a representation of 'transaction' on output 'stream'.
+ * Run a function within a write transaction on a state, retrying if need be.
  *
- * Assumes the transaction is valid.
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``fn`` is the function to call. It is called with the transaction,
+ *   the transaction's pointer to the state data, and ``data``.
+ * - ``data`` is passed to 'fn'.
+ * - ``retry`` says how to retry. If it is NULL, then we don't.
  *
- * If 'start' is non-NULL, print it before the transaction (with no added
- * whitespace).
- * If 'eol' is true, then print a newline after the transaction.
+ * This starts a write transaction on the state, calls 'fn' within it, and if
+ * 'fn' returns 0 tries to commit the transaction. If 'fn' returns anything
+ * else, the transaction is aborted and that value is returned.
+ *
+ * If the commit fails because someone else committed to the state first
+ * (-EPERM), or the transaction can't be started because too many others are
+ * writing to the state (-EAGAIN), then we call the retry's backoff function
+ * and try again, calling 'fn' again on the (new) current version of the state
+ * - at most 'max_retries' times. Since 'fn' may be called more than once, it
+ * should make no changes other than to the transaction's data.
+ *
+ * If 'retry' is not NULL, its 'retries' is set to the number of times we
+ * retried, whether we succeed or not.
+ *
+ * No memory is allocated.
+ *
+ * Returns 0 if the transaction was committed, whatever 'fn' returned if that
+ * was not 0, or a negative value (``-errno``) if it fails.
  */
-extern void kstate_print_transaction(FILE                 *stream,
-                                     const char           *start,
-                                     kstate_transaction_p  transaction,
-                                     bool                  eol)
+extern int kstate_transaction_using_fn(kstate_state_p           state,
+                                       kstate_transaction_fn_t  fn,
+                                       void                    *data,
+                                       struct kstate_retry     *retry)
 {
-  if (start)
-    fprintf(stream, "%s", start);
+  if (fn == NULL) {
+    LOG_ERROR("kstate_transaction_using_fn: fn may not be NULL\n");
+    return -EINVAL;
+  }
 
-  if (kstate_transaction_is_active(transaction)) {
-    print_transaction(stream,
-                      transaction->id,
-                      transaction->name + KSTATE_NAME_PREFIX_LEN,
-                      transaction->permissions);
-  } else {
-    fprintf(stream, "Transaction <not active>");
+  kstate_backoff_fn_t backoff = kstate_default_backoff;
+  void *backoff_data = NULL;
+  uint32_t max_retries = 0;
+  if (retry) {
+    if (retry->backoff) {
+      backoff = retry->backoff;
+      backoff_data = retry->backoff_data;
+    }
+    max_retries = retry->max_retries;
+    retry->retries = 0;
   }
 
-  if (eol)
-    fprintf(stream, "\n");
+  struct kstate_transaction transaction;
+  init_transaction(&transaction);
+
+  uint32_t retries = 0;
+  int rv;
+  for (;;) {
+    rv = kstate_start_transaction(&transaction, state, KSTATE_WRITE);
+    if (rv == 0) {
+      int fn_rv = fn(&transaction, kstate_get_transaction_ptr(&transaction),
+                     data);
+      if (fn_rv) {
+        kstate_abort_transaction(&transaction);
+        rv = fn_rv;
+        break;
+      }
+      rv = kstate_commit_transaction(&transaction);
+    }
+    if ((rv != -EPERM && rv != -EAGAIN) || retries >= max_retries)
+      break;
+
+    backoff(retries, backoff_data);
+    retries ++;
+    if (state->shm)
+      STAT_ADD(state->shm->header, retries, 1);
+    if (retry)
+      retry->retries = retries;
+  }
+  return rv;
 }
 
 /*
- * Create a new "empty" state.
+ * Create a new batch, for grouping many small updates to a state into one
+ * commit.
  *
- * The normal usage is to create an empty state and then immediately
- * populate it::
+ * The normal usage is::
  *
- *     kstate_state_p state = kstate_new_state();
- *     int ret = kstate_subscribe_state("State.Name", KSTATE_READ|KSTATE_WRITE, state);
+ *     kstate_batch_p batch = kstate_new_batch();
+ *     int ret = kstate_start_batch(batch, state, 100, 1000);
  *
- * and then eventually to destroy it::
+ * and then, for each update::
  *
- *     int ret = kstate_unsubscribe_state(state);
- *     if (ret) {
- *       // deal with the error
- *     }
- *     kstate_free_state(&state);
+ *     ret = kstate_batch_update(batch, update_fn, &update);
  *
- * After which it can safely be reused, if you wish.
+ * and eventually::
  *
- * Returns the new state, or NULL if there was insufficient memory.
+ *     ret = kstate_flush_batch(batch);
+ *     kstate_free_batch(&batch);
+ *
+ * Returns the new batch, or NULL if there was insufficient memory.
  */
-extern kstate_state_p kstate_new_state(void)
+extern kstate_batch_p kstate_new_batch(void)
 {
-  static uint32_t next_state_id = 1;    // because 0 is reserved
-
-  kstate_state_p new = malloc(sizeof(*new));
+  struct kstate_batch *new = malloc(sizeof(*new));
+  if (new == NULL)
+    return NULL;
   memset(new, 0, sizeof(*new));
-  new->id = next_state_id ++;
-
-  // Oh, OK, we should probably check.
-  if (next_state_id == 0)
-    next_state_id = 1;
-
+  init_transaction(&new->transaction);
   return new;
 }
 
 /*
- * Free a state created with 'kstate_new_state'.
+ * Destroy a batch created with 'kstate_new_batch'.
  *
- * If a NULL pointer is given, then it is ignored, otherwise the state is
+ * Any updates that have not been committed yet are discarded - call
+ * kstate_flush_batch first to keep them.
+ *
+ * If a NULL pointer is given, then it is ignored, otherwise the batch is
  * freed and the pointer is set to NULL.
  */
-extern void kstate_free_state(kstate_state_p *state)
+extern void kstate_free_batch(kstate_batch_p *batch)
 {
-  if (state && *state) {
-    if (kstate_state_is_subscribed(*state)) {
-      kstate_unsubscribe_state(*state);
-    }
-    struct kstate_state *s = (struct kstate_state *)(*state);
-    free(s);
-    *state = NULL;
+  if (batch && *batch) {
+    if (kstate_transaction_is_active(&(*batch)->transaction))
+      kstate_abort_transaction(&(*batch)->transaction);
+    free(*batch);
+    *batch = NULL;
   }
 }
 
 /*
- * Subscribe to a state.
+ * Start using a batch to update a state.
  *
- * - ``name`` is the name of the state to subscribe to.
- * - ``permissions`` is constructed by OR'ing the permission flags
- *   KSTATE_READ and/or KSTATE_WRITE. At least one of those must be given.
- *   KSTATE_WRITE by itself is regarded as equivalent to KSTATE_WRITE|KSTATE_READ.
- * - ``state`` is the actual state identifier, as amended by this function.
+ * - ``batch`` is the batch, which must not have any updates waiting to be
+ *   committed.
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``max_updates`` is how many updates to commit together, or 0 for no
+ *   limit.
+ * - ``max_delay_us`` is how long (in microseconds) after the first update
+ *   of a batch to commit it, or 0 for no limit.
  *
- * A state name may contain A-Z, a-z, 0-9 and the dot (.) character. It may not
- * start or end with a dot, and may not contain adjacent dots. It must contain
- * at least one character. Note that the name will be copied into 'state'.
+ * Updates made with kstate_batch_update are made within a write
+ * transaction, which is committed as soon as it holds ``max_updates``
+ * updates, or is found to have been going for ``max_delay_us`` or more -
+ * or when kstate_flush_batch is called. Anyone looking at the state only
+ * ever sees whole batches. This makes far fewer commits (and wakes those
+ * waiting for the state to change far less often) than committing each
+ * update, at the cost of seeing each update a little later.
  *
- * If this is the first subscription to the named state, then the shared
- * data for the state will be created.
+ * How long a batch has been going is only checked when an update is made,
+ * or by kstate_poll_batch, so a writer that may go quiet for a while should
+ * call one of kstate_poll_batch or kstate_flush_batch when it does.
  *
- * Note that the first subscription to a state cannot be read-only, as there is
- * nothing to read -i.e., the first subscription to a state must be for
- * KSTATE_WRITE|KSTATE_READ.
+ * A batch is meant for a state with one writer. If anyone else commits to
+ * the state before the batch is committed, the batch's commit fails with
+ * -EPERM, and all of its updates are lost.
  *
- * Returns 0 if the subscription succeeds, or a negative value if it fails.
- * The negative value will be ``-errno``, giving an indication of why the
- * function failed.
+ * Returns 0 if it succeeds, or -EINVAL if the batch still has updates to
+ * commit or the state is not subscribed for write.
  */
-extern int kstate_subscribe_state(kstate_state_p         state,
-                                  const char            *name,
-                                  kstate_permissions_t   permissions)
+extern int kstate_start_batch(kstate_batch_p  batch,
+                              kstate_state_p  state,
+                              uint32_t        max_updates,
+                              uint32_t        max_delay_us)
 {
-  if (state == NULL) {
-    fprintf(stderr, "!!! kstate_subscribe_state: state argument may not be NULL\n");
+  if (batch == NULL) {
+    LOG_ERROR("kstate_start_batch: batch argument may not be NULL\n");
     return -EINVAL;
   }
-
-  if (kstate_state_is_subscribed(state)) {
-    fprintf(stderr, "!!! kstate_subscribe_state: state is still subscribeed\n");
-    kstate_print_state(stderr, "!!! ", state, true);
+  if (kstate_transaction_is_active(&batch->transaction)) {
+    LOG_ERROR("kstate_start_batch: batch still has updates to commit\n");
     return -EINVAL;
   }
-
-  printf("Subscribing to ");
-  print_state(stdout, state->id, name, permissions);
-  printf("\n");
-
-  if (state_permissions_are_bad(permissions)) {
+  if (!(kstate_get_state_permissions(state) & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_start_batch: state is not subscribed for write\n");
     return -EINVAL;
   }
+  batch->state = state;
+  batch->max_updates = max_updates;
+  batch->max_delay_us = max_delay_us;
+  batch->updates = 0;
+  return 0;
+}
 
-  int rv = new_state_name("kstate_subscribe_state", name, &state->name);
-  if (rv) {
-    return rv;
-  }
-
-  // If we had a legitimate permissions set that doesn't include READ,
-  // add READ back in
-  if (!(permissions & KSTATE_READ)) {
-    permissions |= KSTATE_READ;
-  }
-
-  state->permissions = permissions;
-
-  int shm_flag = 0;
-  mode_t shm_mode = 0;
-  bool creating = false;
-  if (permissions & KSTATE_WRITE) {
-    shm_flag = O_RDWR | O_CREAT;
-    // XXX Allow everyone any access, at least for the moment
-    // XXX It is possible that we will want another version of this function
-    // XXX which allows specifying the mode (the "normal" version of the
-    // XXX function should always be the one that defaults to a "sensible"
-    // XXX mode, whatever we decide that to be).
-    shm_mode = S_IRWXU | S_IRWXG | S_IRWXO;
-    creating = true;
-  } else {
-    // We always allow read
-    shm_flag = O_RDONLY;
-  }
-
-  int shm_fd = shm_open(state->name, shm_flag, shm_mode);
-  if (shm_fd < 0) {
-    int rv = errno;
-    fprintf(stderr, "!!! kstate_subscribe_state:"
-            " Error in shm_open(\"%s\", 0x%x, 0x%x): %d %s\n",
-            state->name, shm_flag, shm_mode, rv, strerror(rv));
-    free(state->name);
-    state->name = NULL;
-    state->permissions = 0;
-    return -rv;
-  }
+/*
+ * Is it time to commit a batch?
+ */
+static bool batch_is_due(struct kstate_batch *batch)
+{
+  if (batch->max_updates && batch->updates >= batch->max_updates)
+    return true;
+  return batch->max_delay_us &&
+         monotonic_ns() - batch->first_ns >= batch->max_delay_us * 1000ULL;
+}
 
-  long page_size = sysconf(_SC_PAGESIZE);
+static int commit_batch(struct kstate_batch *batch)
+{
+  LOG_DEBUG("Committing batch of %u updates\n", batch->updates);
+  batch->updates = 0;
+  return kstate_commit_transaction(&batch->transaction);
+}
 
-  // If we're creating the shared memory object, we need to set a size,
-  // or it will be zero sized.
-  // For the moment, we always set the same size, one page.
-  if (creating) {
-    // Caveat emptor - from the man page:
-    //
-    //    If the file previously was larger than this size, the extra data is
-    //    lost. If  the file  previously was  shorter, it is extended, and the
-    //    extended part reads as null bytes ('\0').
-    //
-    int rv = ftruncate(shm_fd, page_size);
-    if (rv) {
-      int rv = errno;
-      kstate_print_state(stderr, "!!! kstate_subscribe_state:"
-                         " Error in setting shared memory size for ", state, false);
-      fprintf(stderr, " to 0x%x: %d %s\n", (uint32_t)page_size, rv, strerror(rv));
-      free(state->name);
-      state->name = NULL;
-      state->permissions = 0;
-      // NB: we're not doing shm_unlink...
-      return -rv;
-    }
+/*
+ * Make an update to a state, as part of a batch.
+ *
+ * - ``batch`` is the batch, as set up by kstate_start_batch.
+ * - ``fn`` is the function to call to make the update. It is called with
+ *   the batch's transaction, the transaction's pointer to the state data
+ *   (which holds any earlier updates in the batch), and ``data``.
+ * - ``data`` is passed to 'fn'.
+ *
+ * If there isn't a transaction for the batch yet, one is started, and then
+ * 'fn' is called within it. If 'fn' returns 0, the update counts towards the
+ * batch, and if that makes the batch due, it is committed. 'fn' may call
+ * kstate_transaction_mark_dirty to say what it altered, which makes the
+ * commit cheaper. If 'fn' returns anything else, that value is returned, and
+ * the update doesn't count - but 'fn' mustn't have altered the data, as
+ * there is no way to undo just one update.
+ *
+ * No memory is allocated.
+ *
+ * Returns 0 if it succeeds (whether or not the batch was committed), whatever
+ * 'fn' returned if that was not 0, or a negative value (``-errno``) if
+ * starting or committing the transaction fails - see kstate_start_batch for
+ * when committing fails.
+ */
+extern int kstate_batch_update(kstate_batch_p           batch,
+                               kstate_transaction_fn_t  fn,
+                               void                    *data)
+{
+  if (batch == NULL || batch->state == NULL || fn == NULL) {
+    LOG_ERROR("kstate_batch_update: batch must be started, and fn"
+              " may not be NULL\n");
+    return -EINVAL;
   }
 
-  // Some defaults just for now...
-  int flags = MAP_SHARED;
-
-  // Again, by default map the whole available area, starting at the
-  // start of the "file". Note that we only map for READ, regardless
-  // of the permissions - the caller must use a transaction if they
-  // want to write to the memory.
-  state->map_length = page_size;
-  state->map_addr = mmap(NULL, state->map_length, PROT_READ, flags, shm_fd, 0);
-  if (state->map_addr == MAP_FAILED) {
-    int rv = errno;
-    kstate_print_state(stderr, "!!! kstate_subscribe_state:"
-                       " Error in mapping shared memory for ", state, false);
-    fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-    free(state->name);
-    state->name = NULL;
-    state->permissions = 0;
-    state->map_addr = 0;
-    state->map_length = 0;
-    // NB: we're not doing shm_unlink...
-    return -rv;
+  struct kstate_transaction *transaction = &batch->transaction;
+  if (!kstate_transaction_is_active(transaction)) {
+    int rv = kstate_start_transaction(transaction, batch->state, KSTATE_WRITE);
+    if (rv)
+      return rv;
+    batch->updates = 0;
+    batch->first_ns = batch->max_delay_us ? monotonic_ns() : 0;
   }
 
-  // At which point, we don't need the file descriptor anymore
-  close(shm_fd);
-
+  int rv = fn(transaction, kstate_get_transaction_ptr(transaction), data);
+  if (rv)
+    return rv;
+  batch->updates ++;
+  if (batch_is_due(batch))
+    return commit_batch(batch);
   return 0;
 }
 
 /*
- * Unsubscribe from a state.
- *
- * - ``state`` is the state from which to unsubscribe.
+ * Commit a batch's updates, if it has been going for its 'max_delay_us'.
  *
- * After this, the content of the state datastructure will have been
- * unset/freed. Unsubscribing from this same state value again will have no
- * effect.
+ * This is for a writer that may stop making updates for a while, to call
+ * every so often, so that its last few updates don't wait indefinitely.
  *
- * Note that transactions using the state keep their own copy of the state
- * information, and are not affected by this function - i.e., the state can
- * still be accessed via any transactions that are still open on it.
+ * Returns 0 if it succeeds (including if there was nothing to commit yet),
+ * or a negative value (``-errno``) if the commit fails.
+ */
+extern int kstate_poll_batch(kstate_batch_p  batch)
+{
+  if (batch == NULL || !kstate_transaction_is_active(&batch->transaction))
+    return 0;
+  if (batch_is_due(batch))
+    return commit_batch(batch);
+  return 0;
+}
+
+/*
+ * Commit a batch's updates now.
  *
- * Returns 0 if the unsubscription succeeds, or a negative value if it fails.
- * The negative value will be ``-errno``, giving an indication of why the
- * function failed.
+ * Returns 0 if it succeeds (including if there was nothing to commit), or a
+ * negative value (``-errno``) if the commit fails.
  */
-extern void kstate_unsubscribe_state(kstate_state_p  state)
+extern int kstate_flush_batch(kstate_batch_p  batch)
 {
-  if (state == NULL)      // What did they expect us to do?
-    return;
+  if (batch == NULL || !kstate_transaction_is_active(&batch->transaction))
+    return 0;
+  return commit_batch(batch);
+}
 
-  kstate_print_state(stdout, "Unsubscribing from ", state, true);
+// Replicating a state to another host. The sender connects to the receiver
+// over TCP, and sends a hello, and then a journal record (see above) for each
+// version it sees - the first holding the whole state, and each after that
+// just what has changed. The records' 'seq' is the sender's change count,
+// and they have no checksum, as TCP looks after that.
+#define KSTATE_REPLICATION_MAGIC        0x4B535250      // "KSRP"
+#define KSTATE_REPLICATION_VERSION      1
 
-  if (state->map_addr != NULL && state->map_addr != MAP_FAILED) {
-    int rv = munmap(state->map_addr, state->map_length);
-    if (rv) {
-      rv = errno;
-      kstate_print_state(stderr, "!!! kstate_unsubscribe_state:"
-                         " Error in freeing shared memory for ", state, false);
-      fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-      // But there's not much we can do about it...
-    }
-    state->map_addr = 0;
-    state->map_length = 0;
-  }
+// How long the sender waits before trying to connect again
+#define KSTATE_REPLICATION_RETRY_MS     1000
 
-  if (state->name) {
-    int rv = shm_unlink(state->name);
-    if (rv) {
-      rv = errno;
-      if (rv == ENOENT) {
-        fprintf(stderr, "... kstate_unsubscribe_state:"
-                " Unable to unlink %s, it has already gone.\n", state->name);
-      } else {
-        fprintf(stderr, "!!! kstate_unsubscribe_state:"
-                " Error unlinking %s: %d %s\n", state->name,
-                rv, strerror(rv));
-      }
-    }
+// How many times the receiver retries committing an update, if someone on
+// this host commits to the state at the same time
+#define KSTATE_REPLICATION_RETRIES      100
 
-    free(state->name);
-    state->name = NULL;
-  }
+struct replication_hello {
+  uint32_t   magic;       // KSTATE_REPLICATION_MAGIC
+  uint32_t   version;     // KSTATE_REPLICATION_VERSION
+  uint64_t   length;      // The length of the state data
+};
 
-  state->permissions = 0;
+// A thread that sends a state to another host, or receives it from one. It
+// belongs to the state, and stops when the state is unsubscribed.
+struct kstate_replication {
+  kstate_state_p state;         // What we're replicating
+  bool       sending;           // Are we sending it, or receiving it?
+  struct addrinfo *address;     // Where we send it to, or listen on
+  int        fd;                // The socket we listen on, or -1
+  uint32_t   interval_ms;       // Send at most one update this often, or 0
+
+  uint8_t   *previous;          // The version we last sent
+  uint8_t   *buffer;            // For putting together (or receiving) a record
+
+  pthread_t  thread;
+  bool       stop;              // Time to stop (atomic)
+};
+
+static bool replication_stopping(struct kstate_replication *replication)
+{
+  return __atomic_load_n(&replication->stop, __ATOMIC_SEQ_CST);
 }
 
 /*
- * Create a new "empty" transaction.
- *
- * The normal usage is to create an empty transaction and then immediately
- * populate it::
- *
- *     struct kstate_transaction *transaction = kstate_new_transaction();
- *     int ret = kstate_start_transaction(&transaction, state, KSTATE_WRITE);
- *
- * and then eventually to destroy it::
- *
- *     int ret = kstate_unsubscribe_state(transaction);
- *     if (ret) {
- *       // deal with the error
- *     }
- *     kstate_free_transaction(&transaction);
+ * Wait until a socket is ready for 'events', or we're told to stop.
  *
- * Returns the new transaction, or NULL if there was insufficient memory.
+ * Returns 0 if it is ready, -ECANCELED if we're stopping, or another negative
+ * value (``-errno``) if it fails.
  */
-extern struct kstate_transaction *kstate_new_transaction(void)
+static int wait_for_socket(struct kstate_replication *replication,
+                           int                        fd,
+                           short                      events)
 {
-  static uint32_t next_transaction_id = 1;    // because 0 is reserved
-
-  struct kstate_transaction *new = malloc(sizeof(struct kstate_transaction));
-  memset(new, 0, sizeof(*new));
-  new->id = next_transaction_id ++;
+  for (;;) {
+    if (replication_stopping(replication))
+      return -ECANCELED;
+    struct pollfd pfd = { fd, events, 0 };
+    int rv = poll(&pfd, 1, KSTATE_JOURNAL_WAIT_MS);
+    if (rv > 0)
+      return 0;
+    if (rv < 0 && errno != EINTR)
+      return -errno;
+  }
+}
 
-  // Oh, OK, we should probably check.
-  if (next_transaction_id == 0)
-    next_transaction_id = 1;
+static int send_all(struct kstate_replication *replication,
+                    int                        fd,
+                    const void                *data,
+                    size_t                     length)
+{
+  const uint8_t *ptr = data;
+  while (length > 0) {
+    ssize_t done = send(fd, ptr, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -errno;
+      // A slow link just means the next update has more in it
+      int rv = wait_for_socket(replication, fd, POLLOUT);
+      if (rv)
+        return rv;
+      continue;
+    }
+    ptr += done;
+    length -= done;
+  }
+  return 0;
+}
 
-  return new;
+static int recv_all(struct kstate_replication *replication,
+                    int                        fd,
+                    void                      *data,
+                    size_t                     length)
+{
+  uint8_t *ptr = data;
+  while (length > 0) {
+    int rv = wait_for_socket(replication, fd, POLLIN);
+    if (rv)
+      return rv;
+    ssize_t done = recv(fd, ptr, length, MSG_DONTWAIT);
+    if (done < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+      return -errno;
+    } else if (done == 0) {
+      return -ENODATA;          // the other end has gone
+    }
+    ptr += done;
+    length -= done;
+  }
+  return 0;
 }
 
 /*
- * Destroy a transaction created with 'kstate_new_transaction'.
- *
- * If the transaction is still in progress, it will be aborted.
- *
- * If a NULL pointer is given, then it is ignored, otherwise the transaction is
- * freed and the pointer is set to NULL.
+ * Send each new version of the state over a connection, until it fails or
+ * we're told to stop.
  */
-extern void kstate_free_transaction(kstate_transaction_p *transaction)
+static int send_versions(struct kstate_replication *replication, int fd)
 {
-  if (transaction && *transaction) {
-    if (kstate_transaction_is_active(*transaction)) {
-      kstate_abort_transaction(*transaction);
+  struct kstate_shm *shm = replication->state->shm;
+  struct kstate_header *header = shm->header;
+  size_t length = shm->map_length;
+  struct timespec timeout = { 0, KSTATE_JOURNAL_WAIT_MS * 1000000L };
+
+  struct replication_hello hello = { KSTATE_REPLICATION_MAGIC,
+                                     KSTATE_REPLICATION_VERSION, length };
+  int rv = send_all(replication, fd, &hello, sizeof(hello));
+  if (rv)
+    return rv;
+
+  // The receiver may have anything at all, so we start by sending it all
+  bool everything = true;
+  uint32_t seen = 0;
+  uint64_t next_ns = 0;
+  for (;;) {
+    if (replication_stopping(replication))
+      return -ECANCELED;
+    uint32_t changes = __atomic_load_n(&header->changes, __ATOMIC_SEQ_CST);
+    if (!everything && changes == seen) {
+      (void) wait_for_change(header, changes, &timeout);
+      continue;
     }
-    struct kstate_transaction *t = (struct kstate_transaction *)(*transaction);
-    free(t);
-    *transaction = NULL;
+    // Anything committed before the next update is due is sent with it
+    uint64_t now = monotonic_ns();
+    if (now < next_ns) {
+      uint64_t delay = next_ns - now;
+      if (delay > KSTATE_JOURNAL_WAIT_MS * 1000000ULL)
+        delay = KSTATE_JOURNAL_WAIT_MS * 1000000ULL;
+      struct timespec wait = { delay / 1000000000ULL, delay % 1000000000ULL };
+      nanosleep(&wait, NULL);
+      continue;
+    }
+
+    struct journal_record record;
+    uint8_t *payload = replication->buffer + sizeof(record);
+    uint32_t num_ranges = 1;
+    size_t payload_len;
+    uint64_t current = pin_current(shm);
+    const uint8_t *data = slot_data(shm, shm->ro_addr, current_slot(current));
+    if (everything) {
+      struct journal_range range = { 0, length };
+      memcpy(payload, &range, sizeof(range));
+      memcpy(payload + sizeof(range), data, length);
+      memcpy(replication->previous, data, length);
+      payload_len = sizeof(range) + length;
+    } else {
+      payload_len = diff_version(replication->previous, data, length,
+                                 payload, &num_ranges);
+    }
+    release_slot(shm, current_slot(current));
+    everything = false;
+    seen = changes;
+    if (num_ranges == 0)
+      continue;
+
+    record.magic = KSTATE_RECORD_MAGIC;
+    record.num_ranges = num_ranges;
+    record.seq = changes;
+    record.time_ns = realtime_ns();
+    record.payload_len = payload_len;
+    record.checksum = 0;
+    memcpy(replication->buffer, &record, sizeof(record));
+    rv = send_all(replication, fd, replication->buffer,
+                  sizeof(record) + payload_len);
+    if (rv)
+      return rv;
+    next_ns = replication->interval_ms ?
+              now + replication->interval_ms * 1000000ULL : 0;
   }
 }
 
-static int clear_transaction(char *caller, kstate_transaction_p  transaction)
+static int connect_to_receiver(struct kstate_replication *replication)
 {
-  if (transaction->state_map_copy) {
-    free(transaction->state_map_copy);
-    transaction->state_map_copy = NULL;
+  struct addrinfo *address = replication->address;
+  int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                  address->ai_protocol);
+  if (fd < 0)
+    return -errno;
+  // Our updates should go as soon as they're ready - we do our own batching
+  int one = 1;
+  (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, address->ai_addr, address->ai_addrlen)) {
+    int rv = -errno;
+    close(fd);
+    return rv;
   }
+  return fd;
+}
 
-  if (transaction->state_map_addr != NULL && transaction->state_map_addr != MAP_FAILED) {
-    int rv = munmap(transaction->state_map_addr, transaction->map_length);
-    if (rv) {
-      rv = errno;
-      fprintf(stderr, "!!! %s: ", caller);
-      kstate_print_transaction(stderr, " Error in freeing shared memory for ", transaction, false);
-      fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-      return -rv;
+static void *sender_thread(void *arg)
+{
+  struct kstate_replication *replication = arg;
+  while (!replication_stopping(replication)) {
+    int fd = connect_to_receiver(replication);
+    if (fd >= 0) {
+      int rv = send_versions(replication, fd);
+      if (rv != -ECANCELED)
+        LOG_INFO("kstate replication: Lost connection sending %s: %d %s\n",
+                 state_desc(replication->state), -rv, strerror(-rv));
+      close(fd);
     }
-    transaction->state_map_addr = 0;
+    // Wait a while before trying again, unless we're stopping
+    uint32_t waited;
+    for (waited = 0; waited < KSTATE_REPLICATION_RETRY_MS &&
+                     !replication_stopping(replication);
+         waited += KSTATE_JOURNAL_WAIT_MS)
+      usleep(KSTATE_JOURNAL_WAIT_MS * 1000);
+  }
+  return NULL;
+}
+
+struct received_update {
+  const uint8_t *payload;
+  size_t     payload_len;
+  uint32_t   num_ranges;
+  size_t     length;
+};
+
+static int apply_update_fn(kstate_transaction_p  transaction,
+                           void                 *ptr,
+                           void                 *data)
+{
+  struct received_update *update = data;
+  return apply_ranges(ptr, update->length, update->payload,
+                      update->payload_len, update->num_ranges, transaction);
+}
+
+/*
+ * Commit each update received over a connection, until it fails or we're
+ * told to stop.
+ */
+static int receive_versions(struct kstate_replication *replication, int fd)
+{
+  kstate_state_p state = replication->state;
+  size_t length = state->shm->map_length;
+
+  struct replication_hello hello;
+  int rv = recv_all(replication, fd, &hello, sizeof(hello));
+  if (rv)
+    return rv;
+  if (hello.magic != KSTATE_REPLICATION_MAGIC ||
+      hello.version != KSTATE_REPLICATION_VERSION || hello.length != length) {
+    LOG_ERROR("kstate replication: Cannot receive %s from a sender"
+              " that is not sending a state of length %zu\n",
+              state_desc(state), length);
+    return -EINVAL;
   }
 
-  if (transaction->map_addr != NULL && transaction->map_addr != MAP_FAILED) {
-    int rv = munmap(transaction->map_addr, transaction->map_length);
+  size_t max_len = max_payload_len(length);
+  for (;;) {
+    struct journal_record record;
+    rv = recv_all(replication, fd, &record, sizeof(record));
+    if (rv == 0 && (record.magic != KSTATE_RECORD_MAGIC ||
+                    record.payload_len > max_len))
+      rv = -EINVAL;
+    if (rv == 0)
+      rv = recv_all(replication, fd, replication->buffer, record.payload_len);
+    if (rv)
+      return rv;
+
+    struct received_update update = { replication->buffer, record.payload_len,
+                                      record.num_ranges, length };
+    struct kstate_retry retry = { KSTATE_REPLICATION_RETRIES, NULL, NULL, 0 };
+    rv = kstate_transaction_using_fn(state, apply_update_fn, &update, &retry);
     if (rv) {
-      rv = errno;
-      fprintf(stderr, "!!! %s: ", caller);
-      kstate_print_transaction(stderr, " Error in freeing local memory for ", transaction, false);
-      fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-      return -rv;
+      LOG_ERROR("kstate replication: Error committing update %" PRIu64
+                " to %s: %d %s\n", record.seq, state_desc(state),
+                -rv, strerror(-rv));
+      return rv;
     }
-    transaction->map_addr = 0;
   }
-  transaction->map_length = 0;
+}
 
-  if (transaction->name) {
-    free(transaction->name);
-    transaction->name = NULL;
+static void *receiver_thread(void *arg)
+{
+  struct kstate_replication *replication = arg;
+  while (wait_for_socket(replication, replication->fd, POLLIN) == 0) {
+    int fd = accept(replication->fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    int rv = receive_versions(replication, fd);
+    if (rv != -ECANCELED)
+      LOG_INFO("kstate replication: Lost connection receiving %s: %d %s\n",
+               state_desc(replication->state), -rv, strerror(-rv));
+    close(fd);
   }
+  return NULL;
+}
 
-  transaction->permissions = 0;
-  return 0;
+static void free_replication(struct kstate_replication *replication)
+{
+  if (replication->address)
+    freeaddrinfo(replication->address);
+  if (replication->fd >= 0)
+    close(replication->fd);
+  free(replication->previous);
+  free(replication->buffer);
+  free(replication);
 }
 
 /*
- * Start a new transaction on a state.
- *
- * If 'transaction' is still active, this will fail.
- *
- * * 'transaction' is the transaction to start.
- * * 'state' is the state on which to start the transaction.
- * - 'permissions' is constructed by OR'ing the permission flags
- *   KSTATE_READ and/or KSTATE_WRITE. At least one of those must be given.
- *   KSTATE_WRITE by itself is regarded as equivalent to KSTATE_WRITE|KSTATE_READ.
- *
- * Note that copy of the state will be taken, so that the transaction
- * can continue to access the state's shared memory even if the particular
- * 'state' is unsubscribed. However, this is not enough information to
- * reconstruct/return the entirety of the original 'state', as we do not
- * (for instance) remember the shared memory object used internally as an
- * intermediary when creating a state.
- *
- * Returns 0 if starting the transaction succeeds, or a negative value if it
- * fails. The negative value will be ``-errno``, giving an indication of why
- * the function failed.
+ * Stop replicating a state.
  */
-extern int kstate_start_transaction(kstate_transaction_p  transaction,
-                                    kstate_state_p        state,
-                                    uint32_t              permissions)
+static void stop_replication(kstate_state_p state)
 {
-  if (transaction == NULL) {
-    fprintf(stderr, "!!! kstate_start_transaction: transaction argument may"
-            " not be NULL\n");
-    return -EINVAL;
-  }
-  if (state == NULL) {
-    fprintf(stderr, "!!! kstate_start_transaction: Cannot start a transaction"
-            " on a NULL state\n");
+  struct kstate_replication *replication = state->replication;
+  __atomic_store_n(&replication->stop, true, __ATOMIC_SEQ_CST);
+  pthread_join(replication->thread, NULL);
+  free_replication(replication);
+  state->replication = NULL;
+}
+
+/*
+ * Start a thread to send or receive a state.
+ */
+static int start_replication(const char     *caller,
+                             kstate_state_p  state,
+                             bool            sending,
+                             const char     *address,
+                             uint32_t        interval_ms)
+{
+  if (!kstate_state_is_subscribed(state)) {
+    LOG_ERROR("%s: state is not subscribed\n", caller);
     return -EINVAL;
   }
-  if (kstate_transaction_is_active(transaction)) {
-    fprintf(stderr, "!!! kstate_start_transaction: transaction is still active\n");
-    kstate_print_transaction(stderr, "!!! ", transaction, true);
-    return -EINVAL;
+  if (state->replication) {
+    LOG_ERROR("%s: %s is already being replicated\n", caller,
+              state_desc(state));
+    return -EBUSY;
   }
-  // Remember, unsubscribing from a state unsets its name
-  if (!kstate_state_is_subscribed(state)) {
-    fprintf(stderr, "!!! kstate_start_transaction: Cannot start a transaction"
-            " on an unsubscribed state\n");
+  if (address == NULL) {
+    LOG_ERROR("%s: address may not be NULL\n", caller);
     return -EINVAL;
   }
 
-  kstate_print_state(stdout, "Starting Transaction on ", state, true);
-
-  if (transaction_permissions_are_bad(permissions)) {
+  // The address is "host:port", and the host may be an IPv6 address in
+  // brackets, or (for the receiver) empty, for any address
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL || colon[1] == '\0') {
+    LOG_ERROR("%s: address \"%s\" is not host:port\n", caller, address);
     return -EINVAL;
   }
-
-  // If we had a legitimate permissions set that doesn't include READ,
-  // add READ back in
-  if (!(permissions & KSTATE_READ)) {
-    permissions |= KSTATE_READ;
+  char host[NAME_MAX + 1];
+  size_t host_len = colon - address;
+  if (host_len >= 2 && address[0] == '[' && address[host_len - 1] == ']') {
+    address ++;
+    host_len -= 2;
   }
-
-  if ((permissions & KSTATE_WRITE) && !(state->permissions & KSTATE_WRITE)) {
-    fprintf(stderr, "!!! kstate_start_transaction: Cannot start a write"
-            " transaction on a read-only state\n");
-    kstate_print_state(stderr, "!!! ", state, true);
+  if (host_len >= sizeof(host)) {
+    LOG_ERROR("%s: address \"%s\" is too long\n", caller, address);
     return -EINVAL;
   }
+  memcpy(host, address, host_len);
+  host[host_len] = '\0';
 
-  transaction->permissions = permissions;
-
-  size_t name_len = strlen(state->name);
-  transaction->name = malloc(name_len + 1);
-  if (transaction->name == NULL) return -ENOMEM;
-
-  strcpy(transaction->name, state->name);
-  transaction->map_length = state->map_length;
-
-  // First off, we need to be able to see what the state has
-  // If we're a write transaction (i.e., can commit) then we need to be able
-  // to write back to it if we ever do commit...
-  int map_prot = PROT_READ;
-  int shm_flag = 0;
-  mode_t shm_mode = 0;
-  if (permissions & KSTATE_WRITE) {
-    map_prot |= PROT_WRITE;
-    shm_flag = O_RDWR;
-  } else {
-    shm_flag = O_RDONLY;
-  }
+  struct kstate_replication *new = malloc(sizeof(*new));
+  if (new == NULL)
+    return -ENOMEM;
+  memset(new, 0, sizeof(*new));
+  new->state = state;
+  new->sending = sending;
+  new->fd = -1;
+  new->interval_ms = interval_ms;
 
-  int shm_fd = shm_open(transaction->name, shm_flag, shm_mode);
-  if (shm_fd < 0) {
-    int rv = errno;
-    fprintf(stderr, "!!! kstate_start_transaction:"
-            " Error in shm_open(\"%s\", 0x%x, 0x%x): %d %s\n",
-            transaction->name, shm_flag, shm_mode, rv, strerror(rv));
-    free(transaction->name);
-    transaction->name = NULL;
-    transaction->permissions = 0;
-    return -rv;
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = sending ? 0 : AI_PASSIVE;
+  int rv = getaddrinfo(host_len ? host : NULL, colon + 1, &hints,
+                       &new->address);
+  if (rv) {
+    LOG_ERROR("%s: Cannot find address \"%s\": %s\n", caller, address,
+              gai_strerror(rv));
+    free(new);
+    return -EINVAL;
   }
 
-  transaction->state_map_addr = mmap(NULL, transaction->map_length, map_prot, MAP_SHARED, shm_fd, 0);
-  if (transaction->state_map_addr == MAP_FAILED) {
-    int rv = errno;
-    kstate_print_state(stderr, "!!! kstate_start_transaction:"
-                       " Error in mapping shared memory for Transaction on ", state, false);
-    fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-    clear_transaction("kstate_start_transaction", transaction);
-    close(shm_fd);
-    return -rv;
+  size_t length = state->shm->map_length;
+  new->buffer = malloc(sizeof(struct journal_record) + max_payload_len(length));
+  if (sending)
+    new->previous = malloc(length);
+  if (new->buffer == NULL || (sending && new->previous == NULL)) {
+    free_replication(new);
+    return -ENOMEM;
   }
-  close(shm_fd);
 
-  // If we're a writable transaction, we will need to know if that state
-  // data has changed when we try to commit. The simplest way to do that
-  // is to keep a copy of the current state of the data.
-  // XXX There's a hole whilst we're copying it where things can go wrong
-  // XXX here - we need some locking...
-  if (transaction->permissions & KSTATE_WRITE) {
-    transaction->state_map_copy = malloc(transaction->map_length);
-    if (transaction->state_map_copy == NULL) {
-      clear_transaction("kstate_start_transaction", transaction);
-      return -ENOMEM;
+  int port = 0;
+  if (!sending) {
+    struct addrinfo *ai = new->address;
+    new->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+    int one = 1;
+    if (new->fd < 0 ||
+        setsockopt(new->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(new->fd, ai->ai_addr, ai->ai_addrlen) ||
+        listen(new->fd, 1)) {
+      rv = -errno;
+      LOG_ERROR("%s: Error listening on \"%s\": %d %s\n", caller, address,
+                -rv, strerror(-rv));
+      free_replication(new);
+      return rv;
+    }
+    // If we were given port 0, we need to say which we got
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    if (getsockname(new->fd, (struct sockaddr *)&bound, &bound_len) == 0) {
+      if (bound.ss_family == AF_INET)
+        port = ntohs(((struct sockaddr_in *)&bound)->sin_port);
+      else if (bound.ss_family == AF_INET6)
+        port = ntohs(((struct sockaddr_in6 *)&bound)->sin6_port);
     }
-    memcpy(transaction->state_map_copy, transaction->state_map_addr,
-           transaction->map_length);
   }
 
-  // Then we need our own version of the data, which is independent of that
-  // for the state - both in case the state changes during our transaction,
-  // and also (if we're allowed to) because we might write to our own copy
-  // However, since we're going to make a copy of the original data, we
-  // do need to be able to write to it - at least for the moment
-  transaction->map_addr = mmap(NULL, transaction->map_length,
-                               PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-  if (transaction->map_addr == MAP_FAILED) {
-    int rv = errno;
-    kstate_print_state(stderr, "!!! kstate_start_transaction:"
-                       " Error in mapping local memory for Transaction on ", state, false);
-    fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-    clear_transaction("kstate_start_transaction", transaction);
+  rv = pthread_create(&new->thread, NULL,
+                      sending ? sender_thread : receiver_thread, new);
+  if (rv) {
+    LOG_ERROR("%s: Error starting replication thread: %d %s\n",
+              caller, rv, strerror(rv));
+    free_replication(new);
     return -rv;
   }
-
-  // And obviously we need to copy one to the other...
-  memcpy(transaction->map_addr, transaction->state_map_addr, transaction->map_length);
-
-  if (!(permissions & KSTATE_WRITE)) {
-    // Revoke permission to write to our internal data
-    int rv = mprotect(transaction->map_addr, transaction->map_length, PROT_READ);
-    if (rv) {
-      int rv = errno;
-      kstate_print_state(stderr, "!!! kstate_start_transaction:"
-                         " Error disallowing write on local memory"
-                         " for Transaction on ", state, false);
-      fprintf(stderr, ": %d %s\n", rv, strerror(rv));
-      clear_transaction("kstate_start_transaction", transaction);
-      return -rv;
-    }
-  }
-
-  kstate_print_transaction(stdout, "Started ", transaction, true);
-
-  return 0;
+  state->replication = new;
+  return port;
 }
 
 /*
- * Abort a transaction.
+ * Send a state to another host, as it changes.
  *
- * - ``transaction`` is the transaction to abort.
+ * - ``state`` is the state, which must be subscribed (reading is enough).
+ * - ``address`` is where to send it, as "host:port", where the host is a
+ *   name, or an IPv4 address, or an IPv6 address in brackets. It should be
+ *   somewhere that kstate_receive_state is listening.
+ * - ``interval_ms`` is how often, at most, to send an update, or 0 to send
+ *   each change as soon as possible.
  *
- * After this, the content of the transaction datastructure will have been
- * unset/freed.
+ * A thread connects to the receiver over TCP, and sends it the whole state
+ * to start with, and then what has changed each time the state changes. It
+ * only ever sends the latest version: everything committed whilst it waits
+ * for ``interval_ms`` to pass, or whilst a slow link is busy with the last
+ * update, is coalesced into the next. So the receiver never falls ever
+ * further behind - it just sees fewer of the changes.
  *
- * It is not allowed to abort a transaction that has not been started.
- * In other words, you cannot abort a transaction before it has been started,
- * or after it has been aborted or committed.
+ * If the receiver isn't listening yet, or the connection is lost, the
+ * thread keeps trying again, once a second, and starts afresh (with the
+ * whole state) each time it gets through.
  *
- * Returns 0 if the abort succeeds, or a negative value if it fails.
- * The negative value will be ``-errno``, giving an indication of why the
- * function failed.
+ * Unsubscribing from the state stops sending it. A state can only be sent
+ * to one place (or received from one), but a receiving host can send the
+ * state on, from another subscription to it.
+ *
+ * Returns 0 if it succeeds, -EBUSY if the state is already being sent or
+ * received, or -EINVAL if it is not subscribed or ``address`` is not valid.
  */
-extern int kstate_abort_transaction(kstate_transaction_p  transaction)
+extern int kstate_replicate_state(kstate_state_p  state,
+                                  const char     *address,
+                                  uint32_t        interval_ms)
 {
-  if (transaction == NULL) {     // What did they expect us to do?
-    fprintf(stderr, "!!! kstate_abort_transaction: Cannot abort NULL transaction\n");
-    return -EINVAL;
-  }
-  if (!kstate_transaction_is_active(transaction)) {
-    fprintf(stderr, "!!! kstate_abort_transaction: transaction is not active\n");
-    kstate_print_transaction(stderr, "!!! ", transaction, true);
-    return -EINVAL;
-  }
-
-  kstate_print_transaction(stdout, "Aborting ", transaction, true);
-
-  int rv = clear_transaction("kstate_abort_transaction", transaction);
-  return rv;
+  int rv = start_replication("kstate_replicate_state", state, true,
+                             address, interval_ms);
+  return rv < 0 ? rv : 0;
 }
 
 /*
- * Commit a transaction.
+ * Receive a state from another host, as it changes.
  *
- * - ``transaction`` is the transaction to commit.
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``address`` is where to listen, as "host:port" (as for
+ *   kstate_replicate_state). The host may be left out (":port") to listen
+ *   on all addresses, and the port may be 0, to listen on any free port.
  *
- * After this, the content of the transaction datastructure will have been
- * unset/freed.
+ * A thread listens for a connection from kstate_replicate_state on another
+ * host, and commits each update it is sent to the state, so that anyone
+ * using the state on this host sees it change just as if it were being
+ * changed here. It takes one connection at a time, and if that connection
+ * is lost, waits for another. The sender's state must be the same size
+ * as ours.
  *
- * It is not allowed to commit a transaction that has not been started.
- * In other words, you cannot commit a transaction before it has been started,
- * or after it has been aborted or committed.
+ * The updates are committed with kstate_transaction_using_fn, which tries
+ * again if someone here commits to the state at the same time - but any
+ * such change is then only kept where the sender's updates don't touch it.
  *
- * It is also not allowed to commit a read-only transaction (such must be
- * aborted).
+ * Unsubscribing from the state stops receiving it.
  *
- * Returns 0 if the commit succeeds, or a negative value if it fails.
- * The negative value will be ``-errno``, giving an indication of why the
- * function failed.
+ * Returns the port that is being listened on, if it succeeds, or -EBUSY if
+ * the state is already being sent or received, -EINVAL if it is not
+ * subscribed for write or ``address`` is not valid, or another negative
+ * value (``-errno``) if it fails.
  */
-extern int kstate_commit_transaction(struct kstate_transaction  *transaction)
+extern int kstate_receive_state(kstate_state_p  state,
+                                const char     *address)
 {
-  if (transaction == NULL) {    // What did they expect us to do?
-    fprintf(stderr, "!!! kstate_commit_transaction: Cannot commit NULL transaction\n");
-    return -EINVAL;
-  }
-  if (!kstate_transaction_is_active(transaction)) {
-    fprintf(stderr, "!!! kstate_commit_transaction: transaction is not active\n");
-    kstate_print_transaction(stderr, "!!! ", transaction, true);
+  if (kstate_state_is_subscribed(state) &&
+      !(state->permissions & KSTATE_WRITE)) {
+    LOG_ERROR("kstate_receive_state: state is not subscribed for write\n");
     return -EINVAL;
   }
-
-  if (!(transaction->permissions & KSTATE_WRITE)) {
-    fprintf(stderr, "!!! kstate_commit_transaction: Cannot commit a read-only transaction\n");
-    kstate_print_transaction(stderr, "!!! ", transaction, true);
-    return -EPERM;
-  }
-
-  kstate_print_transaction(stdout, "Committing ", transaction, true);
-
-  int retcode = 0;
-
-  // We can commit if the state has not changed from our idea of its original
-  // value - i.e., it is as if no-one else has altered it.
-  //
-  // (Presumably, someone altering it and putting it back again while we
-  // weren't looking is not our problem.)
-  //
-  // If someone else has changed the state, then we're meant to fail.
-  //
-  // Maybe if we were nice we'd also check to see if we're trying to change
-  // it to the same thing as someone else has already set it to (!) - we
-  // could conveivably be trying to update <data> to the same value
-  if (memcmp(transaction->state_map_addr, transaction->state_map_copy, transaction->map_length)) {
-    fprintf(stderr, "!!! kstate_commit_transaction: Cannot commit as ");
-    kstate_print_transaction(stderr, "the underlying state for ", transaction, false);
-    fprintf(stderr, " has changed during the transaction\n");
-    retcode = -EPERM;
-  } else if (memcmp(transaction->state_map_addr, transaction->map_addr, transaction->map_length)) {
-    fprintf(stderr, "... kstate_commit_transaction: OK to commit as ");
-    kstate_print_transaction(stderr, "the underlying state for ", transaction, false);
-    fprintf(stderr, " did not change during the transaction\n");
-    memcpy(transaction->state_map_addr, transaction->map_addr, transaction->map_length);
-    retcode = 0;
-  } else {
-    fprintf(stderr, "... kstate_commit_transaction: No need to commit, as ");
-    kstate_print_transaction(stderr, "the underlying state for ", transaction, false);
-    fprintf(stderr, " matches the result of the transaction\n");
-    retcode = 0;
-  }
-
-  int rv = clear_transaction("kstate_commit_transaction", transaction);
-  if (retcode)
-    return retcode;
-  else
-    return rv;
+  return start_replication("kstate_receive_state", state, false, address, 0);
 }
 
 // vim: set tabstop=8 softtabstop=2 shiftwidth=2 expandtab:
@@ -40,20 +40,120 @@ extern "C" {
 enum kstate_permissions {
   KSTATE_READ=1,          // The state may be read
   KSTATE_WRITE=2,         // The state may be written
+  KSTATE_LAZY=4,          // A write transaction only copies what it alters
 };
 typedef enum kstate_permissions kstate_permissions_t;
 
+// How a state's shared memory should be mapped (see kstate_set_mapping)
+enum kstate_mapping {
+  KSTATE_MAP_POPULATE=1,  // Fault all of it in when subscribing
+  KSTATE_MAP_LOCKED=2,    // and lock it into memory, so it stays there
+};
+
 // The maximum length of a state name. We expect this to be 255 - len("/kstate."),
 // since we put that on the start of the shared memory object name corresponding
 // to our state.
 #define KSTATE_NAME_PREFIX_LEN        8
 #define KSTATE_MAX_NAME_LEN           (NAME_MAX - KSTATE_NAME_PREFIX_LEN)
 
+// The maximum size of a state's data, in bytes
+#define KSTATE_MAX_SIZE               (1U << 30)
+
+// The maximum number of versions a state's history may hold
+#define KSTATE_MAX_HISTORY            (1U << 16)
+
+// The maximum number of states a single transaction may be on
+#define KSTATE_MAX_TRANSACTION_STATES 8
+
 typedef struct kstate_state *kstate_state_p;
 typedef struct kstate_transaction *kstate_transaction_p;
+typedef struct kstate_batch *kstate_batch_p;
+
+// A function to be called within a transaction by kstate_transaction_using_fn.
+// 'ptr' is the transaction's pointer to the state data, and 'data' is
+// whatever was passed to kstate_transaction_using_fn. It should return 0 if
+// the transaction should be committed, or any other value to abort it.
+typedef int (*kstate_transaction_fn_t)(kstate_transaction_p  transaction,
+                                       void                 *ptr,
+                                       void                 *data);
+
+// A function to wait before retrying a transaction, after 'retries' retries
+// so far (so it is 0 before the first retry).
+typedef void (*kstate_backoff_fn_t)(uint32_t retries, void *data);
+
+// How kstate_transaction_using_fn should retry
+struct kstate_retry {
+  uint32_t             max_retries;   // How many times to retry, at most
+  kstate_backoff_fn_t  backoff;       // NULL means kstate_default_backoff
+  void                *backoff_data;  // Passed to 'backoff'
+  uint32_t             retries;       // Set to how many times we did retry
+};
+
+// The number of buckets in a state's latency histogram. Bucket 0 counts
+// transactions that took less than a microsecond, bucket N those that took
+// at least 2**(N-1) and less than 2**N microseconds, and the last bucket
+// all the rest.
+#define KSTATE_STATS_LATENCY_BUCKETS  20
+
+// Statistics for a state, as returned by kstate_get_state_stats. These are
+// kept in the state's shared memory, and count what everyone (in any
+// process) has done with the state since it was created.
+struct kstate_stats {
+  uint64_t   commits;       // Transactions committed that altered the state
+  uint64_t   noop_commits;  // Transactions committed that didn't alter it
+  uint64_t   conflicts;     // Commits that failed, as someone else got there first
+  uint64_t   aborts;        // Write transactions aborted
+  uint64_t   busy;          // Write transactions not started, as no slot was free
+  uint64_t   retries;       // Retries by kstate_transaction_using_fn
+  uint64_t   subscribers;   // How many are subscribed to the state now
+  uint64_t   readers;       // How many read transactions are active now
+  // Write transactions committed, by time from start to commit
+  uint64_t   latency[KSTATE_STATS_LATENCY_BUCKETS];
+};
+
+// How much kstate logs, as set by kstate_set_log_level
+enum kstate_log_level {
+  KSTATE_LOG_NONE=0,      // Log nothing
+  KSTATE_LOG_ERROR=1,     // Log errors (the default)
+  KSTATE_LOG_INFO=2,      // Also log things that are odd, but not errors
+  KSTATE_LOG_DEBUG=3,     // Also log each subscription and transaction
+};
+typedef enum kstate_log_level kstate_log_level_t;
+
+// A function to be called with each message kstate logs, as set by
+// kstate_set_log_fn. 'message' has no trailing newline.
+typedef void (*kstate_log_fn_t)(kstate_log_level_t  level,
+                                const char         *message,
+                                void               *data);
 
 // -------- TEXT AFTER THIS AUTOGENERATED - DO NOT EDIT --------
-// Autogenerated by extract_hdrs.py on 2013-01-29 (Tue 29 Jan 2013) at 16:15
+// Autogenerated by extract_hdrs.py on 2026-10-14 (Wed 14 Oct 2026) at 14:34
+
+/*
+ * Set which messages kstate logs.
+ *
+ * 'level' is one of KSTATE_LOG_NONE (log nothing), KSTATE_LOG_ERROR (the
+ * default), KSTATE_LOG_INFO or KSTATE_LOG_DEBUG (log each subscription and
+ * transaction as it happens). Each level includes those before it.
+ *
+ * Messages above KSTATE_LOG_MAX_LEVEL are never logged, as they were not
+ * compiled in.
+ *
+ * Returns the previous level.
+ */
+extern int kstate_set_log_level(int level);
+
+/*
+ * Set a function to be called with each message kstate logs, instead of
+ * writing it to stderr or stdout.
+ *
+ * 'fn' is called with the level of the message, the message itself (with no
+ * prefix or trailing newline) and 'data'. It may be called from any thread
+ * using kstate, and must not call kstate itself.
+ *
+ * If 'fn' is NULL, messages go back to stderr and stdout.
+ */
+extern void kstate_set_log_fn(kstate_log_fn_t fn, void *data);
 
 /*
  * Return a unique valid state name starting with prefix.
@@ -104,6 +204,73 @@ extern const char *kstate_get_transaction_name(kstate_transaction_p transaction)
  */
 extern uint32_t kstate_get_state_permissions(kstate_state_p state);
 
+/*
+ * Return the size of a state's data, in bytes, or 0 if it is not subscribed.
+ */
+extern size_t kstate_get_state_size(kstate_state_p state);
+
+/*
+ * Return a state's change count, or 0 if it is not subscribed.
+ *
+ * The change count is incremented each time a transaction on the state is
+ * committed (by anyone). It wraps around, so only compare it for equality.
+ * See kstate_wait_for_state_change.
+ */
+extern uint32_t kstate_get_state_changes(kstate_state_p state);
+
+/*
+ * Get a state's statistics.
+ *
+ * - ``state`` is the state, which may be subscribed for read or write.
+ * - ``stats`` is filled in with the state's statistics.
+ *
+ * The statistics are kept in the state's shared memory, so they count what
+ * all the subscribers to the state (in any process) have done with it. A
+ * transaction on several states counts towards each of their statistics.
+ * Each count is read atomically, but they are not all read at the
+ * same instant, so they may not quite add up whilst the state is busy.
+ *
+ * A process that crashes during a read transaction leaves 'readers' counting
+ * it. A process that crashes whilst subscribed is taken off 'subscribers'
+ * when someone next subscribes to the state.
+ *
+ * If the library was built with KSTATE_STATS defined as 0, then the
+ * statistics are all zero.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is not subscribed.
+ */
+extern int kstate_get_state_stats(kstate_state_p       state,
+                                  struct kstate_stats *stats);
+
+/*
+ * Wait for a state to change.
+ *
+ * - ``state`` is the state to wait on.
+ * - ``changes`` is the change count the caller has already seen, as returned
+ *   by kstate_get_state_changes.
+ * - ``timeout_ms`` is how long to wait, in milliseconds, or a negative
+ *   number to wait for as long as it takes.
+ *
+ * This returns as soon as the state's change count is not ``changes`` -
+ * that is, as soon as a transaction has been committed since the caller
+ * looked - which may be immediately. It does not busy-wait. So a consumer
+ * might do::
+ *
+ *     uint32_t changes = kstate_get_state_changes(state);
+ *     for (;;) {
+ *       // look at the state...
+ *       kstate_wait_for_state_change(state, changes, -1);
+ *       changes = kstate_get_state_changes(state);
+ *     }
+ *
+ * Returns 0 if the state has changed, -ETIMEDOUT if it did not change in
+ * time, -EINTR if the wait was interrupted by a signal, or another negative
+ * value (``-errno``) if it fails.
+ */
+extern int kstate_wait_for_state_change(kstate_state_p  state,
+                                        uint32_t        changes,
+                                        int             timeout_ms);
+
 /*
  * Return a transaction's permissions, or 0 if it is not active.
  */
@@ -133,11 +300,73 @@ extern uint32_t kstate_get_transaction_id(kstate_transaction_p transaction);
  * Note that this is always a pointer to read-only shared memory, as
  * one must use a transaction to write.
  *
+ * The pointer is to the current version of the state's data. Committing a
+ * transaction makes a new version current (at a different address), so call
+ * this again to see the result of a commit. Once a version is no longer
+ * current, its memory may be reused for a later version at any time, so use
+ * a transaction if you need a consistent view of the data.
+ *
+ * If the state is rate limited (see kstate_set_max_rate), then this is the
+ * version that was current at the last tick, which will stay put until the
+ * next tick.
+ *
  * Beware that this pointer stops being valid as soon as the state is
  * unsubscribed (or freed, which implicitly unsubscribes it).
  */
 extern void *kstate_get_state_ptr(kstate_state_p state);
 
+/*
+ * Start reading a state's data directly, without a transaction.
+ *
+ * - ``state`` is the state, which may be subscribed for read or write.
+ * - ``token`` is set to a token for the version being read, to be passed
+ *   to kstate_read_retry.
+ *
+ * Returns a pointer to the current version of the state's data, in the
+ * (read-only) shared memory, or NULL if the state is not subscribed.
+ *
+ * This doesn't pin the version, so it costs no more than a couple of loads,
+ * and doesn't write to the shared memory at all - but the version may be
+ * reused (and overwritten) at any time after someone commits a newer one.
+ * So copy out the fields wanted, and then call kstate_read_retry to check
+ * that they were all read from the same version::
+ *
+ *     uint64_t token;
+ *     const struct my_data *data;
+ *     uint32_t a, b;
+ *     do {
+ *       data = kstate_read_begin(state, &token);
+ *       a = data->a;
+ *       b = data->b;
+ *     } while (kstate_read_retry(state, token));
+ *
+ * Until kstate_read_retry has said the values are good, don't act on them
+ * (in particular, don't follow any offsets or pointers they contain without
+ * checking them first), as they may be a mixture of two versions, or
+ * partially written.
+ *
+ * If the state is rate limited (see kstate_set_max_rate), then this reads
+ * the version that was current at the last tick, which is pinned and so
+ * doesn't need retrying (unless there is a new tick in the meantime).
+ */
+extern const void *kstate_read_begin(kstate_state_p  state,
+                                     uint64_t       *token);
+
+/*
+ * Check whether data read since kstate_read_begin needs to be read again.
+ *
+ * - ``state`` is the state, as given to kstate_read_begin.
+ * - ``token`` is the token that kstate_read_begin returned.
+ *
+ * Returns false if the version that kstate_read_begin returned was current
+ * the whole time since then - in which case no-one can have written to it,
+ * and everything read from it is consistent. Returns true if the data must
+ * be read again (starting with another call of kstate_read_begin), or if the
+ * state is not subscribed.
+ */
+extern bool kstate_read_retry(kstate_state_p  state,
+                              uint64_t        token);
+
 /*
  * Return a transaction's shared memory pointer, or NULL if it is not active.
  *
@@ -149,6 +378,20 @@ extern void *kstate_get_state_ptr(kstate_state_p state);
  */
 extern void *kstate_get_transaction_ptr(kstate_transaction_p transaction);
 
+/*
+ * Return a transaction's shared memory pointer for one of the states it is
+ * on, or NULL if it is not active, or not on that state.
+ *
+ * This is the same as kstate_get_transaction_ptr for the state the
+ * transaction was started on, and is how to get at the data for any state
+ * added with kstate_add_state_to_transaction.
+ *
+ * Beware that this pointer stops being valid as soon as the transaction is
+ * committed or aborted (or freed, which implicitly aborts it).
+ */
+extern void *kstate_get_transaction_state_ptr(kstate_transaction_p  transaction,
+                                              kstate_state_p        state);
+
 /*
  * Print a representation of 'state' on output 'stream'.
  *
@@ -195,6 +438,13 @@ extern void kstate_print_transaction(FILE                 *stream,
  *
  * After which it can safely be reused, if you wish.
  *
+ * Once a state is subscribed, any number of threads may use it at the same
+ * time, to start and commit transactions on it, get pointers to its data
+ * or wait for it to change. Subscribing, unsubscribing and freeing a state,
+ * and the 'kstate_set_...' functions, must not be called while any other
+ * thread is using that state. If the state is rate limited, the version
+ * it is showing moves on for all of the threads at once.
+ *
  * Returns the new state, or NULL if there was insufficient memory.
  */
 extern kstate_state_p kstate_new_state(void);
@@ -207,6 +457,366 @@ extern kstate_state_p kstate_new_state(void);
  */
 extern void kstate_free_state(kstate_state_p *state);
 
+/*
+ * Set the size of a state's data, in bytes.
+ *
+ * This must be done before subscribing to the state. If the subscription
+ * creates the state, it will be this size. Otherwise, the state must already
+ * be this size, or subscribing will fail.
+ *
+ * If this is not called, a new state is one page in size, and subscribing
+ * to an existing state accepts whatever size it is.
+ *
+ * States of KSTATE_HUGE_PAGE_SIZE (2MB) or more are laid out so that they can
+ * be backed by huge pages, and ask the kernel to do so (whether it does
+ * depends on how transparent huge pages are configured for shared memory).
+ * Note that creating a state makes room for several versions of its data.
+ *
+ * A state in an arena (see kstate_set_arena) is laid out differently, and
+ * must be the same size as the other states in its arena.
+ *
+ * Unsubscribing from the state forgets the size.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or the size is 0 or more than KSTATE_MAX_SIZE.
+ */
+extern int kstate_set_size(kstate_state_p  state,
+                           size_t          size);
+
+/*
+ * Limit how often a state is seen to change.
+ *
+ * - ``state`` is the state, which may or may not be subscribed yet.
+ * - ``max_rate`` is the maximum number of times per second that the state
+ *   should appear to change, or 0 for no limit (the default).
+ *
+ * When a state is rate limited, kstate_get_state_ptr and
+ * kstate_get_state_changes show the version of the state that was current at
+ * the state's last "tick", and only move on to a newer version when the next
+ * tick is due - so it is as if the state were being updated at most that
+ * often. Likewise kstate_wait_for_state_change does not return (successfully)
+ * until the next tick. Transactions are not affected.
+ *
+ * Note that keeping the version from the last tick uses up one of the
+ * state's version slots (see kstate_start_transaction).
+ *
+ * Unsubscribing from the state forgets the rate limit.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if ``state`` is NULL.
+ */
+extern int kstate_set_max_rate(kstate_state_p  state,
+                               uint32_t        max_rate);
+
+/*
+ * Make a state persistent, backed by a file.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``filename`` is the file that holds the state.
+ *
+ * This must be done before subscribing to the state. When it is subscribed,
+ * the file is mapped instead of a shared memory object - so everyone who
+ * wants to share the state must make it persistent with the same file. If
+ * subscribing for write and the file doesn't exist, it is created (and the
+ * state is set up as for a new state, with whatever size was given to
+ * kstate_set_size). Otherwise the file is mapped as it is, and the state
+ * carries on from the version that was current when it was last used - so
+ * starting up again is just a matter of mapping the file.
+ *
+ * Unsubscribing from a persistent state does not remove the file.
+ *
+ * Committing a transaction does not wait for the state to be written to the
+ * file. Instead, each write subscriber to a persistent state has a thread
+ * that flushes it in the background, by default once a second (see
+ * kstate_set_flush), and kstate_sync can be used to flush it explicitly.
+ * Stopping a process (or losing power) after a commit but before the next
+ * flush may leave the file without that commit. If the machine itself stops
+ * part way through writing back a version, the file may hold a mixture of
+ * that version and the previous one.
+ *
+ * Unsubscribing from the state forgets that it was persistent.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * if ``filename`` is NULL or empty, if the state has already been made
+ * persistent with a different file, or if it is journaled or in an arena.
+ */
+extern int kstate_set_persistent(kstate_state_p  state,
+                                 const char     *filename);
+
+/*
+ * Say how often a persistent state should be flushed to its file.
+ *
+ * - ``state`` is the state, which must have been made persistent with
+ *   kstate_set_persistent, and not subscribed yet.
+ * - ``interval_ms`` is the longest (in milliseconds) that a commit should
+ *   wait to be flushed, or 0 for no limit.
+ * - ``commits`` is how many commits to allow before flushing, or 0 for no
+ *   limit.
+ *
+ * The state is flushed (in the background) when either limit is reached,
+ * as long as there has been a commit since it was last flushed. If both are
+ * 0, it is only flushed by kstate_sync, and when the subscription ends.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is not persistent or is
+ * already subscribed.
+ */
+extern int kstate_set_flush(kstate_state_p  state,
+                            uint32_t        interval_ms,
+                            uint32_t        commits);
+
+/*
+ * Flush a persistent state to its file now.
+ *
+ * - ``state`` is the state, which must be subscribed.
+ *
+ * When this returns, the version of the state that was current when it was
+ * called has been written to the file. For a journaled state (see
+ * kstate_set_journal) this instead waits for the journal to catch up. For a
+ * state that is neither, there is nothing to do.
+ *
+ * Returns 0 if it succeeds, -EINVAL if the state is not subscribed, or
+ * another negative value (``-errno``) if writing to the file fails.
+ */
+extern int kstate_sync(kstate_state_p  state);
+
+/*
+ * Journal a state to a file.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``filename`` is the journal file. A checkpoint is also kept, in the same
+ *   place with ".checkpoint" appended to the name.
+ * - ``checkpoint_records`` is how many records to write to the journal
+ *   before writing a new checkpoint and starting the journal afresh, or 0
+ *   for the default (1000).
+ *
+ * This must be done before subscribing to the state. The subscription then
+ * has a thread which, each time the state changes, appends to the journal
+ * the parts of the state that are different from the last version it wrote,
+ * and flushes it. Committing doesn't wait for that, and if several commits
+ * happen whilst the thread is writing, the next record covers all of them.
+ * Use kstate_sync to wait for the journal to catch up.
+ *
+ * If the subscription creates the state, its data is first restored from
+ * the checkpoint and journal. In any case, journaling starts with a
+ * checkpoint of the current version. The state itself is an ordinary shared
+ * memory object, so this is an alternative to kstate_set_persistent, which
+ * suits states updated often in small pieces. kstate_read_journal can
+ * reconstruct the state as it was at any time since the last checkpoint.
+ *
+ * Only one subscriber (in any process) may journal a state to a given file
+ * at a time - subscribing fails with -EBUSY for any others. Its journal
+ * includes commits made by everyone.
+ *
+ * Unsubscribing from the state forgets the journal (after it has caught
+ * up).
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * ``filename`` is NULL or empty, or the state has been made persistent or
+ * put in an arena.
+ */
+extern int kstate_set_journal(kstate_state_p  state,
+                              const char     *filename,
+                              uint32_t        checkpoint_records);
+
+/*
+ * Reconstruct a journaled state as it was at a particular time.
+ *
+ * - ``filename`` is the journal file, as given to kstate_set_journal.
+ * - ``until_ns`` is the time, as nanoseconds since the epoch (so
+ *   CLOCK_REALTIME). Use UINT64_MAX for the latest version journaled.
+ * - ``data`` is where to put the state's data, and ``size`` is its size,
+ *   which must be the size of the state.
+ *
+ * This gives the last version journaled at or before ``until_ns``. The state
+ * need not be subscribed, and the journal may still be being written.
+ *
+ * Returns 0 if it succeeds, -EINVAL if ``size`` is not the size of the state
+ * that was journaled, -ERANGE if the last checkpoint is later than
+ * ``until_ns``, or another negative value (``-errno``) if it fails.
+ */
+extern int kstate_read_journal(const char *filename,
+                               uint64_t    until_ns,
+                               void       *data,
+                               size_t      size);
+
+/*
+ * Say how a state's shared memory should be mapped.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``mapping`` is constructed by OR'ing the flags KSTATE_MAP_POPULATE and
+ *   KSTATE_MAP_LOCKED, or is 0 for the default.
+ *
+ * By default, a state's shared memory is faulted in a page at a time, as it
+ * is first used, and the kernel may page it out again. That makes the first
+ * access to each page, after subscribing, slower than the rest - which
+ * matters to anyone who needs each access to take much the same time.
+ *
+ * With KSTATE_MAP_POPULATE, subscribing to the state faults in all of its
+ * shared memory (all of its versions, and its history if it has one), so
+ * subscribing takes longer, but nothing using it afterwards has to wait for
+ * a page to be found.
+ *
+ * KSTATE_MAP_LOCKED also locks it into memory (and implies
+ * KSTATE_MAP_POPULATE), so that it stays there. How much memory a process
+ * may lock is limited (see RLIMIT_MEMLOCK), and subscribing fails if the
+ * state won't fit. KSTATE_LAZY is ignored for transactions on a state with
+ * locked mappings, as a lazy transaction takes a page fault for each page
+ * it writes to. Other transactions use the state's version slots, which are
+ * already faulted in, and don't map anything.
+ *
+ * A state in an arena cannot be given mapping flags.
+ *
+ * Unsubscribing from the state forgets its mapping flags.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena, or ``mapping`` has flags other than those.
+ */
+extern int kstate_set_mapping(kstate_state_p  state,
+                              uint32_t        mapping);
+
+/*
+ * Give a state a replica of its data on each NUMA node.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``replicas`` says whether the state should have replicas.
+ *
+ * On a host with several NUMA nodes, a reader on a different node from the
+ * memory holding the state pays for the distance on every access, and the
+ * writer's cache lines bounce between the nodes. A state with replicas has a
+ * copy of its version slots for each node, placed on that node (with
+ * mbind), and each commit copies the version it is making current into
+ * every replica before anyone can see it. Subscribing picks the replica on
+ * the node the subscribing thread is running on, and the state's pointers
+ * and read transactions then look at that - so readers only ever read
+ * memory local to them (as long as they stay on that node), at the cost of
+ * one copy of the state data per node for each commit, and a set of slots'
+ * worth of memory per node.
+ *
+ * Whoever creates the state decides whether it has replicas, and how many
+ * nodes it has them for (all those the host may have). Subscribing to an
+ * existing state after asking for replicas fails if it has none, and
+ * subscribing without calling this accepts whatever the state has. A host
+ * with a single node still gets one replica, which works just the same, but
+ * gains nothing.
+ *
+ * A state in an arena cannot have replicas.
+ *
+ * Unsubscribing from the state forgets that replicas were asked for.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena.
+ */
+extern int kstate_set_replicas(kstate_state_p  state,
+                               bool            replicas);
+
+/*
+ * Keep a history of a state's recent versions.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``entries`` is how many of the most recently committed versions the
+ *   history should hold, or 0 for no history (the default). It may be at
+ *   most KSTATE_MAX_HISTORY.
+ *
+ * Each commit to a state with a history also copies the version it makes
+ * current into the history, tagged with the state's change count after the
+ * commit (as kstate_get_state_changes would return). So a reader that needs
+ * to see every change, and not just the latest, can use kstate_read_history
+ * to read each version in turn, as long as it doesn't fall more than
+ * ``entries`` commits behind.
+ *
+ * The history is kept in the state's shared memory object, after its
+ * version slots, so each entry costs about as much memory as the state data
+ * itself. Subscribing to an existing state after giving a different number
+ * of entries fails, and subscribing without calling this accepts whatever
+ * history the state already has.
+ *
+ * A state in an arena cannot have a history.
+ *
+ * Unsubscribing from the state forgets the history length.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * or in an arena, or ``entries`` is more than KSTATE_MAX_HISTORY.
+ */
+extern int kstate_set_history(kstate_state_p  state,
+                              uint32_t        entries);
+
+/*
+ * Read the next version of a state from its history.
+ *
+ * - ``state`` is the state, which must be subscribed, and have a history
+ *   (see kstate_set_history).
+ * - ``changes`` is the change count of the last version the caller has
+ *   seen. Start with the value of kstate_get_state_changes to see every
+ *   change from then on. If we succeed, it is incremented.
+ * - ``data`` and ``size`` are where to put the version, which must have room
+ *   for the whole of the state data (kstate_get_state_size).
+ *
+ * This copies the version committed after the one ``changes`` says the
+ * caller last saw - the version with change count ``changes + 1``. Calling
+ * it repeatedly walks through every committed version in turn. Commits that
+ * didn't alter the state (and so didn't change its change count) don't
+ * appear in the history. Rate limiting (kstate_set_max_rate) doesn't affect
+ * the history.
+ *
+ * Returns 0 if it succeeds, -EAGAIN if there is no newer version yet (so
+ * wait with kstate_wait_for_state_change, and try again), or -EINVAL if the
+ * state has no history or ``data`` is too small. If the version has already
+ * been overwritten, because the caller fell more than the history's length
+ * behind, it returns -EOVERFLOW, and sets ``changes`` so that calling it again
+ * carries on from the oldest version the history still holds.
+ */
+extern int kstate_read_history(kstate_state_p  state,
+                               uint32_t       *changes,
+                               void           *data,
+                               size_t          size);
+
+/*
+ * Put a state in an arena, instead of giving it a shared memory object of
+ * its own.
+ *
+ * - ``state`` is the state, which must not be subscribed yet.
+ * - ``arena`` is the name of the arena, which follows the same rules as a
+ *   state name.
+ * - ``max_states`` is how many states the arena should have room for, if
+ *   subscribing creates it, or 0 for the default of 1024. It may be at most
+ *   1048576.
+ *
+ * An arena holds many small states in one shared memory object, which each
+ * process maps once, however many of its states it subscribes to. So
+ * subscribing to a state in an arena that is already mapped is just a
+ * matter of looking its name up in the arena's index. Transactions on the
+ * state work just as for any other state. Each process maps the states'
+ * data read-only, apart from the pages holding the states it has subscribed
+ * to for write.
+ *
+ * Each state in an arena has the same size. That is taken from the state
+ * that creates the arena (see kstate_set_size), or is 64 bytes by default.
+ * Subscribing to a state in an existing arena after giving a different size
+ * fails. The name of a state in an arena may be at most 55 characters long.
+ *
+ * The first write subscription to a state adds it to the arena, creating the
+ * arena if necessary. States are never removed from an arena, so once it is
+ * full (which gives -ENOSPC), no more states can be added to it. The arena
+ * itself is removed when the last process using it has unsubscribed from
+ * all its states.
+ *
+ * A state in an arena cannot be made persistent or journaled, keep a
+ * history, or be given mapping flags (see kstate_set_mapping). KSTATE_LAZY
+ * is ignored for transactions on states in an arena. If a process dies
+ * whilst using states in an arena, the versions it had pinned are released
+ * by the next process that runs out of free slots for one of them, just as
+ * for any other state - as long as it had no more than 32 different versions
+ * (of all the arena's states) pinned at once.
+ *
+ * Unsubscribing from the state forgets the arena.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the state is already subscribed,
+ * ``arena`` is not a valid name, ``max_states`` is too large, or the state
+ * has been made persistent or journaled or given a history or mapping flags.
+ */
+extern int kstate_set_arena(kstate_state_p  state,
+                            const char     *arena,
+                            uint32_t        max_states);
+
 /*
  * Subscribe to a state.
  *
@@ -227,6 +837,13 @@ extern void kstate_free_state(kstate_state_p *state);
  * nothing to read -i.e., the first subscription to a state must be for
  * KSTATE_WRITE|KSTATE_READ.
  *
+ * A state can have at most 64 subscriptions at once, counting those in all
+ * processes, after which subscribing fails with -EUSERS. Subscribing also
+ * tidies up after any subscribers whose processes have died without
+ * unsubscribing, releasing the versions of the state they were using. A
+ * child of fork() should subscribe for itself, as using its parent's
+ * subscription counts as its parent using it.
+ *
  * Returns 0 if the subscription succeeds, or a negative value if it fails.
  * The negative value will be ``-errno``, giving an indication of why the
  * function failed.
@@ -248,6 +865,10 @@ extern int kstate_subscribe_state(kstate_state_p         state,
  * information, and are not affected by this function - i.e., the state can
  * still be accessed via any transactions that are still open on it.
  *
+ * When the last subscriber to a state has unsubscribed (and any transactions
+ * on it have finished), the state's shared data is removed - unless it is
+ * persistent, in which case its file is left for next time.
+ *
  * Returns 0 if the unsubscription succeeds, or a negative value if it fails.
  * The negative value will be ``-errno``, giving an indication of why the
  * function failed.
@@ -271,6 +892,12 @@ extern void kstate_unsubscribe_state(kstate_state_p  state);
  *     }
  *     kstate_free_transaction(&transaction);
  *
+ * A transaction that has been committed or aborted may be started again,
+ * as many times as is wanted, before it is freed. Neither starting nor
+ * ending a transaction allocates (or maps) any memory, so a loop that
+ * repeatedly starts, alters and commits the same transaction does no
+ * allocations at all.
+ *
  * Returns the new transaction, or NULL if there was insufficient memory.
  */
 extern struct kstate_transaction *kstate_new_transaction(void);
@@ -295,13 +922,33 @@ extern void kstate_free_transaction(kstate_transaction_p *transaction);
  * - 'permissions' is constructed by OR'ing the permission flags
  *   KSTATE_READ and/or KSTATE_WRITE. At least one of those must be given.
  *   KSTATE_WRITE by itself is regarded as equivalent to KSTATE_WRITE|KSTATE_READ.
+ *   KSTATE_LAZY may also be given, and is ignored for read transactions.
  *
- * Note that copy of the state will be taken, so that the transaction
- * can continue to access the state's shared memory even if the particular
- * 'state' is unsubscribed. However, this is not enough information to
- * reconstruct/return the entirety of the original 'state', as we do not
- * (for instance) remember the shared memory object used internally as an
- * intermediary when creating a state.
+ * The transaction uses the state's own mapping of its shared memory, rather
+ * than mapping it again, but keeps that mapping in use until the transaction
+ * ends, so that the transaction can continue to access the state's shared
+ * memory even if the particular 'state' is unsubscribed.
+ *
+ * A read transaction looks directly at the version of the state that was
+ * current when it started, which will not be changed or reused until the
+ * transaction ends - so there's no copying involved.
+ *
+ * A write transaction needs a free version slot in the state's shared
+ * memory to work in. There are a limited number of those, so if too many
+ * transactions (in any process) are writing to the same state at the same
+ * time, starting another will fail with -EAGAIN. Try again later. Note that
+ * read transactions that are still looking at old versions of the state
+ * also keep those versions' slots in use.
+ *
+ * A write transaction normally starts by copying the current version of the
+ * state into its slot. If KSTATE_LAZY is given, it instead maps the current
+ * version privately (copy-on-write), so that only the pages it actually
+ * writes to get copied, and copies its result into its slot when it commits.
+ * That costs a mapping per transaction, so is worth it for large states, or
+ * for transactions that often look at the state and then don't change it.
+ * For states of 256KB or more, the result is copied into the slot as it is
+ * compared with the original, using non-temporal stores where the CPU has
+ * them, so that the commit reads the result once, and doesn't fill the cache.
  *
  * Returns 0 if starting the transaction succeeds, or a negative value if it
  * fails. The negative value will be ``-errno``, giving an indication of why
@@ -311,13 +958,71 @@ extern int kstate_start_transaction(kstate_transaction_p  transaction,
                                     kstate_state_p        state,
                                     uint32_t              permissions);
 
+/*
+ * Add another state to a transaction.
+ *
+ * - ``transaction`` is the (active) transaction.
+ * - ``state`` is the state to add to it. If ``transaction`` is a write
+ *   transaction, then ``state`` must be subscribed for write.
+ *
+ * A transaction may be on up to KSTATE_MAX_TRANSACTION_STATES states,
+ * including the one it was started on, and each must be a different state.
+ * Use kstate_get_transaction_state_ptr to get at the data for each of them.
+ *
+ * Committing a write transaction on several states commits all of them, or
+ * (if anyone else has committed to any of them since the transaction started
+ * on it) none of them. A read transaction on several states sees versions of
+ * the states that were all current at the same time.
+ *
+ * Since there's no point carrying on with a transaction that can't succeed,
+ * this checks the states already in the transaction, and fails with -EPERM
+ * if any of them has already changed (or is being committed to). The
+ * transaction is still active, with the states it already had, and should
+ * be aborted.
+ *
+ * Returns 0 if it succeeds, -EPERM as above, -EAGAIN if there is no free
+ * version slot for a write transaction (see kstate_start_transaction), or
+ * another negative value (``-errno``) if it fails.
+ */
+extern int kstate_add_state_to_transaction(kstate_transaction_p  transaction,
+                                           kstate_state_p        state);
+
+/*
+ * Say which part of the state data a write transaction has altered.
+ *
+ * - ``transaction`` is the write transaction.
+ * - ``offset`` is the offset of the altered bytes within the state data.
+ * - ``length`` is how many bytes were altered.
+ *
+ * The range is within the data for the state the transaction was started on,
+ * even if other states have been added to the transaction.
+ *
+ * This may be called as many times as is needed. It is an optimisation:
+ * if it is never called for a transaction, then committing the transaction
+ * has to compare all of the state data with the original version, to see if
+ * anything has changed. Once it has been called, only the parts of the data
+ * that have been marked are compared.
+ *
+ * So if it is used, every alteration must be marked - if the transaction
+ * alters bytes that have not been marked, then it is undefined whether those
+ * alterations will be committed.
+ *
+ * Returns 0 if all goes well, or a negative value if it fails - -EINVAL if
+ * the transaction is not active, or the range is not within the state data,
+ * or -EPERM if the transaction is read-only.
+ */
+extern int kstate_transaction_mark_dirty(kstate_transaction_p  transaction,
+                                         size_t                offset,
+                                         size_t                length);
+
 /*
  * Abort a transaction.
  *
  * - ``transaction`` is the transaction to abort.
  *
  * After this, the content of the transaction datastructure will have been
- * unset/freed.
+ * unset/freed, and the transaction may be started again (on the same state
+ * or another).
  *
  * It is not allowed to abort a transaction that has not been started.
  * In other words, you cannot abort a transaction before it has been started,
@@ -335,7 +1040,8 @@ extern int kstate_abort_transaction(kstate_transaction_p  transaction);
  * - ``transaction`` is the transaction to commit.
  *
  * After this, the content of the transaction datastructure will have been
- * unset/freed.
+ * unset/freed, and the transaction may be started again (on the same state
+ * or another).
  *
  * It is not allowed to commit a transaction that has not been started.
  * In other words, you cannot commit a transaction before it has been started,
@@ -349,6 +1055,231 @@ extern int kstate_abort_transaction(kstate_transaction_p  transaction);
  * function failed.
  */
 extern int kstate_commit_transaction(struct kstate_transaction  *transaction);
+
+/*
+ * The default backoff policy for kstate_transaction_using_fn.
+ *
+ * - ``retries`` is how many times the transaction has been retried so far.
+ * - ``data`` is ignored.
+ *
+ * For the first few retries this just spins (for an increasing number of
+ * iterations), on the basis that the other committer will be finished very
+ * soon. After that it yields the processor for a few retries, and after that
+ * it sleeps for a random time of up to an exponentially increasing limit
+ * (capped at a millisecond), so that writers that keep colliding spread
+ * themselves out.
+ */
+extern void kstate_default_backoff(uint32_t  retries,
+                                   void     *data);
+
+/*
+ * Run a function within a write transaction on a state, retrying if need be.
+ *
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``fn`` is the function to call. It is called with the transaction,
+ *   the transaction's pointer to the state data, and ``data``.
+ * - ``data`` is passed to 'fn'.
+ * - ``retry`` says how to retry. If it is NULL, then we don't.
+ *
+ * This starts a write transaction on the state, calls 'fn' within it, and if
+ * 'fn' returns 0 tries to commit the transaction. If 'fn' returns anything
+ * else, the transaction is aborted and that value is returned.
+ *
+ * If the commit fails because someone else committed to the state first
+ * (-EPERM), or the transaction can't be started because too many others are
+ * writing to the state (-EAGAIN), then we call the retry's backoff function
+ * and try again, calling 'fn' again on the (new) current version of the state
+ * - at most 'max_retries' times. Since 'fn' may be called more than once, it
+ * should make no changes other than to the transaction's data.
+ *
+ * If 'retry' is not NULL, its 'retries' is set to the number of times we
+ * retried, whether we succeed or not.
+ *
+ * No memory is allocated.
+ *
+ * Returns 0 if the transaction was committed, whatever 'fn' returned if that
+ * was not 0, or a negative value (``-errno``) if it fails.
+ */
+extern int kstate_transaction_using_fn(kstate_state_p           state,
+                                       kstate_transaction_fn_t  fn,
+                                       void                    *data,
+                                       struct kstate_retry     *retry);
+
+/*
+ * Create a new batch, for grouping many small updates to a state into one
+ * commit.
+ *
+ * The normal usage is::
+ *
+ *     kstate_batch_p batch = kstate_new_batch();
+ *     int ret = kstate_start_batch(batch, state, 100, 1000);
+ *
+ * and then, for each update::
+ *
+ *     ret = kstate_batch_update(batch, update_fn, &update);
+ *
+ * and eventually::
+ *
+ *     ret = kstate_flush_batch(batch);
+ *     kstate_free_batch(&batch);
+ *
+ * Returns the new batch, or NULL if there was insufficient memory.
+ */
+extern kstate_batch_p kstate_new_batch(void);
+
+/*
+ * Destroy a batch created with 'kstate_new_batch'.
+ *
+ * Any updates that have not been committed yet are discarded - call
+ * kstate_flush_batch first to keep them.
+ *
+ * If a NULL pointer is given, then it is ignored, otherwise the batch is
+ * freed and the pointer is set to NULL.
+ */
+extern void kstate_free_batch(kstate_batch_p *batch);
+
+/*
+ * Start using a batch to update a state.
+ *
+ * - ``batch`` is the batch, which must not have any updates waiting to be
+ *   committed.
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``max_updates`` is how many updates to commit together, or 0 for no
+ *   limit.
+ * - ``max_delay_us`` is how long (in microseconds) after the first update
+ *   of a batch to commit it, or 0 for no limit.
+ *
+ * Updates made with kstate_batch_update are made within a write
+ * transaction, which is committed as soon as it holds ``max_updates``
+ * updates, or is found to have been going for ``max_delay_us`` or more -
+ * or when kstate_flush_batch is called. Anyone looking at the state only
+ * ever sees whole batches. This makes far fewer commits (and wakes those
+ * waiting for the state to change far less often) than committing each
+ * update, at the cost of seeing each update a little later.
+ *
+ * How long a batch has been going is only checked when an update is made,
+ * or by kstate_poll_batch, so a writer that may go quiet for a while should
+ * call one of kstate_poll_batch or kstate_flush_batch when it does.
+ *
+ * A batch is meant for a state with one writer. If anyone else commits to
+ * the state before the batch is committed, the batch's commit fails with
+ * -EPERM, and all of its updates are lost.
+ *
+ * Returns 0 if it succeeds, or -EINVAL if the batch still has updates to
+ * commit or the state is not subscribed for write.
+ */
+extern int kstate_start_batch(kstate_batch_p  batch,
+                              kstate_state_p  state,
+                              uint32_t        max_updates,
+                              uint32_t        max_delay_us);
+
+/*
+ * Make an update to a state, as part of a batch.
+ *
+ * - ``batch`` is the batch, as set up by kstate_start_batch.
+ * - ``fn`` is the function to call to make the update. It is called with
+ *   the batch's transaction, the transaction's pointer to the state data
+ *   (which holds any earlier updates in the batch), and ``data``.
+ * - ``data`` is passed to 'fn'.
+ *
+ * If there isn't a transaction for the batch yet, one is started, and then
+ * 'fn' is called within it. If 'fn' returns 0, the update counts towards the
+ * batch, and if that makes the batch due, it is committed. 'fn' may call
+ * kstate_transaction_mark_dirty to say what it altered, which makes the
+ * commit cheaper. If 'fn' returns anything else, that value is returned, and
+ * the update doesn't count - but 'fn' mustn't have altered the data, as
+ * there is no way to undo just one update.
+ *
+ * No memory is allocated.
+ *
+ * Returns 0 if it succeeds (whether or not the batch was committed), whatever
+ * 'fn' returned if that was not 0, or a negative value (``-errno``) if
+ * starting or committing the transaction fails - see kstate_start_batch for
+ * when committing fails.
+ */
+extern int kstate_batch_update(kstate_batch_p           batch,
+                               kstate_transaction_fn_t  fn,
+                               void                    *data);
+
+/*
+ * Commit a batch's updates, if it has been going for its 'max_delay_us'.
+ *
+ * This is for a writer that may stop making updates for a while, to call
+ * every so often, so that its last few updates don't wait indefinitely.
+ *
+ * Returns 0 if it succeeds (including if there was nothing to commit yet),
+ * or a negative value (``-errno``) if the commit fails.
+ */
+extern int kstate_poll_batch(kstate_batch_p  batch);
+
+/*
+ * Commit a batch's updates now.
+ *
+ * Returns 0 if it succeeds (including if there was nothing to commit), or a
+ * negative value (``-errno``) if the commit fails.
+ */
+extern int kstate_flush_batch(kstate_batch_p  batch);
+
+/*
+ * Send a state to another host, as it changes.
+ *
+ * - ``state`` is the state, which must be subscribed (reading is enough).
+ * - ``address`` is where to send it, as "host:port", where the host is a
+ *   name, or an IPv4 address, or an IPv6 address in brackets. It should be
+ *   somewhere that kstate_receive_state is listening.
+ * - ``interval_ms`` is how often, at most, to send an update, or 0 to send
+ *   each change as soon as possible.
+ *
+ * A thread connects to the receiver over TCP, and sends it the whole state
+ * to start with, and then what has changed each time the state changes. It
+ * only ever sends the latest version: everything committed whilst it waits
+ * for ``interval_ms`` to pass, or whilst a slow link is busy with the last
+ * update, is coalesced into the next. So the receiver never falls ever
+ * further behind - it just sees fewer of the changes.
+ *
+ * If the receiver isn't listening yet, or the connection is lost, the
+ * thread keeps trying again, once a second, and starts afresh (with the
+ * whole state) each time it gets through.
+ *
+ * Unsubscribing from the state stops sending it. A state can only be sent
+ * to one place (or received from one), but a receiving host can send the
+ * state on, from another subscription to it.
+ *
+ * Returns 0 if it succeeds, -EBUSY if the state is already being sent or
+ * received, or -EINVAL if it is not subscribed or ``address`` is not valid.
+ */
+extern int kstate_replicate_state(kstate_state_p  state,
+                                  const char     *address,
+                                  uint32_t        interval_ms);
+
+/*
+ * Receive a state from another host, as it changes.
+ *
+ * - ``state`` is the state, which must be subscribed for write.
+ * - ``address`` is where to listen, as "host:port" (as for
+ *   kstate_replicate_state). The host may be left out (":port") to listen
+ *   on all addresses, and the port may be 0, to listen on any free port.
+ *
+ * A thread listens for a connection from kstate_replicate_state on another
+ * host, and commits each update it is sent to the state, so that anyone
+ * using the state on this host sees it change just as if it were being
+ * changed here. It takes one connection at a time, and if that connection
+ * is lost, waits for another. The sender's state must be the same size
+ * as ours.
+ *
+ * The updates are committed with kstate_transaction_using_fn, which tries
+ * again if someone here commits to the state at the same time - but any
+ * such change is then only kept where the sender's updates don't touch it.
+ *
+ * Unsubscribing from the state stops receiving it.
+ *
+ * Returns the port that is being listened on, if it succeeds, or -EBUSY if
+ * the state is already being sent or received, -EINVAL if it is not
+ * subscribed for write or ``address`` is not valid, or another negative
+ * value (``-errno``) if it fails.
+ */
+extern int kstate_receive_state(kstate_state_p  state,
+                                const char     *address);
 // -------- TEXT BEFORE THIS AUTOGENERATED - DO NOT EDIT --------
 
 #ifdef __cplusplus
@@ -0,0 +1,275 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS State library.
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2013
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *   Tony Ibbs <tibs@tonyibbs.co.uk>
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+// A typed C++ layer over kstate.h. It is all inline, so there is nothing
+// more to link against than the C library, and it needs C++11 or later.
+//
+// A state holds one trivially copyable struct::
+//
+//     struct Position { double x, y; uint32_t fix; };
+//
+//     kstate::State<Position> state;
+//     int rv = state.subscribe("Vehicle.Position", KSTATE_WRITE);
+//
+//     kstate::WriteTransaction<Position> write(state);
+//     if (write) {
+//       write.set(&Position::x, 1.5);
+//       write.set(&Position::fix, 3u);
+//       rv = write.commit();
+//     }
+//
+//     Position now = state.load();
+//
+// Errors are reported as they are by the C functions, as negative values
+// (``-errno``), and nothing here throws.
+
+#ifndef _KSTATE_HPP_INCLUDED_
+#define _KSTATE_HPP_INCLUDED_
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "kstate.h"
+
+namespace kstate {
+
+// Return the offset of a field within 'data'. Wherever this is inlined with
+// a constant 'field', the compiler can work this out without looking at
+// 'data' at all.
+template <typename T, typename F>
+inline size_t offset_of(const T *data, F T::*field)
+{
+  return reinterpret_cast<const char *>(&(data->*field)) -
+         reinterpret_cast<const char *>(data);
+}
+
+// A subscription to a state holding a T.
+//
+// Subscribing makes the state exactly sizeof(T) bytes long - or, for a state
+// that already exists, checks that it is. Anything else that must be set up
+// before subscribing (kstate_set_history, kstate_set_persistent and so on)
+// can be done on get().
+template <typename T>
+class State {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "A state's data must be trivially copyable");
+  static_assert(sizeof(T) > 0 && sizeof(T) <= KSTATE_MAX_SIZE,
+                "A state's data must fit in a state");
+
+ public:
+  State() : state_(kstate_new_state()) {}
+  ~State() { kstate_free_state(&state_); }
+
+  State(const State &) = delete;
+  State &operator=(const State &) = delete;
+  State(State &&other) noexcept : state_(other.state_) {
+    other.state_ = nullptr;
+  }
+  State &operator=(State &&other) noexcept {
+    if (this != &other) {
+      kstate_free_state(&state_);
+      state_ = other.state_;
+      other.state_ = nullptr;
+    }
+    return *this;
+  }
+
+  // Subscribe to the state (see kstate_subscribe_state). Returns 0, or a
+  // negative value (-EINVAL if an existing state is not sizeof(T) long).
+  int subscribe(const char *name, uint32_t permissions) {
+    if (state_ == nullptr)
+      return -ENOMEM;
+    int rv = kstate_set_size(state_, sizeof(T));
+    if (rv == 0)
+      rv = kstate_subscribe_state(
+          state_, name, static_cast<kstate_permissions_t>(permissions));
+    return rv;
+  }
+
+  void unsubscribe() { kstate_unsubscribe_state(state_); }
+  bool subscribed() const { return kstate_state_is_subscribed(state_); }
+
+  // The underlying state, for anything else the C API offers
+  kstate_state_p get() const { return state_; }
+
+  // The current version of the data, which may change under our feet at
+  // any time (see kstate_get_state_ptr). Use a transaction, or load(), to
+  // see a consistent version.
+  const T *ptr() const {
+    return static_cast<const T *>(kstate_get_state_ptr(state_));
+  }
+
+  // Return a consistent copy of the current version, without pinning it
+  // (see kstate_read_begin). If the state is not subscribed, this is a T
+  // that is all zeroes.
+  T load() const {
+    T copy;
+    uint64_t token;
+    do {
+      const void *data = kstate_read_begin(state_, &token);
+      if (data == nullptr) {
+        std::memset(&copy, 0, sizeof(copy));
+        break;
+      }
+      std::memcpy(&copy, data, sizeof(copy));
+    } while (kstate_read_retry(state_, token));
+    return copy;
+  }
+
+  uint32_t changes() const { return kstate_get_state_changes(state_); }
+  int wait_for_change(uint32_t changes, int timeout_ms = -1) const {
+    return kstate_wait_for_state_change(state_, changes, timeout_ms);
+  }
+
+ private:
+  kstate_state_p state_;
+};
+
+// A transaction on a State<T>, which is aborted when it goes out of scope,
+// unless it has already been committed or aborted.
+//
+// All it holds is the C transaction, which comes from the per-thread cache
+// that kstate_new_transaction keeps, so starting one is no more expensive
+// than using the C functions directly. It may not be copied, but may be
+// moved.
+template <typename T>
+class Transaction {
+ public:
+  // 0 if the transaction was started, or why it wasn't
+  int error() const { return error_; }
+  explicit operator bool() const { return error_ == 0 && active(); }
+  bool active() const { return kstate_transaction_is_active(transaction_); }
+
+  const T *operator->() const { return data(); }
+  const T &operator*() const { return *data(); }
+
+  int abort() { return kstate_abort_transaction(transaction_); }
+
+  // The underlying transaction, for anything else the C API offers
+  kstate_transaction_p get() const { return transaction_; }
+
+  Transaction(const Transaction &) = delete;
+  Transaction &operator=(const Transaction &) = delete;
+
+ protected:
+  Transaction(const State<T> &state, uint32_t permissions)
+    : transaction_(kstate_new_transaction()), error_(0) {
+    if (transaction_ == nullptr)
+      error_ = -ENOMEM;
+    else
+      error_ = kstate_start_transaction(transaction_, state.get(), permissions);
+  }
+  Transaction(Transaction &&other) noexcept
+    : transaction_(other.transaction_), error_(other.error_) {
+    other.transaction_ = nullptr;
+    other.error_ = -EINVAL;
+  }
+  // Freeing a transaction aborts it, if it's still active
+  ~Transaction() { kstate_free_transaction(&transaction_); }
+
+  T *data() const {
+    return static_cast<T *>(kstate_get_transaction_ptr(transaction_));
+  }
+
+  kstate_transaction_p transaction_;
+  int error_;
+};
+
+// A read transaction, which looks at the version that was current when it
+// started, for as long as it lasts.
+template <typename T>
+class ReadTransaction : public Transaction<T> {
+ public:
+  explicit ReadTransaction(const State<T> &state)
+    : Transaction<T>(state, KSTATE_READ) {}
+  ReadTransaction(ReadTransaction &&other) noexcept
+    : Transaction<T>(std::move(other)) {}
+};
+
+// A write transaction.
+//
+// Writing a field with set() or modify() marks just that field as dirty (see
+// kstate_transaction_mark_dirty), so committing only compares what was
+// written. Writing through data() marks nothing, and if nothing at all is
+// marked, committing compares the whole state - but once anything has been
+// marked, anything written through data() must be marked with mark_dirty()
+// as well, or it may not be committed.
+//
+// A transaction that didn't start has no data to write to, so set() returns
+// -EINVAL for one, and modify() and data() must not be used on it.
+template <typename T>
+class WriteTransaction : public Transaction<T> {
+ public:
+  // 'permissions' may add KSTATE_LAZY to KSTATE_WRITE
+  explicit WriteTransaction(const State<T> &state,
+                            uint32_t permissions = KSTATE_WRITE)
+    : Transaction<T>(state, permissions | KSTATE_WRITE) {}
+  WriteTransaction(WriteTransaction &&other) noexcept
+    : Transaction<T>(std::move(other)) {}
+
+  // Returns 0, or -EINVAL if the transaction isn't active
+  template <typename F>
+  int set(F T::*field, const F &value) {
+    if (!*this)
+      return -EINVAL;
+    modify(field) = value;
+    return 0;
+  }
+
+  template <typename F>
+  F &modify(F T::*field) {
+    assert(*this);
+    T *ptr = this->data();
+    (void) kstate_transaction_mark_dirty(this->transaction_,
+                                         offset_of(ptr, field), sizeof(F));
+    return ptr->*field;
+  }
+
+  T *data() const { return Transaction<T>::data(); }
+
+  int mark_dirty(size_t offset, size_t length) {
+    return kstate_transaction_mark_dirty(this->transaction_, offset, length);
+  }
+
+  int commit() { return kstate_commit_transaction(this->transaction_); }
+};
+
+}  // namespace kstate
+
+#endif /* _KSTATE_HPP_INCLUDED_ */
+
+// vim: set tabstop=8 softtabstop=2 shiftwidth=2 expandtab:
+//
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End: